@@ -0,0 +1,212 @@
+#include"../src/common.h"
+
+// Times editor_highlight_line() against the lexer it replaced, which tried
+// every keyword with a strncmp() at each token start, on the same lines
+// under the C, JavaScript and CSS syntaxes.
+//
+//     make highlight-bench
+//     ./highlight_bench [file...]
+//
+// The files default to this repo's src/*.c and src/*.h, read from the
+// working directory. Each run goes over every line five times and reports
+// lines per second.
+
+#define BENCH_PASSES 5
+
+static long long bench_clock_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static EditorLine *bench_lines = NULL;
+static int bench_num_lines = 0;
+static int bench_lines_cap = 0;
+
+static void bench_read_file(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return;
+    char *text = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&text, &cap, fp)) != -1) {
+        while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) len--;
+        if (bench_num_lines == bench_lines_cap) {
+            bench_lines_cap = bench_lines_cap ? bench_lines_cap * 2 : 4096;
+            bench_lines = realloc(bench_lines, bench_lines_cap * sizeof(EditorLine));
+            if (bench_lines == NULL) exit(1);
+        }
+        EditorLine *line = &bench_lines[bench_num_lines++];
+        memset(line, 0, sizeof(EditorLine));
+        line->text = strndup(text, len);
+        line->len = len;
+    }
+    free(text);
+    fclose(fp);
+}
+
+static unsigned char *old_hl = NULL;
+static size_t old_hl_cap = 0;
+
+static int line_matches_at(EditorLine *line, size_t i, const char *s, size_t slen) {
+    return i + slen <= line->len && memcmp(&line->text[i], s, slen) == 0;
+}
+
+// editor_highlight_line() before keywords were hashed, painting a byte per
+// character into a buffer of its own.
+static int old_highlight_line(EditorLine *line, int in_multiline_comment) {
+    if (line->len > old_hl_cap) {
+        old_hl_cap = line->len * 2;
+        old_hl = realloc(old_hl, old_hl_cap);
+        if (old_hl == NULL) exit(1);
+    }
+    unsigned char *hl = old_hl;
+    memset(hl, HL_NORMAL, line->len);
+
+    char **keywords1 = E_syntax->keywords1;
+    char **keywords2 = E_syntax->keywords2;
+    char *sc_start = E_syntax->singleline_comment_start;
+    char *mc_start = E_syntax->multiline_comment_start;
+    char *mc_end = E_syntax->multiline_comment_end;
+
+    int prev_sep = 1;
+    int in_string = 0;
+
+    size_t i = 0;
+    while (i < line->len) {
+        char c = line->text[i];
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
+        if (mc_start && mc_end) {
+            if (in_multiline_comment) {
+                hl[i] = HL_COMMENT;
+                if (line_matches_at(line, i, mc_end, strlen(mc_end))) {
+                    for (size_t j = 0; j < strlen(mc_end); j++) hl[i + j] = HL_COMMENT;
+                    i += strlen(mc_end);
+                    in_multiline_comment = 0;
+                    prev_sep = 1;
+                    continue;
+                }
+                i++;
+                continue;
+            } else if (line_matches_at(line, i, mc_start, strlen(mc_start))) {
+                for (size_t j = 0; j < strlen(mc_start); j++) hl[i + j] = HL_COMMENT;
+                i += strlen(mc_start);
+                in_multiline_comment = 1;
+                continue;
+            }
+        }
+
+        if (sc_start && line_matches_at(line, i, sc_start, strlen(sc_start))) {
+            for (size_t j = i; j < line->len; j++) hl[j] = HL_COMMENT;
+            break;
+        }
+
+        if (in_string) {
+            hl[i] = HL_STRING;
+            if (c == '\\' && i + 1 < line->len) {
+                hl[i + 1] = HL_STRING;
+                i += 2;
+                continue;
+            }
+            if (c == in_string) in_string = 0;
+            i++;
+            prev_sep = 0;
+            continue;
+        } else if (c == '"' || c == '\'') {
+            in_string = c;
+            hl[i] = HL_STRING;
+            i++;
+            prev_sep = 0;
+            continue;
+        }
+
+        if (isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) {
+            hl[i] = HL_NUMBER;
+            i++;
+            prev_sep = 0;
+            continue;
+        }
+
+        if (i == 0 && c == '#') {
+            for (size_t j = 0; j < line->len; j++) hl[j] = HL_PREPROC;
+            break;
+        }
+
+        if (prev_sep) {
+            for (size_t k = 0; keywords1[k]; k++) {
+                size_t kwlen = strlen(keywords1[k]);
+                if (line_matches_at(line, i, keywords1[k], kwlen) &&
+                    (i + kwlen == line->len || is_separator(line->text[i + kwlen]))) {
+                    for (size_t j = 0; j < kwlen; j++) hl[i + j] = HL_KEYWORD1;
+                    i += kwlen;
+                    prev_sep = 0;
+                    goto next_char;
+                }
+            }
+            for (size_t k = 0; keywords2[k]; k++) {
+                size_t kwlen = strlen(keywords2[k]);
+                if (line_matches_at(line, i, keywords2[k], kwlen) &&
+                    (i + kwlen == line->len || is_separator(line->text[i + kwlen]))) {
+                    for (size_t j = 0; j < kwlen; j++) hl[i + j] = HL_KEYWORD2;
+                    i += kwlen;
+                    prev_sep = 0;
+                    goto next_char;
+                }
+            }
+        }
+
+        prev_sep = is_separator(c);
+        i++;
+        next_char:;
+    }
+    return in_multiline_comment;
+}
+
+static double bench_run(int (*highlight)(EditorLine *line, int in_state)) {
+    long long start = bench_clock_us();
+    for (int pass = 0; pass < BENCH_PASSES; pass++) {
+        int state = 0;
+        for (int i = 0; i < bench_num_lines; i++) state = highlight(&bench_lines[i], state);
+    }
+    long long elapsed = bench_clock_us() - start;
+    return (double)bench_num_lines * BENCH_PASSES * 1000000.0 / (elapsed > 0 ? elapsed : 1);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) bench_read_file(argv[i]);
+    } else {
+        DIR *dir = opendir("src");
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            if (len > 2 && entry->d_name[len - 2] == '.' && (entry->d_name[len - 1] == 'c' || entry->d_name[len - 1] == 'h')) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "src/%s", entry->d_name);
+                bench_read_file(path);
+            }
+        }
+        if (dir) closedir(dir);
+    }
+    if (bench_num_lines == 0) {
+        fprintf(stderr, "usage: %s [file...] (run from the repo root for the default corpus)\n", argv[0]);
+        return 1;
+    }
+
+    // Only the built-in syntaxes, not whatever is in ~/.nimki/syntax/.
+    setenv("HOME", "/nonexistent", 1);
+    printf("%d lines, %d passes, lines per second\n", bench_num_lines, BENCH_PASSES);
+
+    const char *files[] = { "bench.c", "bench.js", "bench.css" };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        E.filename = (char *)files[i];
+        editor_select_syntax_highlight();
+        double before = bench_run(old_highlight_line);
+        double after = bench_run(editor_highlight_line);
+        printf("  %-4s strncmp per keyword %10.0f   editor_highlight_line %10.0f   %.2fx\n",
+               strrchr(files[i], '.') + 1, before, after, after / before);
+    }
+    E.filename = NULL;
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include"../src/common.h"
+
+// Times a full walk of a directory tree three ways: readdir() with a stat()
+// per entry on one thread, the way the file tree used to load, and
+// scan_tree_run() on one thread and on every core. Without an existing
+// tree it builds a synthetic one first: 100 directories of 100
+// subdirectories, with the files spread evenly across them.
+//
+//     make scan-bench
+//     ./scan_bench [dir] [files]
+//
+// dir defaults to /tmp/nimki-scan-bench and files to 1000000. Each walk
+// runs twice and the second, warm-cache time is reported.
+
+static long long bench_clock_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bench_make_tree(const char *root, long files) {
+    if (mkdir(root, 0755) == -1) return -1;
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+    if (root_fd == -1) return -1;
+
+    long made = 0;
+    char name[32];
+    for (int top = 0; top < 100; top++) {
+        snprintf(name, sizeof(name), "d%02d", top);
+        mkdirat(root_fd, name, 0755);
+        int top_fd = openat(root_fd, name, O_RDONLY | O_DIRECTORY);
+        if (top_fd == -1) return -1;
+        for (int sub = 0; sub < 100; sub++) {
+            snprintf(name, sizeof(name), "s%02d", sub);
+            mkdirat(top_fd, name, 0755);
+            int sub_fd = openat(top_fd, name, O_RDONLY | O_DIRECTORY);
+            if (sub_fd == -1) return -1;
+            long here = (files - made) / (10000 - (top * 100 + sub));
+            for (long i = 0; i < here; i++) {
+                snprintf(name, sizeof(name), "file%ld.txt", i);
+                int fd = openat(sub_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd != -1) close(fd);
+            }
+            made += here;
+            close(sub_fd);
+        }
+        close(top_fd);
+        fprintf(stderr, "\rcreating %s: %ld files", root, made);
+    }
+    fprintf(stderr, "\n");
+    close(root_fd);
+    return 0;
+}
+
+static long bench_count;
+
+// The walk load_directory_tree() used to do, minus building nodes.
+static void bench_walk_stat(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (stat(child, &st) == -1) continue;
+        if (S_ISDIR(st.st_mode)) {
+            bench_walk_stat(child);
+        } else {
+            bench_count++;
+        }
+    }
+    closedir(dir);
+}
+
+static void bench_visit(const char *path, size_t path_len, void *data) {
+    (void)path;
+    (void)path_len;
+    __atomic_add_fetch((long *)data, 1, __ATOMIC_RELAXED);
+}
+
+static void bench_report(const char *label, long files, long long us) {
+    printf("%-32s %9ld files %9.1f ms %10.0f files/s\n", label, files, us / 1000.0, us > 0 ? files * 1e6 / us : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    const char *root = argc > 1 ? argv[1] : "/tmp/nimki-scan-bench";
+    long files = argc > 2 ? atol(argv[2]) : 1000000;
+
+    struct stat st;
+    if (stat(root, &st) == -1 && bench_make_tree(root, files) == -1) {
+        fprintf(stderr, "cannot create %s: %s\n", root, strerror(errno));
+        return 1;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) cores = 1;
+    long long start = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        bench_count = 0;
+        start = bench_clock_us();
+        bench_walk_stat(root);
+    }
+    bench_report("readdir + stat, 1 thread", bench_count, bench_clock_us() - start);
+
+    int thread_counts[2] = {1, (int)cores};
+    for (int i = 0; i < (cores > 1 ? 2 : 1); i++) {
+        long count = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            count = 0;
+            start = bench_clock_us();
+            scan_tree_run(root, thread_counts[i], false, bench_visit, &count);
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "getdents64 scan, %d thread%s", thread_counts[i], thread_counts[i] == 1 ? "" : "s");
+        bench_report(label, count, bench_clock_us() - start);
+    }
+    return 0;
+}
@@ -0,0 +1,414 @@
+#include"common.h"
+
+extern EditorConfig E;
+
+// The document is a treap of line blocks keyed implicitly by line number.
+// Each node holds up to BUFFER_BLOCK_LINES consecutive lines and the line
+// count of its subtree, so lookup, line insert, line delete and range delete
+// are O(log n) in the number of blocks. Edits that fit inside one block are
+// done in place; everything else is a split/merge.
+#define BUFFER_BLOCK_LINES 64
+
+struct BufferNode {
+    struct BufferNode *left;
+    struct BufferNode *right;
+    unsigned int priority;
+    int count;
+    int total;
+    EditorLine lines[BUFFER_BLOCK_LINES];
+};
+
+// Last block returned by buffer_line(), so sequential scans only descend the
+// tree once per block. Any structural change invalidates it.
+static BufferNode *cache_node = NULL;
+static int cache_start = 0;
+
+static unsigned int priority_state = 2463534242u;
+
+// Source of EditorLine text and hl versions. Only advanced with the buffer
+// lock held.
+static unsigned int version_counter = 0;
+// Advanced by every change that can alter or move text already in the
+// buffer, so caches of positions in it can tell they are stale. Appending
+// lines at the end, as the indexer does, leaves it alone.
+static unsigned int edit_counter = 0;
+
+// Guards the tree against the background indexer. The UI thread holds it
+// whenever it is not waiting for input; the indexer takes it only to append
+// a finished batch and then signals buffer_grown_cond.
+static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buffer_grown_cond = PTHREAD_COND_INITIALIZER;
+// Threads blocked in buffer_lock(), so a background job that works under
+// the lock can step aside for them between chunks.
+static int lock_waiters = 0;
+
+EditorLine *buffer_line(int row);
+int buffer_insert_lines(int at, EditorLine *lines, int count);
+int buffer_insert_line(int at, const char *text, size_t len);
+void buffer_delete_lines(int at, int count);
+void buffer_clear();
+int buffer_line_own(EditorLine *line);
+void buffer_lock();
+void buffer_unlock();
+void buffer_yield();
+void buffer_wait_grown();
+void buffer_signal_grown();
+unsigned int buffer_next_version();
+void buffer_line_changed(EditorLine *line);
+unsigned int buffer_edit_version();
+
+static unsigned int buffer_next_priority() {
+    priority_state ^= priority_state << 13;
+    priority_state ^= priority_state >> 17;
+    priority_state ^= priority_state << 5;
+    return priority_state;
+}
+
+static int node_total(BufferNode *node) {
+    return node ? node->total : 0;
+}
+
+static void node_update(BufferNode *node) {
+    node->total = node_total(node->left) + node->count + node_total(node->right);
+}
+
+static BufferNode *node_new(unsigned int priority) {
+    BufferNode *node = malloc(sizeof(BufferNode));
+    if (node == NULL) return NULL;
+    node->left = NULL;
+    node->right = NULL;
+    node->priority = priority;
+    node->count = 0;
+    node->total = 0;
+    return node;
+}
+
+static void node_free_lines(BufferNode *node, int from, int to) {
+    for (int i = from; i < to; i++) {
+        if (!node->lines[i].mapped) free(node->lines[i].text);
+        node->lines[i].text = NULL;
+        editor_free_hl(node->lines[i].hl);
+        node->lines[i].hl = NULL;
+    }
+}
+
+static void node_free_tree(BufferNode *node) {
+    if (!node) return;
+    node_free_tree(node->left);
+    node_free_tree(node->right);
+    node_free_lines(node, 0, node->count);
+    free(node);
+}
+
+static BufferNode *node_merge(BufferNode *a, BufferNode *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->priority >= b->priority) {
+        a->right = node_merge(a->right, b);
+        node_update(a);
+        return a;
+    }
+    b->left = node_merge(a, b->left);
+    node_update(b);
+    return b;
+}
+
+// Splits `node` so the first `k` lines end up in *left and the rest in
+// *right. A block straddling the split point is cut in two using `*spare`,
+// which is allocated up front so a split never fails halfway; the new half
+// keeps the same priority so the heap order still holds.
+static void node_split(BufferNode *node, int k, BufferNode **left, BufferNode **right, BufferNode **spare) {
+    if (!node) {
+        *left = NULL;
+        *right = NULL;
+        return;
+    }
+
+    int left_total = node_total(node->left);
+    if (k <= left_total) {
+        BufferNode *sub_right;
+        node_split(node->left, k, left, &sub_right, spare);
+        node->left = sub_right;
+        node_update(node);
+        *right = node;
+        return;
+    }
+    if (k >= left_total + node->count) {
+        BufferNode *sub_left;
+        node_split(node->right, k - left_total - node->count, &sub_left, right, spare);
+        node->right = sub_left;
+        node_update(node);
+        *left = node;
+        return;
+    }
+
+    int offset = k - left_total;
+    BufferNode *tail = *spare;
+    *spare = NULL;
+    tail->left = NULL;
+    tail->priority = node->priority;
+    tail->count = node->count - offset;
+    memcpy(tail->lines, &node->lines[offset], tail->count * sizeof(EditorLine));
+    tail->right = node->right;
+    node->count = offset;
+    node->right = NULL;
+    node_update(node);
+    node_update(tail);
+    *left = node;
+    *right = tail;
+}
+
+// Frees block nodes without touching the lines they hold.
+static void node_free_blocks(BufferNode *node) {
+    if (!node) return;
+    node_free_blocks(node->left);
+    node_free_blocks(node->right);
+    free(node);
+}
+
+// Inserts into an existing block when there is room, fixing up subtree
+// totals on the way back. Returns 0 when the caller has to split instead.
+static int node_insert_in_place(BufferNode *node, int at, const EditorLine *lines, int count) {
+    if (!node) return 0;
+
+    int left_total = node_total(node->left);
+    int inserted;
+    if (at < left_total) {
+        inserted = node_insert_in_place(node->left, at, lines, count);
+    } else if (at <= left_total + node->count) {
+        if (node->count + count > BUFFER_BLOCK_LINES) return 0;
+        int offset = at - left_total;
+        memmove(&node->lines[offset + count], &node->lines[offset], (node->count - offset) * sizeof(EditorLine));
+        memcpy(&node->lines[offset], lines, count * sizeof(EditorLine));
+        node->count += count;
+        inserted = 1;
+    } else {
+        inserted = node_insert_in_place(node->right, at - left_total - node->count, lines, count);
+    }
+
+    if (inserted) node->total += count;
+    return inserted;
+}
+
+// Deletes lines that all live in one block and leave it non-empty.
+static int node_delete_in_place(BufferNode *node, int at, int count) {
+    if (!node) return 0;
+
+    int left_total = node_total(node->left);
+    int deleted;
+    if (at < left_total) {
+        deleted = node_delete_in_place(node->left, at, count);
+    } else if (at < left_total + node->count) {
+        int offset = at - left_total;
+        if (offset + count > node->count || count >= node->count) return 0;
+        node_free_lines(node, offset, offset + count);
+        memmove(&node->lines[offset], &node->lines[offset + count], (node->count - offset - count) * sizeof(EditorLine));
+        node->count -= count;
+        deleted = 1;
+    } else {
+        deleted = node_delete_in_place(node->right, at - left_total - node->count, count);
+    }
+
+    if (deleted) node->total -= count;
+    return deleted;
+}
+
+EditorLine *buffer_line(int row) {
+    if (row < 0 || row >= E.num_lines) return NULL;
+
+    if (cache_node && row >= cache_start && row < cache_start + cache_node->count) {
+        return &cache_node->lines[row - cache_start];
+    }
+
+    BufferNode *node = E.buffer;
+    int start = 0;
+    while (node) {
+        int left_total = node_total(node->left);
+        if (row < start + left_total) {
+            node = node->left;
+        } else if (row < start + left_total + node->count) {
+            cache_node = node;
+            cache_start = start + left_total;
+            return &node->lines[row - cache_start];
+        } else {
+            start += left_total + node->count;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+// Takes ownership of `lines` (their text and hl); the array itself stays
+// with the caller.
+int buffer_insert_lines(int at, EditorLine *lines, int count) {
+    if (count <= 0) return 0;
+    if (at < 0) at = 0;
+    if (at > E.num_lines) at = E.num_lines;
+
+    cache_node = NULL;
+    if (at < E.num_lines) edit_counter++;
+    for (int k = 0; k < count; k++) {
+        lines[k].text_version = buffer_next_version();
+        lines[k].hl_version = 0;
+    }
+
+    if (count <= BUFFER_BLOCK_LINES && node_insert_in_place(E.buffer, at, lines, count)) {
+        E.num_lines += count;
+        return 0;
+    }
+
+    BufferNode *spare = node_new(0);
+    if (spare == NULL) {
+        editor_set_status_message("Error: Out of memory for buffer block.");
+        return -1;
+    }
+
+    BufferNode *middle = NULL;
+    for (int done = 0; done < count; ) {
+        BufferNode *node = node_new(buffer_next_priority());
+        if (node == NULL) {
+            node_free_blocks(middle);
+            free(spare);
+            editor_set_status_message("Error: Out of memory for buffer block.");
+            return -1;
+        }
+        node->count = count - done < BUFFER_BLOCK_LINES ? count - done : BUFFER_BLOCK_LINES;
+        memcpy(node->lines, &lines[done], node->count * sizeof(EditorLine));
+        node_update(node);
+        middle = node_merge(middle, node);
+        done += node->count;
+    }
+
+    BufferNode *left, *right;
+    node_split(E.buffer, at, &left, &right, &spare);
+    free(spare);
+    E.buffer = node_merge(node_merge(left, middle), right);
+    E.num_lines += count;
+    return 0;
+}
+
+int buffer_insert_line(int at, const char *text, size_t len) {
+    EditorLine line;
+    line.text = malloc(len + 1);
+    if (line.text == NULL) {
+        editor_set_status_message("Error: Out of memory for line text.");
+        return -1;
+    }
+    memcpy(line.text, text, len);
+    line.text[len] = '\0';
+    line.len = len;
+    line.hl = NULL;
+    line.hl_open_comment = 0;
+    line.mapped = false;
+
+    if (buffer_insert_lines(at, &line, 1) == -1) {
+        free(line.text);
+        return -1;
+    }
+    return 0;
+}
+
+void buffer_delete_lines(int at, int count) {
+    if (at < 0 || count <= 0 || at >= E.num_lines) return;
+    if (at + count > E.num_lines) count = E.num_lines - at;
+
+    cache_node = NULL;
+    edit_counter++;
+
+    if (node_delete_in_place(E.buffer, at, count)) {
+        E.num_lines -= count;
+        return;
+    }
+
+    BufferNode *spare_left = node_new(0);
+    BufferNode *spare_right = node_new(0);
+    if (spare_left == NULL || spare_right == NULL) {
+        free(spare_left);
+        free(spare_right);
+        editor_set_status_message("Error: Out of memory splitting buffer block.");
+        return;
+    }
+
+    BufferNode *left, *rest, *middle, *right;
+    node_split(E.buffer, at, &left, &rest, &spare_left);
+    node_split(rest, count, &middle, &right, &spare_right);
+    free(spare_left);
+    free(spare_right);
+    node_free_tree(middle);
+    E.buffer = node_merge(left, right);
+    E.num_lines -= count;
+}
+
+// Releases every line and, once nothing points into it any more, the file
+// mapping they were loaded from.
+void buffer_clear() {
+    node_free_tree(E.buffer);
+    E.buffer = NULL;
+    E.num_lines = 0;
+    cache_node = NULL;
+    edit_counter++;
+
+    if (E.map_data) {
+        munmap(E.map_data, E.map_size);
+        E.map_data = NULL;
+        E.map_size = 0;
+    }
+}
+
+void buffer_lock() {
+    __atomic_add_fetch(&lock_waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&buffer_mutex);
+    __atomic_sub_fetch(&lock_waiters, 1, __ATOMIC_RELAXED);
+}
+
+void buffer_unlock() {
+    pthread_mutex_unlock(&buffer_mutex);
+}
+
+// Drops and retakes the lock, letting anyone already waiting for it go
+// first. The mutex is not fair, so a job that just unlocked would otherwise
+// usually win it straight back from the UI thread.
+void buffer_yield() {
+    pthread_mutex_unlock(&buffer_mutex);
+    while (__atomic_load_n(&lock_waiters, __ATOMIC_RELAXED) > 0) sched_yield();
+    buffer_lock();
+}
+
+// Sleeps until the indexer appends more lines. The caller holds the lock.
+void buffer_wait_grown() {
+    pthread_cond_wait(&buffer_grown_cond, &buffer_mutex);
+}
+
+void buffer_signal_grown() {
+    pthread_cond_broadcast(&buffer_grown_cond);
+}
+
+unsigned int buffer_next_version() {
+    return ++version_counter;
+}
+
+// Stamps a line whose text was edited in place.
+void buffer_line_changed(EditorLine *line) {
+    line->text_version = buffer_next_version();
+    edit_counter++;
+}
+
+unsigned int buffer_edit_version() {
+    return edit_counter;
+}
+
+// Copies a mapped line into the heap so it can be edited in place.
+int buffer_line_own(EditorLine *line) {
+    if (!line->mapped) return 0;
+
+    char *text = malloc(line->len + 1);
+    if (text == NULL) {
+        editor_set_status_message("Error: Out of memory copying mapped line.");
+        return -1;
+    }
+    memcpy(text, line->text, line->len);
+    text[line->len] = '\0';
+    line->text = text;
+    line->mapped = false;
+    return 0;
+}
@@ -20,58 +20,26 @@ void editor_copy_selection_to_clipboard() {
         sel_max_cy = temp_cy;
         sel_max_cx = temp_cx;
     }
-    size_t total_len = 0;
-    for (int r = sel_min_cy; r <= sel_max_cy; r++) {
-        if (r < 0 || r >= E.num_lines) continue;
-
-        EditorLine *line = &E.lines[r];
-        int start_col = (r == sel_min_cy) ? sel_min_cx : 0;
-        int end_col = (r == sel_max_cy) ? sel_max_cx : (int)line->len;
-
-        if (end_col > (int)line->len) end_col = (int)line->len;
-        if (start_col < 0) start_col = 0;
-
-        if (end_col > start_col) {
-            total_len += (size_t)(end_col - start_col);
-        }
-        if (r < sel_max_cy) {
-            total_len += 1;
-        }
+    if (sel_max_cy >= E.num_lines) {
+        sel_max_cy = E.num_lines - 1;
+        sel_max_cx = (int)buffer_line(sel_max_cy)->len;
     }
-
-    if (total_len == 0) {
-        editor_set_status_message("No text selected to copy.");
-        return;
+    if (sel_min_cy < 0) {
+        sel_min_cy = 0;
+        sel_min_cx = 0;
     }
 
-    char *selected_text = malloc(total_len + 1);
+    size_t current_offset = 0;
+    char *selected_text = editor_get_text(sel_min_cy, sel_min_cx, sel_max_cy, sel_max_cx, &current_offset);
     if (selected_text == NULL) {
         editor_set_status_message("Copy error: Out of memory for selected text.");
         return;
     }
-    selected_text[0] = '\0';
-    size_t current_offset = 0;
-
-    for (int r = sel_min_cy; r <= sel_max_cy; r++) {
-        if (r < 0 || r >= E.num_lines) continue;
-
-        EditorLine *line = &E.lines[r];
-        int start_col = (r == sel_min_cy) ? sel_min_cx : 0;
-        int end_col = (r == sel_max_cy) ? sel_max_cx : (int)line->len;
-
-        if (end_col > (int)line->len) end_col = (int)line->len;
-        if (start_col < 0) start_col = 0;
-
-        if (end_col > start_col) {
-            size_t segment_len = (size_t)(end_col - start_col);
-            memcpy(selected_text + current_offset, line->text + start_col, segment_len);
-            current_offset += segment_len;
-        }
-        if (r < sel_max_cy) {
-            selected_text[current_offset++] = '\n';
-        }
+    if (current_offset == 0) {
+        free(selected_text);
+        editor_set_status_message("No text selected to copy.");
+        return;
     }
-    selected_text[current_offset] = '\0';
 
     int pipefd[2];
     pid_t pid;
@@ -202,9 +170,6 @@ void editor_copy_selection_to_clipboard() {
     free(selected_text);
     selected_text = NULL;
     E.selection_active = false;
-    for (int i = 0; i < E.num_lines; i++) {
-        editor_update_syntax(i);
-    }
     editor_refresh_screen();
 }
 
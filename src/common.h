@@ -19,16 +19,26 @@
 #include<dirent.h>
 #include<sys/stat.h>
 #include<limits.h>
+#include<sys/mman.h>
+#include<fcntl.h>
+#include<pthread.h>
 
 #define EDITOR_VERSION "0.1.4"
 #define TAB_STOP 4
 
 #define CTRL(k) ((k) & 0x1f)
 
+// Key code curses returns for the ESC[200~ that opens a bracketed paste.
+#define KEY_PASTE_BEGIN (KEY_MAX + 1)
+
 #define MAX_UNDO_STATES 20
 
 #define FILE_TREE_WIDTH 30
 
+// Files at least this large are mmap'd and their lines kept as views into
+// the mapping instead of being copied into the heap.
+#define MMAP_THRESHOLD (16 * 1024 * 1024)
+
 enum EditorHighlight {
     HL_NORMAL = 0,
     HL_COMMENT,
@@ -41,6 +51,77 @@ enum EditorHighlight {
     HL_SELECTION
 };
 
+#define GRAMMAR_MAX_REGIONS 15
+#define GRAMMAR_MAX_DELIM 16
+#define GRAMMAR_MAX_EXTENSIONS 8
+
+enum GrammarRegionFlags {
+    REGION_MULTILINE = 1,
+    REGION_NESTED = 2
+};
+
+// What a byte may do to the scanner, as looked up in Grammar's action tables.
+enum GrammarAction {
+    GRAMMAR_SEPARATOR = 1,
+    GRAMMAR_DIGIT = 2,
+    GRAMMAR_LINE_COMMENT = 4,
+    GRAMMAR_PREPROC = 8,
+    GRAMMAR_OPEN = 16,
+    GRAMMAR_CLOSE = 32,
+    GRAMMAR_ESCAPE = 64,
+    GRAMMAR_NEST = 128
+};
+
+// A delimited span such as a string or block comment, painted in `hl`.
+typedef struct {
+    unsigned char hl;
+    unsigned char flags;
+    unsigned char escape;
+    unsigned char open_len, close_len;
+    char open[GRAMMAR_MAX_DELIM];
+    char close[GRAMMAR_MAX_DELIM];
+} GrammarRegion;
+
+typedef struct {
+    unsigned int offset;
+    unsigned short len;
+    unsigned char hl;
+    unsigned short order;
+} GrammarKeyword;
+
+// A language compiled for the table-driven scanner in syntax.c, either from
+// a built-in EditorSyntax or from a file in ~/.nimki/syntax/, see grammar.c.
+// Everything but the three trailing arrays is flat so it can be cached as is.
+typedef struct {
+    char name[32];
+    char extensions[GRAMMAR_MAX_EXTENSIONS][16];
+    int num_extensions;
+    char line_comment[GRAMMAR_MAX_DELIM];
+    unsigned char line_comment_len;
+    unsigned char preproc;
+    bool numbers;
+    int num_regions;
+    GrammarRegion regions[GRAMMAR_MAX_REGIONS];
+
+    // Per-byte actions outside any region and inside each region.
+    unsigned char code_action[256];
+    unsigned char region_action[GRAMMAR_MAX_REGIONS][256];
+    // Regions ordered by first byte of their opener, longest opener first;
+    // open_first[c] is one past the first of them starting with c.
+    unsigned char open_order[GRAMMAR_MAX_REGIONS];
+    unsigned char open_first[256];
+
+    // Keywords without separators, perfectly hashed by (seed, mask), and
+    // the few that contain one, matched in order. Names live in `words`.
+    unsigned int keyword_mask;
+    unsigned int keyword_seed;
+    int num_special;
+    unsigned int words_len;
+    GrammarKeyword *keywords;
+    GrammarKeyword *special;
+    char *words;
+} Grammar;
+
 typedef struct {
     char **filetype_extensions;
     char **keywords1;
@@ -48,25 +129,89 @@ typedef struct {
     char *singleline_comment_start;
     char *multiline_comment_start;
     char *multiline_comment_end;
+    // Compiled from the fields above the first time the syntax is selected.
+    Grammar *grammar;
 } EditorSyntax;
 
+// A run of bytes painted in one highlight class.
+typedef struct {
+    unsigned int start;
+    unsigned int len;
+    unsigned char hl;
+} HlRun;
+
+// A line's highlight as sorted, disjoint runs; bytes outside every run are
+// HL_NORMAL. Lines painted in a single class from start to end share one
+// static instance whose run extends to the end of any line, see syntax.c.
+typedef struct {
+    int num_runs;
+    bool shared;
+    HlRun *runs;
+} HlRuns;
+
 typedef struct {
     char *text;
     size_t len;
-    char *hl;
+    // NULL until the line is first drawn, see editor_syntax_line().
+    HlRuns *hl;
+    // Scanner state at the end of the line: 0, or the region left open
+    // there and its nesting depth, see syntax.c.
     int hl_open_comment;
+    // Stamped from buffer_next_version() whenever the text or the hl runs
+    // change, so no two line states share a version; see editor_draw_rows().
+    unsigned int text_version;
+    unsigned int hl_version;
+    // text points into E.map_data and is not NUL-terminated; call
+    // buffer_line_own() before modifying it.
+    bool mapped;
 } EditorLine;
 
+enum UndoOpType {
+    UNDO_INSERT = 0,
+    UNDO_DELETE,
+    UNDO_REPLACE
+};
+
+// One inserted or deleted span. `text` may contain '\n' for spans that
+// cross line boundaries; (row, col) is where the span starts. An
+// UNDO_REPLACE op is a whole batch of replacements instead, packed by
+// replace.c; (row, col) is its first match.
 typedef struct {
-    EditorLine *lines;
-    int num_lines;
+    int type;
+    int row, col;
+    char *text;
+    size_t len;
+} UndoOp;
+
+// Everything one keystroke (or one bulk command) changed, replayed in
+// reverse by editor_undo().
+typedef struct {
+    UndoOp *ops;
+    int num_ops;
     int cx, cy;
-    int dirty;
-} EditorStateSnapshot;
+} UndoRecord;
+
+// Half-open run of lines whose highlight must be recomputed, see syntax.c.
+typedef struct {
+    int start, end;
+} HlRange;
+
+// Line storage, see buffer.c. Only reachable through the buffer_* API.
+typedef struct BufferNode BufferNode;
 
 typedef struct {
-    EditorLine *lines;
+    BufferNode *buffer;
     int num_lines;
+    char *map_data;
+    size_t map_size;
+    // Set while the background indexer is still appending lines; both are
+    // only touched with the buffer lock held.
+    bool indexing;
+    bool index_cancel;
+    int hl_frontier;
+    HlRange *hl_dirty;
+    int hl_dirty_count;
+    int hl_dirty_cap;
     int cx, cy;
     int row_offset;
     int col_offset;
@@ -75,9 +220,13 @@ typedef struct {
     int dirty;
     int select_all_active;
 
-    EditorStateSnapshot undo_history[MAX_UNDO_STATES];
+    UndoRecord undo_history[MAX_UNDO_STATES];
     int undo_history_len;
     int undo_history_idx;
+    int undo_saved_idx;
+    // While an input burst is applied, edits join the record it opened.
+    bool undo_grouping;
+    int undo_group_idx;
 
     char *search_query;
     int search_direction;
@@ -89,12 +238,23 @@ typedef struct {
     int selection_start_cy, selection_start_cx;
     int selection_end_cy, selection_end_cx;
 
+    // The find-in-files result list is shown over the text, see grep.c.
+    bool grep_active;
+
     bool context_menu_active;
     int context_menu_x, context_menu_y;
     int context_menu_selected_option;
     bool show_line_numbers;
 
+    // Text rows editor_draw_rows() actually redrew in the last frame.
+    int rows_repainted;
+    // Redraws per second at most, from max_fps in ~/.nimkirc.
+    int max_fps;
+
     bool file_tree_visible;
+    // Whether files .gitignore and friends leave out are listed and
+    // searched anyway, see ignore.c.
+    bool show_ignored;
     int file_tree_cursor;
     int file_tree_offset;
     int file_tree_width;
@@ -102,14 +262,33 @@ typedef struct {
 
 extern EditorConfig E;
 
+typedef struct IgnoreDir IgnoreDir;
+
 typedef struct FileTreeNode {
     char *name;
     char *path;
     bool is_dir;
     bool expanded;
+    // Levels below the root, for indenting.
+    int depth;
     struct FileTreeNode **children;
     int num_children;
     int parent_index;
+    struct FileTreeNode *parent;
+    // Directories are read when first expanded, a page at a time; `dir`
+    // stays open while entries are left, and `more` is the row that pages
+    // them in. A `more` row has is_more set and no children.
+    bool loaded;
+    DIR *dir;
+    struct FileTreeNode *more;
+    bool is_more;
+    // inotify watch descriptor of a loaded directory, or -1.
+    int watch;
+    // Ignore rules for a loaded directory's entries, and whether this entry
+    // is one they leave out; those are hidden and never loaded unless
+    // E.show_ignored is set.
+    IgnoreDir *ignore;
+    bool ignored;
 } FileTreeNode;
 
 typedef struct {
@@ -119,34 +298,155 @@ typedef struct {
     int max_nodes;
 } FileTreeState;
 
+// Background work is queued as jobs of a kind. job_cancel() bumps the
+// kind's generation, which supersedes every job of that kind submitted
+// before it: queued ones never run, and running ones stop at their next
+// job_cancelled() check.
+enum JobKind {
+    JOB_HIGHLIGHT = 0,
+    JOB_SEARCH,
+    JOB_TREE_SCAN,
+    JOB_MATCH_INDEX,
+    JOB_GREP,
+    JOB_KINDS
+};
+
+typedef struct Job {
+    int kind;
+    unsigned int generation;
+    // Runs on a worker thread without the buffer lock.
+    void (*run)(struct Job *job);
+    // Runs on the UI thread with the buffer lock held once the job is over,
+    // or was cancelled, and frees `data`.
+    void (*finish)(struct Job *job, bool cancelled);
+    void *data;
+    struct Job *next;
+} Job;
+
+typedef struct Regex Regex;
+typedef struct ScanTree ScanTree;
+
+// A find query ready to match: a literal needle, or a compiled regular
+// expression when the query is written as /pattern/.
+typedef struct {
+    const char *needle;
+    size_t needle_len;
+    Regex *regex;
+} SearchPattern;
+
 extern FileTreeState FT;
 extern EditorSyntax *E_syntax;
 
 // Function declarations
+EditorLine *buffer_line(int row);
+int buffer_insert_lines(int at, EditorLine *lines, int count);
+int buffer_insert_line(int at, const char *text, size_t len);
+void buffer_delete_lines(int at, int count);
+void buffer_clear();
+int buffer_line_own(EditorLine *line);
+void buffer_lock();
+void buffer_unlock();
+void buffer_yield();
+void buffer_wait_grown();
+void buffer_signal_grown();
+unsigned int buffer_next_version();
+void buffer_line_changed(EditorLine *line);
+unsigned int buffer_edit_version();
+int jobs_init();
+void jobs_shutdown();
+int job_submit(int kind, void (*run)(Job *job), void (*finish)(Job *job, bool cancelled), void *data);
+void job_cancel(int kind);
+bool job_cancelled(Job *job);
+int jobs_worker_count();
+void editor_schedule_highlight();
+const char *search_forward(const char *hay, size_t hay_len, const char *needle, size_t needle_len);
+const char *search_backward(const char *hay, size_t hay_len, const char *needle, size_t needle_len);
+int search_pattern_init(SearchPattern *pattern, const char *query, char *error, size_t error_size);
+void search_pattern_free(SearchPattern *pattern);
+bool search_pattern_match(SearchPattern *pattern, const char *text, size_t len, size_t col, int direction, size_t *match_start, size_t *match_len);
+bool search_buffer(SearchPattern *pattern, int direction, int *row, int *col, int limit, size_t *budget);
+Regex *regex_compile(const char *pattern, size_t len, char *error, size_t error_size);
+void regex_free(Regex *re);
+bool regex_search(Regex *re, const char *text, size_t len, size_t col, int direction, size_t *match_start, size_t *match_len);
+void editor_stop_indexer();
+void editor_wait_for_indexer();
+void editor_wait_for_lines(int row);
+void editor_poll_indexer();
+int editor_read_key();
+int editor_read_key_timeout(int timeout_ms);
+void editor_init_keys();
+int editor_highlight_line(EditorLine *line, int in_multiline_comment);
 void init_editor();
 void cleanup_editor();
 void editor_read_file(const char *filename);
 void editor_save_file();
 void editor_draw_rows();
+void editor_invalidate_screen();
 void editor_refresh_screen();
 void editor_move_cursor(int key);
-void editor_process_keypress();
+void editor_process_keypress(int c);
 void editor_insert_char(int c);
 int editor_insert_newline();
 void editor_del_char();
 void editor_set_status_message(const char *fmt, ...);
 void editor_select_syntax_highlight();
-void editor_update_syntax(int filerow);
+EditorLine *editor_syntax_line(int filerow);
+void editor_invalidate_syntax(int start, int end);
+void editor_syntax_lines_inserted(int at, int count);
+void editor_syntax_lines_deleted(int at, int count);
+void editor_reset_syntax(bool states_known);
+int editor_syntax_line_state(EditorLine *line, int in_multiline_comment);
+void editor_free_hl(HlRuns *hl);
 int is_separator(int c);
-char *editor_prompt(const char *prompt_fmt, ...);
+Grammar *grammar_from_syntax(EditorSyntax *syntax);
+Grammar *grammar_find(const char *ext);
+const GrammarKeyword *grammar_match_keyword(Grammar *grammar, const char *text, size_t len, size_t i);
+void grammar_free(Grammar *grammar);
+char *editor_prompt(const char *prompt, const char *(*callback)(const char *input, int key));
 void paste_from_clipboard();
+void editor_paste_text(const char *text, size_t len);
 void handle_winch(int sig);
+int event_init();
+void event_wake();
+int event_on_signal(int sig, void (*callback)(int sig));
+int event_watch_fd(int fd, void (*callback)(int fd, void *data), void *data);
+void event_unwatch_fd(int fd);
+bool event_wait(int timeout_ms);
+int editor_next_timer_ms();
 void editor_draw_clock();
-void editor_free_snapshot(EditorStateSnapshot *snapshot);
-void editor_save_state();
+void editor_undo_begin();
+void editor_undo_group_begin();
+void editor_undo_group_end();
+void editor_undo_record(int type, int row, int col, const char *text, size_t len);
+void editor_undo_mark_saved();
+void editor_undo_reset();
 void editor_undo();
+int editor_insert_text(int row, int col, const char *text, size_t len, int *end_row, int *end_col);
+char *editor_get_text(int row, int col, int end_row, int end_col, size_t *out_len);
+void editor_delete_text(int row, int col, int end_row, int end_col);
 void editor_find();
 void editor_find_next(int direction);
+void editor_find_report();
+void editor_replace();
+void editor_undo_replace(const UndoOp *op);
+void match_index_update(const char *query);
+void match_index_stop();
+bool match_index_next(int row, int col, int direction, int *match_row, int *match_col);
+bool match_index_describe(const char *query, int row, int col, char *buffer, size_t size);
+void ignore_add_global(const char *pattern);
+IgnoreDir *ignore_dir_open(IgnoreDir *parent, int dir_fd, size_t path_len);
+IgnoreDir *ignore_dir_retain(IgnoreDir *dir);
+void ignore_dir_release(IgnoreDir *dir);
+bool ignore_match(const IgnoreDir *dir, const char *path, size_t path_len, const char *name, bool is_dir);
+void toggle_show_ignored();
+ScanTree *scan_tree_start(const char *root, int num_workers, bool skip_ignored, void (*visit)(const char *path, size_t path_len, void *data), void *data);
+int scan_tree_step(ScanTree *scan, int worker);
+void scan_tree_stop(ScanTree *scan);
+void scan_tree_free(ScanTree *scan);
+int scan_tree_run(const char *root, int num_threads, bool skip_ignored, void (*visit)(const char *path, size_t path_len, void *data), void *data);
+void editor_grep();
+void editor_grep_key(int c);
+void editor_draw_grep_results();
 void editor_copy_selection_to_clipboard();
 void editor_select_all();
 void editor_draw_context_menu();
@@ -159,6 +459,7 @@ void file_tree_toggle_expand();
 void file_tree_open_file();
 int get_cx_display();
 void editor_scroll();
+void load_config();
 void initialize_syntax_colors();
 
 #endif
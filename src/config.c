@@ -91,8 +91,11 @@ void load_config() {
 
     FILE *config_file = fopen(config_path, "r");
     if (!config_file) {
+        // The defaults written on first run hold settings beyond colors,
+        // such as ignore= lines, so read them back like any other config.
         create_default_config_file(config_path);
-        return;
+        config_file = fopen(config_path, "r");
+        if (!config_file) return;
     }
 
     char line[512];
@@ -128,6 +131,13 @@ void load_config() {
         else if (strncmp(line, "hl_selection=", 13) == 0) {
             SYNTAX_COLORS.hl_selection = hex_to_ansi_color(line + 13);
         }
+        else if (strncmp(line, "max_fps=", 8) == 0) {
+            int fps = atoi(line + 8);
+            if (fps > 0) E.max_fps = fps;
+        }
+        else if (strncmp(line, "ignore=", 7) == 0) {
+            ignore_add_global(line + 7);
+        }
     }
     fclose(config_file);
 }
@@ -160,16 +170,18 @@ void create_default_config_file(const char* config_path) {
         "hl_match=#000000\n"
         "hl_preproc=#0000FF\n"
         "hl_selection=#FFFFFF\n"
+        "\n# Redraws per second at most\n"
+        "max_fps=60\n"
+        "\n# Left out of the file tree and find in files, like .gitignore lines\n"
+        "ignore=node_modules/\n"
         "\n# Restart Nimki after editing for changes to take effect\n"
     );
 
     fclose(config_file);
 }
 
+// Sets up the color pairs from the colors load_config() read.
 void initialize_syntax_colors() {
-    load_config();
-
-    // Reinitialize color pairs with loaded values
     if (has_colors()) {
         start_color();
         use_default_colors();
@@ -9,20 +9,23 @@ extern time_t status_message_time;
 
 void init_editor();
 void cleanup_editor();
-void editor_free_snapshot(EditorStateSnapshot *snapshot);
-void editor_save_state();
-void editor_undo();
 int get_cx_display();
 void editor_scroll();
 void editor_move_cursor(int key);
 int is_separator(int c);
-char *editor_prompt(const char *prompt_fmt, ...);
+char *editor_prompt(const char *prompt, const char *(*callback)(const char *input, int key));
 
 void init_editor() {
     E.cx = 0;
     E.cy = 0;
     E.num_lines = 0;
-    E.lines = NULL;
+    E.buffer = NULL;
+    E.map_data = NULL;
+    E.map_size = 0;
+    E.hl_frontier = 0;
+    E.hl_dirty = NULL;
+    E.hl_dirty_count = 0;
+    E.hl_dirty_cap = 0;
     E.row_offset = 0;
     E.col_offset = 0;
     E.filename = NULL;
@@ -31,12 +34,14 @@ void init_editor() {
 
     E.undo_history_len = 0;
     E.undo_history_idx = 0;
+    E.undo_saved_idx = 0;
+    E.undo_grouping = false;
+    E.undo_group_idx = -1;
     for (int i = 0; i < MAX_UNDO_STATES; ++i) {
-        E.undo_history[i].lines = NULL;
-        E.undo_history[i].num_lines = 0;
+        E.undo_history[i].ops = NULL;
+        E.undo_history[i].num_ops = 0;
         E.undo_history[i].cx = 0;
         E.undo_history[i].cy = 0;
-        E.undo_history[i].dirty = 0;
     }
 
     E.search_query = NULL;
@@ -51,13 +56,18 @@ void init_editor() {
     E.selection_end_cy = 0;
     E.selection_end_cx = 0;
 
+    E.grep_active = false;
+
     E.context_menu_active = false;
     E.context_menu_x = 0;
     E.context_menu_y = 0;
     E.context_menu_selected_option = 0;
     E.show_line_numbers = false;
+    E.rows_repainted = 0;
+    E.max_fps = 60;
 
     E.file_tree_visible = false;
+    E.show_ignored = false;
     E.file_tree_cursor = 0;
     E.file_tree_offset = 0;
     E.file_tree_width = 30;
@@ -66,49 +76,43 @@ void init_editor() {
     raw();
     noecho();
     keypad(stdscr, TRUE);
+    editor_init_keys();
 
     mousemask(ALL_MOUSE_EVENTS | REPORT_MOUSE_POSITION, NULL);
 
-    signal(SIGWINCH, handle_winch);
+    // Have the terminal wrap pastes in ESC[200~ ... ESC[201~ so they can be
+    // inserted in one go instead of being typed out key by key.
+    define_key("\033[200~", KEY_PASTE_BEGIN);
+    fputs("\033[?2004h", stdout);
+    fflush(stdout);
+
+    // Resizes are picked up by the event loop; curses must not be touched
+    // from the signal handler itself.
+    event_init();
+    event_on_signal(SIGWINCH, handle_winch);
+    jobs_init();
 
     getmaxyx(stdscr, E.screen_rows, E.screen_cols);
     E.screen_rows -= 2;
 
+    // Settings other than colors apply on any terminal.
+    load_config();
     if (has_colors()) {
         initialize_syntax_colors();
     }
 }
 
-void editor_free_snapshot(EditorStateSnapshot *snapshot) {
-    if (snapshot->lines) {
-        for (int i = 0; i < snapshot->num_lines; ++i) {
-            free(snapshot->lines[i].text);
-            snapshot->lines[i].text = NULL;
-            free(snapshot->lines[i].hl);
-            snapshot->lines[i].hl = NULL;
-        }
-        free(snapshot->lines);
-        snapshot->lines = NULL;
-    }
-    snapshot->num_lines = 0;
-    snapshot->cx = 0;
-    snapshot->cy = 0;
-    snapshot->dirty = 0;
-}
-
 void cleanup_editor() {
     endwin();
+    fputs("\033[?2004l", stdout);
+    fflush(stdout);
 
-    if (E.lines) {
-        for (int i = 0; i < E.num_lines; ++i) {
-            free(E.lines[i].text);
-            E.lines[i].text = NULL;
-            free(E.lines[i].hl);
-            E.lines[i].hl = NULL;
-        }
-        free(E.lines);
-        E.lines = NULL;
-    }
+    jobs_shutdown();
+    editor_stop_indexer();
+
+    buffer_clear();
+    free(E.hl_dirty);
+    E.hl_dirty = NULL;
     if (E.filename) {
         free(E.filename);
         E.filename = NULL;
@@ -118,11 +122,7 @@ void cleanup_editor() {
         E.search_query = NULL;
     }
 
-    for (int i = 0; i < MAX_UNDO_STATES; ++i) {
-        editor_free_snapshot(&E.undo_history[i]);
-    }
-    E.undo_history_len = 0;
-    E.undo_history_idx = 0;
+    editor_undo_reset();
 
     if (FT.root) {
         free_file_tree(FT.root);
@@ -136,132 +136,8 @@ void cleanup_editor() {
     FT.max_nodes = 0;
 }
 
-void editor_save_state() {
-    if (E.undo_history_idx < E.undo_history_len) {
-        for (int i = E.undo_history_idx; i < E.undo_history_len; ++i) {
-            editor_free_snapshot(&E.undo_history[i]);
-        }
-        E.undo_history_len = E.undo_history_idx;
-    }
-
-    if (E.undo_history_len == MAX_UNDO_STATES) {
-        editor_free_snapshot(&E.undo_history[0]);
-        memmove(&E.undo_history[0], &E.undo_history[1], (MAX_UNDO_STATES - 1) * sizeof(EditorStateSnapshot));
-        E.undo_history_len--;
-        E.undo_history_idx--;
-    }
-
-    EditorStateSnapshot *new_snapshot = &E.undo_history[E.undo_history_idx];
-    new_snapshot->num_lines = E.num_lines;
-    new_snapshot->cx = E.cx;
-    new_snapshot->cy = E.cy;
-    new_snapshot->dirty = E.dirty;
-
-    new_snapshot->lines = malloc(E.num_lines * sizeof(EditorLine));
-    if (new_snapshot->lines == NULL) {
-        editor_set_status_message("Undo error: Out of memory for snapshot lines.");
-        return;
-    }
-
-    for (int i = 0; i < E.num_lines; ++i) {
-        new_snapshot->lines[i].len = E.lines[i].len;
-        new_snapshot->lines[i].hl_open_comment = E.lines[i].hl_open_comment;
-
-        new_snapshot->lines[i].text = strdup(E.lines[i].text);
-        if (new_snapshot->lines[i].text == NULL) {
-            editor_set_status_message("Undo error: Out of memory for snapshot line text.");
-            editor_free_snapshot(new_snapshot);
-            return;
-        }
-
-        new_snapshot->lines[i].hl = malloc(E.lines[i].len);
-        if (new_snapshot->lines[i].hl == NULL) {
-            editor_set_status_message("Undo error: Out of memory for snapshot line hl.");
-            free(new_snapshot->lines[i].text);
-            editor_free_snapshot(new_snapshot);
-            return;
-        }
-        memcpy(new_snapshot->lines[i].hl, E.lines[i].hl, E.lines[i].len);
-    }
-
-    E.undo_history_len++;
-    E.undo_history_idx++;
-}
-
-void editor_undo() {
-    if (E.undo_history_idx <= 0) {
-        editor_set_status_message("Nothing to undo.");
-        return;
-    }
-
-    E.undo_history_idx--;
-
-    EditorStateSnapshot *prev_snapshot = &E.undo_history[E.undo_history_idx];
-
-    if (E.lines) {
-        for (int i = 0; i < E.num_lines; ++i) {
-            free(E.lines[i].text);
-            E.lines[i].text = NULL;
-            free(E.lines[i].hl);
-            E.lines[i].hl = NULL;
-        }
-        free(E.lines);
-        E.lines = NULL;
-    }
-
-    E.num_lines = prev_snapshot->num_lines;
-    E.cx = prev_snapshot->cx;
-    E.cy = prev_snapshot->cy;
-    E.dirty = prev_snapshot->dirty;
-
-    E.lines = malloc(E.num_lines * sizeof(EditorLine));
-    if (E.lines == NULL) {
-        editor_set_status_message("Undo error: Out of memory restoring lines.");
-        return;
-    }
-
-    for (int i = 0; i < E.num_lines; ++i) {
-        E.lines[i].len = prev_snapshot->lines[i].len;
-        E.lines[i].hl_open_comment = prev_snapshot->lines[i].hl_open_comment;
-
-        E.lines[i].text = strdup(prev_snapshot->lines[i].text);
-        if (E.lines[i].text == NULL) {
-            editor_set_status_message("Undo error: out of memory restoring line text.");
-            for (int j = 0; j < i; ++j) {
-                free(E.lines[j].text);
-                free(E.lines[j].hl);
-            }
-            free(E.lines);
-            E.lines = NULL;
-            E.num_lines = 0;
-            return;
-        }
-
-        E.lines[i].hl = malloc(prev_snapshot->lines[i].len);
-        if (E.lines[i].hl == NULL) {
-            editor_set_status_message("Undo error: out of memory restoring line hl.");
-            for (int j = 0; j < i; ++j) {
-                free(E.lines[j].text);
-                free(E.lines[j].hl);
-            }
-            free(E.lines);
-            E.lines = NULL;
-            E.num_lines = 0;
-            return;
-        }
-        memcpy(E.lines[i].hl, prev_snapshot->lines[i].hl, prev_snapshot->lines[i].len);
-    }
-
-    for (int i = 0; i < E.num_lines; i++) {
-        editor_update_syntax(i);
-    }
-
-    editor_set_status_message("Undo successful.");
-    editor_refresh_screen();
-}
-
 void editor_move_cursor(int key) {
-    EditorLine *line = (E.cy >= E.num_lines) ? NULL : &E.lines[E.cy];
+    EditorLine *line = buffer_line(E.cy);
 
     switch (key) {
         case KEY_LEFT:
@@ -269,7 +145,7 @@ void editor_move_cursor(int key) {
                 E.cx--;
             } else if (E.cy > 0) {
                 E.cy--;
-                E.cx = (int)E.lines[E.cy].len;
+                E.cx = (int)buffer_line(E.cy)->len;
             }
             break;
         case KEY_RIGHT:
@@ -310,7 +186,7 @@ void editor_move_cursor(int key) {
             }
             break;
     }
-    line = (E.cy >= E.num_lines) ? NULL : &E.lines[E.cy];
+    line = buffer_line(E.cy);
     int line_len = line ? (int)line->len : 0;
     if (E.cx > line_len) {
         E.cx = line_len;
@@ -321,7 +197,7 @@ int get_cx_display() {
     int display_cx = 0;
     if (E.cy >= E.num_lines) return 0;
 
-    EditorLine *line = &E.lines[E.cy];
+    EditorLine *line = buffer_line(E.cy);
     for (int i = 0; i < (int)E.cx; i++) {
         if (i >= (int)line->len) break;
         if (line->text[i] == '\t') {
@@ -362,7 +238,7 @@ void editor_scroll() {
     if (max_row_offset < 0) max_row_offset = 0;
     if (E.row_offset > max_row_offset) E.row_offset = max_row_offset;
 
-    int current_line_len = (E.cy >= E.num_lines) ? 0 : (int)E.lines[E.cy].len;
+    int current_line_len = (E.cy >= E.num_lines) ? 0 : (int)buffer_line(E.cy)->len;
     if (E.cx > current_line_len) {
         E.cx = current_line_len;
     }
@@ -381,22 +257,30 @@ int is_separator(int c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-char *editor_prompt(const char *prompt_fmt, ...) {
+// Reads a line of input on the status bar, shown after `prompt`. The prompt
+// is printed as is, so it may hold user text such as a search query. When
+// given, `callback` sees the input after every key, and with ERR while idle,
+// and returns a note shown after the input or NULL.
+char *editor_prompt(const char *prompt, const char *(*callback)(const char *input, int key)) {
     char buffer[128];
     size_t buflen = 0;
     buffer[0] = '\0';
+    int c = ERR;
 
     while (1) {
-        editor_set_status_message(prompt_fmt, buffer);
+        const char *note = callback ? callback(buffer, c) : NULL;
+        if (note) {
+            editor_set_status_message("%s%s  %s", prompt, buffer, note);
+        } else {
+            editor_set_status_message("%s%s", prompt, buffer);
+        }
         editor_refresh_screen();
 
-        int c = getch();
+        c = editor_read_key();
         if (c == '\r' || c == '\n') {
-            if (buflen > 0) {
-                return strdup(buffer);
-            }
-            editor_set_status_message("");
-            return NULL;
+            // An empty answer is returned too; callers that need text
+            // treat it as cancelled.
+            return strdup(buffer);
         } else if (c == CTRL('c') || c == CTRL('q') || c == 27) {
             editor_set_status_message("");
             return NULL;
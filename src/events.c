@@ -0,0 +1,151 @@
+#include"common.h"
+#include<poll.h>
+
+// The UI thread sleeps in a single poll() over the terminal, a self-pipe
+// and whatever descriptors other modules register. Signal handlers only
+// note the signal and write to the pipe, and worker threads write to it
+// through event_wake(), so every reaction runs later on the UI thread with
+// the buffer locked, where curses calls are safe.
+
+#define MAX_WATCHED_FDS 16
+
+typedef struct {
+    int fd;
+    void (*callback)(int fd, void *data);
+    void *data;
+} WatchedFd;
+
+static int wake_pipe[2] = {-1, -1};
+static volatile sig_atomic_t pending_signals[NSIG];
+static void (*signal_callbacks[NSIG])(int sig);
+static WatchedFd watched[MAX_WATCHED_FDS];
+static int num_watched = 0;
+
+int event_init();
+void event_wake();
+int event_on_signal(int sig, void (*callback)(int sig));
+int event_watch_fd(int fd, void (*callback)(int fd, void *data), void *data);
+void event_unwatch_fd(int fd);
+bool event_wait(int timeout_ms);
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) return -1;
+    return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+int event_init() {
+    if (pipe(wake_pipe) == -1) {
+        wake_pipe[0] = wake_pipe[1] = -1;
+        return -1;
+    }
+    if (set_nonblocking(wake_pipe[0]) == -1 || set_nonblocking(wake_pipe[1]) == -1) {
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+        wake_pipe[0] = wake_pipe[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Interrupts event_wait(). Safe from signal handlers and other threads; a
+// full pipe already guarantees a wakeup, so a failed write is fine.
+void event_wake() {
+    if (wake_pipe[1] == -1) return;
+    char byte = 0;
+    ssize_t written = write(wake_pipe[1], &byte, 1);
+    (void)written;
+}
+
+static void event_signal_handler(int sig) {
+    int saved_errno = errno;
+    pending_signals[sig] = 1;
+    event_wake();
+    errno = saved_errno;
+}
+
+// Has `callback` run from event_wait() after `sig` arrives.
+int event_on_signal(int sig, void (*callback)(int sig)) {
+    if (sig <= 0 || sig >= NSIG) return -1;
+    signal_callbacks[sig] = callback;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = event_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    return sigaction(sig, &sa, NULL);
+}
+
+// Has `callback` run from event_wait() whenever `fd` is readable.
+int event_watch_fd(int fd, void (*callback)(int fd, void *data), void *data) {
+    if (num_watched == MAX_WATCHED_FDS) return -1;
+    watched[num_watched].fd = fd;
+    watched[num_watched].callback = callback;
+    watched[num_watched].data = data;
+    num_watched++;
+    return 0;
+}
+
+void event_unwatch_fd(int fd) {
+    for (int i = 0; i < num_watched; i++) {
+        if (watched[i].fd == fd) {
+            watched[i] = watched[--num_watched];
+            return;
+        }
+    }
+}
+
+// Sleeps with the buffer unlocked until the terminal has input, a signal
+// or wakeup comes in, a watched fd turns readable, or `timeout_ms` passes
+// (-1 waits for ever). Pending signal and fd callbacks are run before it
+// returns. Returns true when the terminal has input.
+bool event_wait(int timeout_ms) {
+    struct pollfd fds[MAX_WATCHED_FDS + 2];
+    int nfds = 0;
+
+    fds[nfds].fd = STDIN_FILENO;
+    fds[nfds++].events = POLLIN;
+    if (wake_pipe[0] != -1) {
+        fds[nfds].fd = wake_pipe[0];
+        fds[nfds++].events = POLLIN;
+    }
+    int first_watched = nfds;
+    for (int i = 0; i < num_watched; i++) {
+        fds[nfds].fd = watched[i].fd;
+        fds[nfds++].events = POLLIN;
+    }
+
+    buffer_unlock();
+    int ready = poll(fds, nfds, timeout_ms);
+    buffer_lock();
+    if (ready == -1) {
+        // Interrupted by a signal; its handler has already queued it.
+        for (int i = 0; i < nfds; i++) fds[i].revents = 0;
+    }
+
+    if (wake_pipe[0] != -1) {
+        char drain[64];
+        while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+    }
+
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (pending_signals[sig]) {
+            pending_signals[sig] = 0;
+            if (signal_callbacks[sig]) signal_callbacks[sig](sig);
+        }
+    }
+
+    // A callback may unwatch descriptors, so look each one up again.
+    for (int i = first_watched; i < nfds; i++) {
+        if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        for (int j = 0; j < num_watched; j++) {
+            if (watched[j].fd == fds[i].fd) {
+                watched[j].callback(watched[j].fd, watched[j].data);
+                break;
+            }
+        }
+    }
+
+    return (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+}
@@ -1,4 +1,7 @@
 #include"common.h"
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
 
 extern EditorConfig E;
 extern EditorSyntax *E_syntax;
@@ -9,6 +12,238 @@ void editor_select_syntax_highlight();
 int editor_insert_newline();
 void editor_insert_char(int c);
 void editor_del_char();
+int editor_insert_text(int row, int col, const char *text, size_t len, int *end_row, int *end_col);
+char *editor_get_text(int row, int col, int end_row, int end_col, size_t *out_len);
+void editor_delete_text(int row, int col, int end_row, int end_col);
+void editor_paste_text(const char *text, size_t len);
+
+#define LOAD_BATCH_LINES 4096
+
+// Records the offset of each '\n' in data[from, size) into `offsets`, stopping
+// once `max` are found. Returns how many were found; *resume is where the
+// next call should continue.
+static size_t find_newlines(const char *data, size_t size, size_t from, size_t *offsets, size_t max, size_t *resume) {
+    size_t found = 0;
+    size_t i = from;
+
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (i + 16 <= size && found + 16 <= max) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        while (mask) {
+            offsets[found++] = i + (size_t)__builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+        i += 16;
+    }
+#endif
+
+    while (i < size && found < max) {
+        const char *nl = memchr(data + i, '\n', size - i);
+        if (nl == NULL) {
+            i = size;
+            break;
+        }
+        offsets[found++] = (size_t)(nl - data);
+        i = (size_t)(nl - data) + 1;
+    }
+
+    *resume = i;
+    return found;
+}
+
+// Turns the next LOAD_BATCH_LINES lines of the mapping into views.
+// *pos is where the newline scan resumes and *line_start where the current
+// line begins. Returns the number of lines written to `batch`.
+static int editor_index_batch(char *data, size_t size, size_t *pos, size_t *line_start, EditorLine *batch) {
+    size_t offsets[LOAD_BATCH_LINES];
+    size_t found = find_newlines(data, size, *pos, offsets, LOAD_BATCH_LINES, pos);
+    int count = 0;
+
+    for (size_t k = 0; k <= found; k++) {
+        size_t line_end;
+        if (k < found) {
+            line_end = offsets[k];
+        } else if (*pos >= size && *line_start < size) {
+            line_end = size;
+        } else {
+            break;
+        }
+
+        size_t len = line_end - *line_start;
+        if (len > 0 && data[*line_start + len - 1] == '\r') len--;
+
+        batch[count].text = data + *line_start;
+        batch[count].len = len;
+        batch[count].hl = NULL;
+        batch[count].hl_open_comment = 0;
+        batch[count].mapped = true;
+        count++;
+        *line_start = line_end + 1;
+    }
+    return count;
+}
+
+// Records the comment state each line of a batch ends in.
+static int editor_batch_states(EditorLine *batch, int count, int open_comment) {
+    for (int k = 0; k < count; k++) {
+        open_comment = editor_syntax_line_state(&batch[k], open_comment);
+        batch[k].hl_open_comment = open_comment;
+    }
+    return open_comment;
+}
+
+static pthread_t index_thread;
+static bool index_thread_running = false;
+static size_t index_pos;
+static size_t index_line_start;
+
+// Indexes the rest of a mapped file a batch at a time, taking the buffer
+// lock only to append each finished batch to the end. Each line's comment
+// state is recorded on the way so a jump anywhere in the file can be
+// highlighted without lexing what lies above it; the hl runs themselves
+// are built by editor_syntax_line() when the lines are first drawn. Lines the
+// user adds meanwhile are all above the unread part of the file, so
+// appending keeps the order right.
+static void *editor_index_worker(void *arg) {
+    (void)arg;
+    static EditorLine batch[LOAD_BATCH_LINES + 1];
+
+    buffer_lock();
+    char *data = E.map_data;
+    size_t size = E.map_size;
+    int open_comment = E.num_lines > 0 ? buffer_line(E.num_lines - 1)->hl_open_comment : 0;
+    buffer_unlock();
+
+    while (1) {
+        int count = editor_index_batch(data, size, &index_pos, &index_line_start, batch);
+        if (count == 0) break;
+
+        int batch_comment = open_comment;
+        open_comment = editor_batch_states(batch, count, open_comment);
+
+        buffer_lock();
+        if (E.index_cancel) {
+            buffer_unlock();
+            return NULL;
+        }
+
+        int first = E.num_lines;
+        int actual_comment = first > 0 ? buffer_line(first - 1)->hl_open_comment : 0;
+        if (buffer_insert_lines(first, batch, count) == -1) {
+            buffer_unlock();
+            break;
+        }
+        // An edit changed the state the batch was lexed with.
+        if (actual_comment != batch_comment) {
+            editor_invalidate_syntax(first, first + count);
+        }
+        buffer_signal_grown();
+        buffer_unlock();
+    }
+
+    buffer_lock();
+    E.indexing = false;
+    buffer_signal_grown();
+    buffer_unlock();
+    // Let the event loop reap the thread and repaint without waiting for
+    // its next progress tick.
+    event_wake();
+    return NULL;
+}
+
+// Maps the file, indexes the first screenful right away and leaves the
+// rest to editor_index_worker(). Nothing is copied until a line is edited.
+// Returns -1 if the file can't be mapped so the caller can fall back to
+// reading it.
+static int editor_read_mapped(int fd, size_t size) {
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return -1;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    E.map_data = data;
+    E.map_size = size;
+
+    static EditorLine batch[LOAD_BATCH_LINES + 1];
+    index_pos = 0;
+    index_line_start = 0;
+    int count = editor_index_batch(data, size, &index_pos, &index_line_start, batch);
+    int open_comment = editor_batch_states(batch, count, 0);
+    if (buffer_insert_lines(0, batch, count) == -1) {
+        cleanup_editor();
+        fprintf(stderr, "Fatal error: out of memory (line index).\n");
+        exit(1);
+    }
+    // Every line arrives with its comment state already recorded.
+    editor_reset_syntax(true);
+
+    if (index_pos < size) {
+        E.indexing = true;
+        E.index_cancel = false;
+        if (pthread_create(&index_thread, NULL, editor_index_worker, NULL) == 0) {
+            index_thread_running = true;
+        } else {
+            // No thread available; finish the index here instead.
+            E.indexing = false;
+            while ((count = editor_index_batch(data, size, &index_pos, &index_line_start, batch)) > 0) {
+                open_comment = editor_batch_states(batch, count, open_comment);
+                if (buffer_insert_lines(E.num_lines, batch, count) == -1) {
+                    cleanup_editor();
+                    fprintf(stderr, "Fatal error: out of memory (line index).\n");
+                    exit(1);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Cancels a running indexer and waits for it to exit. Called with the
+// buffer lock held, before the buffer or the mapping goes away.
+void editor_stop_indexer() {
+    if (!index_thread_running) return;
+    E.index_cancel = true;
+    buffer_unlock();
+    pthread_join(index_thread, NULL);
+    buffer_lock();
+    index_thread_running = false;
+    E.indexing = false;
+    E.index_cancel = false;
+    // Jobs waiting for more lines must see that none are coming.
+    buffer_signal_grown();
+}
+
+// Blocks until the whole file is indexed, for operations that need the
+// real end of the file.
+void editor_wait_for_indexer() {
+    if (!index_thread_running) return;
+    if (E.indexing) {
+        editor_set_status_message("Waiting for file indexing to finish...");
+        editor_refresh_screen();
+    }
+    buffer_unlock();
+    pthread_join(index_thread, NULL);
+    buffer_lock();
+    index_thread_running = false;
+}
+
+// Blocks until `row` exists or the indexer is done, so a scan can stream
+// through the file while it is still being read.
+void editor_wait_for_lines(int row) {
+    while (E.indexing && row >= E.num_lines) {
+        buffer_wait_grown();
+    }
+}
+
+// Reaps a finished indexer from the UI loop.
+void editor_poll_indexer() {
+    if (index_thread_running && !E.indexing) {
+        pthread_join(index_thread, NULL);
+        index_thread_running = false;
+        editor_set_status_message("Indexed %d lines.", E.num_lines);
+    }
+}
 
 void editor_read_file(const char *filename) {
     if (E.filename) {
@@ -22,36 +257,28 @@ void editor_read_file(const char *filename) {
         exit(1);
     }
 
+    // A search over the old buffer has nothing to report.
+    job_cancel(JOB_SEARCH);
+    editor_stop_indexer();
     editor_select_syntax_highlight();
+    editor_undo_reset();
+
+    buffer_clear();
 
     FILE *fp = fopen(filename, "r");
     if (!fp) {
         if (errno == ENOENT) {
-            E.lines = malloc(sizeof(EditorLine));
-            if (E.lines == NULL) {
+            if (buffer_insert_line(0, "", 0) == -1) {
                 cleanup_editor();
                 fprintf(stderr, "Fatal error: out of memory (initial line).\n");
                 exit(1);
             }
-            E.lines[0].text = strdup("");
-            if (E.lines[0].text == NULL) {
-                free(E.lines);
-                E.lines = NULL;
-                cleanup_editor();
-                fprintf(stderr, "Fatal error: out of memory (initial line text).\n");
-                exit(1);
-            }
-            E.lines[0].len = 0;
-            E.lines[0].hl = NULL;
-            E.lines[0].hl_open_comment = 0;
-            E.num_lines = 1;
             editor_set_status_message("New file: %s", filename);
         } else {
             cleanup_editor();
             fprintf(stderr, "Error opening file '%s': %s\n", filename, strerror(errno));
             exit(1);
         }
-        editor_save_state();
         return;
     }
 
@@ -59,80 +286,47 @@ void editor_read_file(const char *filename) {
     size_t linecap = 0;
     ssize_t linelen;
 
-    if (E.lines) {
-        for (int i = 0; i < E.num_lines; ++i) {
-            free(E.lines[i].text);
-            free(E.lines[i].hl);
-        }
-        free(E.lines);
-        E.lines = NULL;
-        E.num_lines = 0;
-    }
+    struct stat st;
+    bool mapped = fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) &&
+                  st.st_size >= MMAP_THRESHOLD &&
+                  editor_read_mapped(fileno(fp), (size_t)st.st_size) == 0;
 
-    while ((linelen = getline(&line_buffer, &linecap, fp)) != -1) {
+    while (!mapped && (linelen = getline(&line_buffer, &linecap, fp)) != -1) {
         while (linelen > 0 && (line_buffer[linelen - 1] == '\n' || line_buffer[linelen - 1] == '\r')) {
             linelen--;
         }
 
-        E.lines = realloc(E.lines, (E.num_lines + 1) * sizeof(EditorLine));
-        if (E.lines == NULL) {
-            free(line_buffer);
-            cleanup_editor();
-            fprintf(stderr, "Fatal error: out of memory (realloc lines).\n");
-            exit(1);
-        }
-
-        E.lines[E.num_lines].text = malloc(linelen + 1);
-        if (E.lines[E.num_lines].text == NULL) {
+        if (buffer_insert_line(E.num_lines, line_buffer, linelen) == -1) {
             free(line_buffer);
             cleanup_editor();
             fprintf(stderr, "Fatal error: out of memory (line text).\n");
             exit(1);
         }
-        memcpy(E.lines[E.num_lines].text, line_buffer, linelen);
-        E.lines[E.num_lines].text[linelen] = '\0';
-        E.lines[E.num_lines].len = linelen;
-        E.lines[E.num_lines].hl = NULL;
-        E.lines[E.num_lines].hl_open_comment = 0;
-        E.num_lines++;
     }
     free(line_buffer);
     fclose(fp);
 
     if (E.num_lines == 0) {
-        E.lines = malloc(sizeof(EditorLine));
-        if (E.lines == NULL) {
+        if (buffer_insert_line(0, "", 0) == -1) {
             cleanup_editor();
             fprintf(stderr, "Fatal error: out of memory (empty file init after read).\n");
             exit(1);
         }
-        E.lines[0].text = strdup("");
-        if (E.lines[0].text == NULL) {
-            free(E.lines);
-            E.lines = NULL;
-            cleanup_editor();
-            fprintf(stderr, "Fatal error: out of memory (empty file text after read).\n");
-            exit(1);
-        }
-        E.lines[0].len = 0;
-        E.lines[0].hl = NULL;
-        E.lines[0].hl_open_comment = 0;
-        E.num_lines = 1;
-    }
-
-    for (int i = 0; i < E.num_lines; i++) {
-        editor_update_syntax(i);
     }
 
     E.dirty = 0;
-    editor_set_status_message("Opened file: %s (%d lines)", filename, E.num_lines);
-    editor_save_state();
+    if (E.indexing) {
+        editor_set_status_message("Opened file: %s (indexing...)", filename);
+    } else {
+        editor_set_status_message("Opened file: %s (%d lines)", filename, E.num_lines);
+    }
 }
 
 void editor_save_file() {
     if (!E.filename) {
-        char *new_filename = editor_prompt("Save as: %s (ESC to cancel)", "");
-        if (new_filename == NULL) {
+        char *new_filename = editor_prompt("Save as (ESC to cancel): ", NULL);
+        if (new_filename == NULL || new_filename[0] == '\0') {
+            free(new_filename);
             editor_set_status_message("Save cancelled.");
             return;
         }
@@ -144,98 +338,288 @@ void editor_save_file() {
         editor_select_syntax_highlight();
     }
 
-    FILE *fp = fopen(E.filename, "w");
+    editor_wait_for_indexer();
+
+    // Mapped lines still point into the file on disk, so truncating it would
+    // pull the pages out from under them. Write a new file next to the real
+    // one, symlinks followed, and rename it over it instead; the mapping
+    // keeps the old inode alive.
+    char save_path[PATH_MAX];
+    char target[PATH_MAX];
+    struct stat st;
+    bool exists = stat(E.filename, &st) == 0;
+    bool replace = E.map_data != NULL;
+    bool owner_kept = true;
+    if (replace && exists && st.st_nlink > 1) {
+        // A rename would split the hard links. Copy the lines off the
+        // mapping so the file can be rewritten in place.
+        for (int i = 0; i < E.num_lines; ++i) {
+            if (buffer_line_own(buffer_line(i)) == -1) return;
+        }
+        munmap(E.map_data, E.map_size);
+        E.map_data = NULL;
+        E.map_size = 0;
+        replace = false;
+    }
+    if (replace) {
+        if (!realpath(E.filename, target)) snprintf(target, sizeof(target), "%s", E.filename);
+        if (snprintf(save_path, sizeof(save_path), "%s.nimki-save", target) >= (int)sizeof(save_path)) {
+            editor_set_status_message("Error saving file: %s", strerror(ENAMETOOLONG));
+            return;
+        }
+    } else {
+        snprintf(save_path, sizeof(save_path), "%s", E.filename);
+    }
+
+    FILE *fp = fopen(save_path, "w");
     if (!fp) {
         editor_set_status_message("Error saving file: %s", strerror(errno));
         return;
     }
 
     for (int i = 0; i < E.num_lines; ++i) {
-        fprintf(fp, "%s\n", E.lines[i].text);
+        EditorLine *line = buffer_line(i);
+        fwrite(line->text, 1, line->len, fp);
+        fputc('\n', fp);
+    }
+    if (replace) {
+        // The new file takes the old one's place, so it gets its mode and,
+        // as far as we are allowed, its owner; and it must be on disk before
+        // the rename makes it the only copy.
+        int fd = fileno(fp);
+        if (exists) {
+            fchmod(fd, st.st_mode & 07777);
+            // Without the right to give the file away, keep at least the
+            // group if we are in it.
+            owner_kept = fchown(fd, st.st_uid, st.st_gid) == 0 || fchown(fd, -1, st.st_gid) == 0;
+        }
+        if (fflush(fp) != 0 || fsync(fd) == -1) {
+            editor_set_status_message("Error saving file: %s", strerror(errno));
+            fclose(fp);
+            unlink(save_path);
+            return;
+        }
+    }
+    if (fclose(fp) != 0) {
+        editor_set_status_message("Error saving file: %s", strerror(errno));
+        if (replace) unlink(save_path);
+        return;
+    }
+    if (replace && rename(save_path, target) == -1) {
+        editor_set_status_message("Error saving file: %s", strerror(errno));
+        unlink(save_path);
+        return;
     }
-    fclose(fp);
     E.dirty = 0;
-    editor_set_status_message("File saved: %s", E.filename);
-    editor_save_state();
+    editor_set_status_message("File saved: %s%s", E.filename, owner_kept ? "" : " (owner not kept)");
+    editor_undo_mark_saved();
 }
 
-int editor_insert_newline() {
-    editor_save_state();
-    if (E.num_lines == 0) {
-        E.lines = malloc(sizeof(EditorLine));
-        if (E.lines == NULL) {
-            editor_set_status_message("Error: Out of memory for initial lines array.");
+// Inserts `text`, which may span several lines, at row/col. Reports where
+// the inserted text ends so callers can place the cursor after it.
+int editor_insert_text(int row, int col, const char *text, size_t len, int *end_row, int *end_col) {
+    EditorLine *line = buffer_line(row);
+    if (line == NULL || buffer_line_own(line) == -1) return -1;
+
+    if (col < 0) col = 0;
+    if (col > (int)line->len) col = (int)line->len;
+
+    int new_rows = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\n') new_rows++;
+    }
+
+    if (new_rows == 0) {
+        char *new_text = realloc(line->text, line->len + len + 1);
+        if (new_text == NULL) {
+            editor_set_status_message("Error: Out of memory for line %d.", row);
             return -1;
         }
-        E.lines[0].text = strdup("");
-        if (E.lines[0].text == NULL) {
-            free(E.lines);
-            E.lines = NULL;
-            editor_set_status_message("Error: Out of memory for initial line text.");
+        line->text = new_text;
+        memmove(&line->text[col + len], &line->text[col], line->len - col + 1);
+        memcpy(&line->text[col], text, len);
+        line->len += len;
+        buffer_line_changed(line);
+        editor_invalidate_syntax(row, row + 1);
+        if (end_row) *end_row = row;
+        if (end_col) *end_col = col + (int)len;
+        return 0;
+    }
+
+    // Build every new line before touching the buffer so a failed
+    // allocation leaves the document as it was.
+    EditorLine *inserted = malloc(new_rows * sizeof(EditorLine));
+    if (inserted == NULL) {
+        editor_set_status_message("Error: Out of memory for inserted lines.");
+        return -1;
+    }
+
+    const char *first_nl = memchr(text, '\n', len);
+    const char *seg = first_nl + 1;
+    for (int r = 0; r < new_rows; r++) {
+        const char *nl = memchr(seg, '\n', text + len - seg);
+        size_t seg_len = nl ? (size_t)(nl - seg) : (size_t)(text + len - seg);
+        size_t tail_len = (r == new_rows - 1) ? line->len - col : 0;
+
+        inserted[r].text = malloc(seg_len + tail_len + 1);
+        if (inserted[r].text == NULL) {
+            for (int j = 0; j < r; j++) free(inserted[j].text);
+            free(inserted);
+            editor_set_status_message("Error: Out of memory for inserted line text.");
             return -1;
         }
-        E.lines[0].len = 0;
-        E.lines[0].hl = NULL;
-        E.lines[0].hl_open_comment = 0;
-        E.num_lines = 1;
-        E.cy = 0;
-        E.cx = 0;
-        E.dirty = 1;
-        editor_update_syntax(0);
-        return 0;
+        memcpy(inserted[r].text, seg, seg_len);
+        memcpy(inserted[r].text + seg_len, line->text + col, tail_len);
+        inserted[r].text[seg_len + tail_len] = '\0';
+        inserted[r].len = seg_len + tail_len;
+        inserted[r].hl = NULL;
+        inserted[r].hl_open_comment = 0;
+        inserted[r].mapped = false;
+        seg = nl ? nl + 1 : text + len;
     }
 
-    E.lines = realloc(E.lines, (E.num_lines + 1) * sizeof(EditorLine));
-    if (E.lines == NULL) {
-        editor_set_status_message("Error: Out of memory for lines array (realloc).");
+    size_t first_len = first_nl - text;
+    char *first_text = realloc(line->text, col + first_len + 1);
+    if (first_text == NULL) {
+        for (int j = 0; j < new_rows; j++) free(inserted[j].text);
+        free(inserted);
+        editor_set_status_message("Error: Out of memory for split line text.");
+        return -1;
+    }
+    line->text = first_text;
+    memcpy(&line->text[col], text, first_len);
+    size_t old_len = line->len;
+    line->len = col + first_len;
+    line->text[line->len] = '\0';
+    buffer_line_changed(line);
+
+    if (buffer_insert_lines(row + 1, inserted, new_rows) == -1) {
+        // Put the split-off tail back so nothing is lost.
+        line = buffer_line(row);
+        char *restored = realloc(line->text, old_len + 1);
+        if (restored) {
+            line->text = restored;
+            memcpy(&line->text[col], inserted[new_rows - 1].text + inserted[new_rows - 1].len - (old_len - col), old_len - col);
+            line->len = old_len;
+            line->text[line->len] = '\0';
+            buffer_line_changed(line);
+        }
+        for (int j = 0; j < new_rows; j++) free(inserted[j].text);
+        free(inserted);
         return -1;
     }
+    free(inserted);
 
-    memmove(&E.lines[E.cy + 1], &E.lines[E.cy], (E.num_lines - E.cy) * sizeof(EditorLine));
+    editor_syntax_lines_inserted(row + 1, new_rows);
+    editor_invalidate_syntax(row, row + 1);
 
-    E.lines[E.cy].hl = NULL;
-    E.lines[E.cy].hl_open_comment = 0;
+    if (end_row) *end_row = row + new_rows;
+    if (end_col) {
+        const char *last_nl = memrchr(text, '\n', len);
+        *end_col = (int)(text + len - (last_nl + 1));
+    }
+    return 0;
+}
 
-    if (E.cx == 0) {
-        E.lines[E.cy].text = strdup("");
-        if (E.lines[E.cy].text == NULL) {
-            editor_set_status_message("Error: Out of memory for new empty line text.");
-            return -1;
-        }
-        E.lines[E.cy].len = 0;
-    } else {
-        EditorLine *current_line = &E.lines[E.cy];
-        E.lines[E.cy + 1].len = current_line->len - E.cx;
-        E.lines[E.cy + 1].text = strdup(&current_line->text[E.cx]);
-        if (E.lines[E.cy + 1].text == NULL) {
-            editor_set_status_message("Error: Out of memory for split line text.");
-            return -1;
+// Returns a malloc'd copy of the text between two positions, with '\n'
+// between lines. The caller frees it.
+char *editor_get_text(int row, int col, int end_row, int end_col, size_t *out_len) {
+    size_t total_len = 0;
+    for (int r = row; r <= end_row && r < E.num_lines; r++) {
+        EditorLine *line = buffer_line(r);
+        int start = (r == row) ? col : 0;
+        int end = (r == end_row && end_col < (int)line->len) ? end_col : (int)line->len;
+        if (end > start) total_len += (size_t)(end - start);
+        if (r < end_row) total_len++;
+    }
+
+    char *text = malloc(total_len + 1);
+    if (text == NULL) return NULL;
+
+    size_t offset = 0;
+    for (int r = row; r <= end_row && r < E.num_lines; r++) {
+        EditorLine *line = buffer_line(r);
+        int start = (r == row) ? col : 0;
+        int end = (r == end_row && end_col < (int)line->len) ? end_col : (int)line->len;
+        if (end > start) {
+            memcpy(text + offset, line->text + start, (size_t)(end - start));
+            offset += (size_t)(end - start);
         }
-        E.lines[E.cy + 1].hl = NULL;
-        E.lines[E.cy + 1].hl_open_comment = 0;
+        if (r < end_row) text[offset++] = '\n';
+    }
+    text[offset] = '\0';
+    if (out_len) *out_len = offset;
+    return text;
+}
+
+// Removes the text between two positions, joining the first and last line.
+void editor_delete_text(int row, int col, int end_row, int end_col) {
+    if (row < 0 || end_row >= E.num_lines || row > end_row) return;
+
+    EditorLine *line = buffer_line(row);
+    EditorLine *end_line = buffer_line(end_row);
+    if (buffer_line_own(line) == -1) return;
+    if (col > (int)line->len) col = (int)line->len;
+    if (end_col > (int)end_line->len) end_col = (int)end_line->len;
+
+    if (row == end_row) {
+        if (end_col <= col) return;
+        memmove(&line->text[col], &line->text[end_col], line->len - end_col + 1);
+        line->len -= end_col - col;
+        buffer_line_changed(line);
+        editor_invalidate_syntax(row, row + 1);
+        return;
+    }
+
+    size_t tail_len = end_line->len - end_col;
+    char *merged_text = realloc(line->text, col + tail_len + 1);
+    if (merged_text == NULL) {
+        editor_set_status_message("Error: Out of memory for merged text.");
+        return;
+    }
+    line->text = merged_text;
+    memcpy(&line->text[col], end_line->text + end_col, tail_len);
+    line->len = col + tail_len;
+    line->text[line->len] = '\0';
+    buffer_line_changed(line);
+
+    buffer_delete_lines(row + 1, end_row - row);
+
+    editor_syntax_lines_deleted(row + 1, end_row - row);
+    editor_invalidate_syntax(row, row + 1);
+}
 
-        current_line->text = realloc(current_line->text, E.cx + 1);
-        if (current_line->text == NULL) {
-            editor_set_status_message("Error: out of memory for truncated line.");
+int editor_insert_newline() {
+    editor_undo_begin();
+    if (E.num_lines == 0) {
+        if (buffer_insert_line(0, "", 0) == -1) {
             return -1;
         }
-        current_line->text[E.cx] = '\0';
-        current_line->len = E.cx;
+        E.cy = 0;
+        E.cx = 0;
+        E.dirty = 1;
+        editor_invalidate_syntax(0, 1);
+        return 0;
     }
 
-    E.num_lines++;
-    E.cy++;
-    E.cx = 0;
-    E.dirty = 1;
+    if (E.cy >= E.num_lines) {
+        E.cy = E.num_lines - 1;
+        E.cx = (int)buffer_line(E.cy)->len;
+    }
 
-    editor_update_syntax(E.cy - 1);
-    editor_update_syntax(E.cy);
+    int row = E.cy;
+    int col = E.cx;
+    if (editor_insert_text(row, col, "\n", 1, &E.cy, &E.cx) == -1) {
+        return -1;
+    }
+    editor_undo_record(UNDO_INSERT, row, col, "\n", 1);
+    E.dirty = 1;
 
     return 0;
 }
 
 void editor_insert_char(int c) {
-    editor_save_state();
+    editor_undo_begin();
     if (E.cy == E.num_lines) {
         if (editor_insert_newline() == -1) {
             editor_set_status_message("Error: Failed to prepare new line for character insertion.");
@@ -243,61 +627,84 @@ void editor_insert_char(int c) {
         }
     }
 
-    if (E.lines == NULL || E.cy >= E.num_lines) {
+    if (E.cy >= E.num_lines) {
         editor_set_status_message("Internal error: Invalid line state for character insertion.");
         return;
     }
 
-    EditorLine *line = &E.lines[E.cy];
-    line->text = realloc(line->text, line->len + 2);
-    if (line->text == NULL) {
-        editor_set_status_message("Error: Out of memory for line %d.", E.cy);
+    char ch = (char)c;
+    if (editor_insert_text(E.cy, E.cx, &ch, 1, NULL, NULL) == -1) {
         return;
     }
-    memmove(&line->text[E.cx + 1], &line->text[E.cx], line->len - E.cx + 1);
-    line->text[E.cx] = c;
-    line->len++;
+    editor_undo_record(UNDO_INSERT, E.cy, E.cx, &ch, 1);
     E.cx++;
     E.dirty = 1;
+}
+
+// Inserts pasted text at the cursor as one edit: CR and CRLF line ends
+// become '\n', the whole text goes in through one multi-line insert, and a
+// single undo record covers it.
+void editor_paste_text(const char *text, size_t len) {
+    if (len == 0) return;
+
+    char *normalized = malloc(len);
+    if (normalized == NULL) {
+        editor_set_status_message("Paste error: Out of memory.");
+        return;
+    }
+    size_t n = 0;
+    int lines = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\r') {
+            if (i + 1 < len && text[i + 1] == '\n') continue;
+            normalized[n++] = '\n';
+        } else {
+            normalized[n++] = text[i];
+        }
+        if (normalized[n - 1] == '\n') lines++;
+    }
+
+    editor_undo_begin();
+    if (E.cy >= E.num_lines) {
+        E.cy = E.num_lines - 1;
+        E.cx = (int)buffer_line(E.cy)->len;
+    }
+    int row = E.cy;
+    int col = E.cx;
+    if (editor_insert_text(row, col, normalized, n, &E.cy, &E.cx) == 0) {
+        editor_undo_record(UNDO_INSERT, row, col, normalized, n);
+        E.dirty = 1;
+        editor_set_status_message("Pasted %zu bytes (%d lines).", n, lines + 1);
+    }
+    free(normalized);
+}
 
-    editor_update_syntax(E.cy);
+// Deletes a range and journals the removed text so undo can put it back.
+static void editor_delete_range_with_undo(int row, int col, int end_row, int end_col) {
+    size_t deleted_len = 0;
+    char *deleted = editor_get_text(row, col, end_row, end_col, &deleted_len);
+    if (deleted == NULL) {
+        editor_set_status_message("Error: Out of memory saving deleted text.");
+        return;
+    }
+    editor_delete_text(row, col, end_row, end_col);
+    editor_undo_record(UNDO_DELETE, row, col, deleted, deleted_len);
+    free(deleted);
 }
 
 void editor_del_char() {
-    editor_save_state();
+    editor_undo_begin();
 
     if (E.select_all_active) {
-        if (E.lines) {
-            for (int i = 0; i < E.num_lines; ++i) {
-                free(E.lines[i].text);
-                E.lines[i].text = NULL;
-                free(E.lines[i].hl);
-                E.lines[i].hl = NULL;
-            }
-            free(E.lines);
-            E.lines = NULL;
-        }
-        E.lines = malloc(sizeof(EditorLine));
-        if (E.lines == NULL) {
-            editor_set_status_message("Fatal error: Out of memory (clear all init).");
-            exit(1);
+        editor_wait_for_indexer();
+        int last = E.num_lines - 1;
+        if (last >= 0) {
+            editor_delete_range_with_undo(0, 0, last, (int)buffer_line(last)->len);
         }
-        E.lines[0].text = strdup("");
-        if (E.lines[0].text == NULL) {
-            free(E.lines);
-            E.lines = NULL;
-            editor_set_status_message("Fatal error: out of memory (clear all text).");
-            exit(1);
-        }
-        E.lines[0].len = 0;
-        E.lines[0].hl = NULL;
-        E.lines[0].hl_open_comment = 0;
-        E.num_lines = 1;
         E.cx = 0;
         E.cy = 0;
         E.dirty = 1;
         E.select_all_active = 0;
-        editor_update_syntax(0);
         editor_set_status_message("All text deleted.");
         return;
     }
@@ -323,183 +730,34 @@ void editor_del_char() {
             return;
         }
 
-        int target_cy = sel_min_cy;
-        int target_cx = sel_min_cx;
-
-        int new_num_lines = E.num_lines - (sel_max_cy - sel_min_cy);
-        if (new_num_lines == 0) {
-            if (E.lines) {
-                for (int i = 0; i < E.num_lines; ++i) {
-                    free(E.lines[i].text);
-                    E.lines[i].text = NULL;
-                    free(E.lines[i].hl);
-                    E.lines[i].hl = NULL;
-                }
-                free(E.lines);
-                E.lines = NULL;
-            }
-            E.lines = malloc(sizeof(EditorLine));
-            if (E.lines == NULL) {
-                editor_set_status_message("Fatal error: out of memory (empty file init after sel del).");
-                exit(1);
-            }
-            E.lines[0].text = strdup("");
-            if (E.lines[0].text == NULL) {
-                free(E.lines);
-                E.lines = NULL;
-                editor_set_status_message("Fatal error: out of memory (empty file text after sel del).");
-                exit(1);
-            }
-            E.lines[0].len = 0;
-            E.lines[0].hl = NULL;
-            E.lines[0].hl_open_comment = 0;
-            E.num_lines = 1;
-            E.cx = 0;
-            E.cy = 0;
-        } else {
-            EditorLine *new_lines = malloc(new_num_lines * sizeof(EditorLine));
-            if (new_lines == NULL) {
-                editor_set_status_message("Error: Out of memory for new lines array during deletion.");
-                return;
-            }
-
-            int current_new_line_idx = 0;
-
-            for (int r = 0; r < sel_min_cy; r++) {
-                new_lines[current_new_line_idx++] = E.lines[r];
-            }
-
-            EditorLine *start_line_orig = &E.lines[sel_min_cy];
-            EditorLine *end_line_orig = &E.lines[sel_max_cy];
-
-            size_t merged_len = sel_min_cx + (end_line_orig->len - sel_max_cx);
-            char *merged_text = malloc(merged_len + 1);
-            if (merged_text == NULL) {
-                editor_set_status_message("Error: Out of memory for merged text.");
-                free(new_lines);
-                return;
-            }
-            memcpy(merged_text, start_line_orig->text, sel_min_cx);
-            memcpy(merged_text + sel_min_cx, end_line_orig->text + sel_max_cx, end_line_orig->len - sel_max_cx);
-            merged_text[merged_len] = '\0';
-
-            new_lines[current_new_line_idx].text = merged_text;
-            new_lines[current_new_line_idx].len = merged_len;
-            new_lines[current_new_line_idx].hl = NULL;
-            new_lines[current_new_line_idx].hl_open_comment = 0;
-            current_new_line_idx++;
-
-            for (int r = sel_max_cy + 1; r < E.num_lines; r++) {
-                new_lines[current_new_line_idx++] = E.lines[r];
-            }
-
-            for (int r = sel_min_cy; r <= sel_max_cy; r++) {
-                if (r != sel_min_cy || (r == sel_min_cy && sel_min_cy != sel_max_cy)) {
-                    free(E.lines[r].text);
-                    E.lines[r].text = NULL;
-                    free(E.lines[r].hl);
-                    E.lines[r].hl = NULL;
-                }
-            }
-            if (sel_min_cy != sel_max_cy) {
-                free(start_line_orig->text);
-                start_line_orig->text = NULL;
-                free(start_line_orig->hl);
-                start_line_orig->hl = NULL;
-            }
-
-            free(E.lines);
-            E.lines = NULL;
-
-            E.lines = new_lines;
-            E.num_lines = new_num_lines;
-            E.cx = target_cx;
-            E.cy = target_cy;
+        if (sel_max_cy >= E.num_lines) {
+            sel_max_cy = E.num_lines - 1;
+            sel_max_cx = (int)buffer_line(sel_max_cy)->len;
         }
+        if (sel_min_cx > (int)buffer_line(sel_min_cy)->len) sel_min_cx = (int)buffer_line(sel_min_cy)->len;
+        if (sel_max_cx > (int)buffer_line(sel_max_cy)->len) sel_max_cx = (int)buffer_line(sel_max_cy)->len;
+
+        editor_delete_range_with_undo(sel_min_cy, sel_min_cx, sel_max_cy, sel_max_cx);
 
+        E.cx = sel_min_cx;
+        E.cy = sel_min_cy;
         E.selection_active = false;
         E.dirty = 1;
         editor_set_status_message("Selected text deleted.");
-        for (int i = target_cy; i < E.num_lines; i++) {
-            editor_update_syntax(i);
-        }
         return;
     }
 
     if (E.cy == E.num_lines || E.num_lines == 0) return;
-    if (E.cx == 0 && E.cy == 0 && E.lines[0].len == 0) return;
+    if (E.cx == 0 && E.cy == 0) return;
 
-    EditorLine *line = &E.lines[E.cy];
     if (E.cx > 0) {
-        memmove(&line->text[E.cx - 1], &line->text[E.cx], line->len - E.cx + 1);
-        line->len--;
-        line->text = realloc(line->text, line->len + 1);
-        if (line->text == NULL) {
-            editor_set_status_message("Error: Out of memory (del char realloc).");
-            return;
-        }
+        editor_delete_range_with_undo(E.cy, E.cx - 1, E.cy, E.cx);
         E.cx--;
-        E.dirty = 1;
-        editor_update_syntax(E.cy);
     } else {
-        if (E.cy > 0) {
-            EditorLine *prev_line = &E.lines[E.cy - 1];
-            prev_line->text = realloc(prev_line->text, prev_line->len + line->len + 1);
-            if (prev_line->text == NULL) {
-                editor_set_status_message("Error: Out of memory (merge line realloc).");
-                return;
-            }
-            memcpy(&prev_line->text[prev_line->len], line->text, line->len);
-            prev_line->len += line->len;
-            prev_line->text[prev_line->len] = '\0';
-
-            free(line->text);
-            line->text = NULL;
-            free(line->hl);
-            line->hl = NULL;
-
-            memmove(&E.lines[E.cy], &E.lines[E.cy + 1], (E.num_lines - E.cy - 1) * sizeof(EditorLine));
-            E.num_lines--;
-
-            if (E.num_lines > 0) {
-                EditorLine *new_lines_ptr = realloc(E.lines, E.num_lines * sizeof(EditorLine));
-                if (new_lines_ptr == NULL) {
-                    editor_set_status_message("Error: Out of memory shrinking lines realloc. Data might be inconsistent.");
-                } else {
-                    E.lines = new_lines_ptr;
-                }
-            } else {
-                if (E.lines) {
-                    free(E.lines);
-                    E.lines = NULL;
-                }
-                E.lines = malloc(sizeof(EditorLine));
-                if (E.lines == NULL) {
-                    editor_set_status_message("Fatal error: out of memory (empty file init after single del).");
-                    exit(1);
-                }
-                E.lines[0].text = strdup("");
-                if (E.lines[0].text == NULL) {
-                    free(E.lines);
-                    E.lines = NULL;
-                    editor_set_status_message("Fatal error: out of memory (empty file text after single del).");
-                    exit(1);
-                }
-                E.lines[0].len = 0;
-                E.lines[0].hl = NULL;
-                E.lines[0].hl_open_comment = 0;
-                E.num_lines = 1;
-                E.cx = 0;
-                E.cy = 0;
-                editor_update_syntax(0);
-                E.dirty = 1;
-                return;
-            }
-
-            E.cx = (int)prev_line->len;
-            E.cy--;
-            E.dirty = 1;
-            editor_update_syntax(E.cy);
-        }
+        int prev_len = (int)buffer_line(E.cy - 1)->len;
+        editor_delete_range_with_undo(E.cy - 1, prev_len, E.cy, 0);
+        E.cy--;
+        E.cx = prev_len;
     }
+    E.dirty = 1;
 }
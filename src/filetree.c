@@ -1,11 +1,22 @@
 #include"common.h"
 
+#ifdef __linux__
+#include<sys/inotify.h>
+#endif
+
 extern EditorConfig E;
 extern FileTreeState FT;
 
 void draw_file_tree();
 void refresh_flat_file_tree();
-int get_node_depth(FileTreeNode *node);
+void toggle_show_ignored();
+
+// Set while a tree-scan job is walking the working directory.
+static bool tree_scan_pending = false;
+
+// Entries read from a directory per page; a bigger directory shows a
+// "..." row that reads the next page when it is reached.
+#define FILE_TREE_PAGE 512
 
 FileTreeNode *create_file_tree_node(const char *path, bool is_dir) {
     FileTreeNode *node = malloc(sizeof(FileTreeNode));
@@ -30,62 +41,125 @@ FileTreeNode *create_file_tree_node(const char *path, bool is_dir) {
     node->children = NULL;
     node->num_children = 0;
     node->parent_index = -1;
+    node->parent = NULL;
+    node->depth = 0;
+    node->loaded = false;
+    node->dir = NULL;
+    node->more = NULL;
+    node->is_more = false;
+    node->watch = -1;
+    node->ignore = NULL;
+    node->ignored = false;
 
     return node;
 }
 
+static void file_tree_watch(FileTreeNode *node);
+static void file_tree_unwatch(FileTreeNode *node);
+
 void free_file_tree(FileTreeNode *node) {
     if (!node) return;
 
+    if (node->watch != -1) file_tree_unwatch(node);
     for (int i = 0; i < node->num_children; i++) {
         free_file_tree(node->children[i]);
     }
+    if (node->dir) closedir(node->dir);
+    ignore_dir_release(node->ignore);
+    free_file_tree(node->more);
     free(node->children);
     free(node->name);
     free(node->path);
     free(node);
 }
 
-FileTreeNode *load_directory_tree(const char *path) {
-    FileTreeNode *node = create_file_tree_node(path, true);
-    if (!node) return NULL;
+// Whether `node` has a row when its parent is expanded.
+static bool file_tree_shown(FileTreeNode *node) {
+    return !node->ignored || E.show_ignored;
+}
 
-    struct stat st;
-    if (stat(path, &st) == -1) {
-        node->is_dir = false;
-        return node;
+// Reads the next page of a directory's entries into its children. d_type
+// says which entries are directories; only symlinks and filesystems that
+// leave it unset cost a stat(). Entries the directory's ignore rules leave
+// out are kept, marked, but do not count towards the page.
+static void file_tree_load_page(FileTreeNode *node) {
+    if (!node->loaded) {
+        node->loaded = true;
+        node->dir = opendir(node->path);
+        if (node->dir) {
+            node->ignore = ignore_dir_open(node->parent ? node->parent->ignore : NULL,
+                                           dirfd(node->dir), strlen(node->path));
+        }
     }
-    node->is_dir = S_ISDIR(st.st_mode);
-
-    if (!node->is_dir) return node;
+    if (!node->dir) return;
 
-    DIR *dir = opendir(path);
-    if (!dir) return node;
+    int capacity = node->num_children + FILE_TREE_PAGE;
+    FileTreeNode **children = realloc(node->children, capacity * sizeof(FileTreeNode *));
+    if (!children) return;
+    node->children = children;
 
-    struct dirent *entry;
-    node->children = NULL;
-    node->num_children = 0;
-
-    while ((entry = readdir(dir)) != NULL) {
+    struct dirent *entry = NULL;
+    int read = 0;
+    while (read < FILE_TREE_PAGE && (entry = readdir(node->dir)) != NULL) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
             continue;
+        if (node->num_children == capacity) {
+            children = realloc(node->children, (capacity + FILE_TREE_PAGE) * sizeof(FileTreeNode *));
+            if (!children) break;
+            node->children = children;
+            capacity += FILE_TREE_PAGE;
+        }
 
         char child_path[PATH_MAX];
-        snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
+        snprintf(child_path, sizeof(child_path), "%s/%s", node->path, entry->d_name);
 
-        FileTreeNode *child = load_directory_tree(child_path);
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = stat(child_path, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        FileTreeNode *child = create_file_tree_node(child_path, is_dir);
         if (child) {
-            node->num_children++;
-            node->children = realloc(node->children, node->num_children * sizeof(FileTreeNode *));
-            if (!node->children) {
-                free_file_tree(child);
-                closedir(dir);
-                return node;
-            }
-            node->children[node->num_children - 1] = child;
+            child->parent = node;
+            child->depth = node->depth + 1;
+            child->ignored = node->ignore && ignore_match(node->ignore, child_path, strlen(child_path), entry->d_name, is_dir);
+            node->children[node->num_children++] = child;
+            if (!child->ignored) read++;
+        }
+    }
+
+    if (entry == NULL) {
+        closedir(node->dir);
+        node->dir = NULL;
+        free_file_tree(node->more);
+        node->more = NULL;
+    } else if (!node->more) {
+        char more_path[PATH_MAX];
+        snprintf(more_path, sizeof(more_path), "%s/...", node->path);
+        node->more = create_file_tree_node(more_path, false);
+        if (node->more) {
+            node->more->parent = node;
+            node->more->depth = node->depth + 1;
+            node->more->is_more = true;
         }
     }
-    closedir(dir);
+}
+
+// Reads the top level of `path` only; everything below is loaded when it
+// is expanded.
+FileTreeNode *load_directory_tree(const char *path) {
+    FileTreeNode *node = create_file_tree_node(path, true);
+    if (!node) return NULL;
+
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        node->is_dir = false;
+        return node;
+    }
+    node->is_dir = S_ISDIR(st.st_mode);
+
+    if (node->is_dir) file_tree_load_page(node);
     return node;
 }
 
@@ -99,8 +173,9 @@ void flatten_file_tree(FileTreeNode *node, FileTreeNode ***array, int *count, in
     (*array)[(*count)++] = node;
     if (node->is_dir && node->expanded) {
         for (int i = 0; i < node->num_children; i++) {
-            flatten_file_tree(node->children[i], array, count, capacity);
+            if (file_tree_shown(node->children[i])) flatten_file_tree(node->children[i], array, count, capacity);
         }
+        if (node->more) flatten_file_tree(node->more, array, count, capacity);
     }
 }
 
@@ -111,35 +186,241 @@ void refresh_flat_file_tree() {
 
     FT.flat_nodes = NULL;
     FT.flat_node_count = 0;
-    int capacity = 0;
+    FT.max_nodes = 0;
 
     if (FT.root) {
-        flatten_file_tree(FT.root, &FT.flat_nodes, &FT.flat_node_count, &capacity);
+        flatten_file_tree(FT.root, &FT.flat_nodes, &FT.flat_node_count, &FT.max_nodes);
     }
 }
 
-int get_node_depth(FileTreeNode *node) {
-    if (!node || !node->path) return 0;
+// Rows `node` and everything shown under it take up in the flat view.
+static int file_tree_visible_rows(FileTreeNode *node) {
+    int rows = 1;
+    if (node->is_dir && node->expanded) {
+        for (int i = 0; i < node->num_children; i++) {
+            if (file_tree_shown(node->children[i])) rows += file_tree_visible_rows(node->children[i]);
+        }
+        if (node->more) rows++;
+    }
+    return rows;
+}
 
-    int depth = 0;
-    const char *path = node->path;
-    for (const char *c = path; *c; c++) {
-        if (*c == '/') depth++;
+// Where `node` sits in the flat view, or -1 when a collapsed ancestor
+// hides it, or it or an ancestor is ignored.
+static int file_tree_flat_index(FileTreeNode *node) {
+    if (!file_tree_shown(node)) return -1;
+    for (FileTreeNode *up = node->parent; up; up = up->parent) {
+        if (!up->expanded || !file_tree_shown(up)) return -1;
+    }
+    for (int i = 0; i < FT.flat_node_count; i++) {
+        if (FT.flat_nodes[i] == node) return i;
     }
-    if (FT.root && FT.root->path) {
-        const char *root_path = FT.root->path;
-        int root_depth = 0;
-        for (const char *c = root_path; *c; c++) {
-            if (*c == '/') root_depth++;
+    return -1;
+}
+
+// Moves a flat view position past rows spliced in at `at`, or onto `at`
+// when the rows removed there included it, so the cursor and the top row
+// stay on the nodes they were on.
+static int file_tree_shift_row(int row, int at, int delta) {
+    if (delta > 0) return row >= at ? row + delta : row;
+    if (row >= at - delta) return row + delta;
+    return row >= at ? at : row;
+}
+
+static void file_tree_shift_view(int at, int delta) {
+    E.file_tree_cursor = file_tree_shift_row(E.file_tree_cursor, at, delta);
+    E.file_tree_offset = file_tree_shift_row(E.file_tree_offset, at, delta);
+    if (E.file_tree_cursor >= FT.flat_node_count) E.file_tree_cursor = FT.flat_node_count - 1;
+    if (E.file_tree_cursor < 0) E.file_tree_cursor = 0;
+    if (E.file_tree_offset > E.file_tree_cursor) E.file_tree_offset = E.file_tree_cursor;
+}
+
+// Replaces `remove` rows of the flat view at `at` with `count` new ones,
+// so a change to the tree costs a memmove of the rows after it rather than
+// a walk of everything expanded.
+static void file_tree_flat_splice(int at, int remove, FileTreeNode **rows, int count) {
+    int new_count = FT.flat_node_count - remove + count;
+    if (new_count > FT.max_nodes) {
+        int new_cap = FT.max_nodes ? FT.max_nodes : 64;
+        while (new_cap < new_count) new_cap *= 2;
+        FileTreeNode **new_nodes = realloc(FT.flat_nodes, new_cap * sizeof(FileTreeNode *));
+        if (!new_nodes) {
+            // The tree itself is already updated; rebuild from it.
+            refresh_flat_file_tree();
+            return;
+        }
+        FT.flat_nodes = new_nodes;
+        FT.max_nodes = new_cap;
+    }
+    memmove(&FT.flat_nodes[at + count], &FT.flat_nodes[at + remove],
+            (FT.flat_node_count - at - remove) * sizeof(FileTreeNode *));
+    if (count > 0) memcpy(&FT.flat_nodes[at], rows, count * sizeof(FileTreeNode *));
+    FT.flat_node_count = new_count;
+    if (remove > 0) file_tree_shift_view(at, -remove);
+    if (count > 0) file_tree_shift_view(at, count);
+}
+
+static void file_tree_flat_insert(int at, FileTreeNode *node) {
+    file_tree_flat_splice(at, 0, &node, 1);
+}
+
+static void file_tree_flat_remove(int at, int count) {
+    file_tree_flat_splice(at, count, NULL, 0);
+}
+
+#ifdef __linux__
+
+// Every loaded directory is watched with inotify, so files a checkout or a
+// build creates, deletes or renames show up without rescanning. Events
+// come in through the event loop and patch the nodes and the flat view in
+// place.
+static int tree_inotify_fd = -1;
+// Watched directories by watch descriptor.
+static FileTreeNode **tree_watches = NULL;
+static int tree_watches_cap = 0;
+
+static void file_tree_inotify_ready(int fd, void *data);
+
+static void file_tree_watch(FileTreeNode *node) {
+    if (node->watch != -1 || !node->is_dir) return;
+    if (tree_inotify_fd == -1) {
+        tree_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (tree_inotify_fd == -1) return;
+        if (event_watch_fd(tree_inotify_fd, file_tree_inotify_ready, NULL) == -1) {
+            close(tree_inotify_fd);
+            tree_inotify_fd = -1;
+            return;
+        }
+    }
+
+    // Without a watch, say past fs.inotify.max_user_watches, the directory
+    // just stays as it was loaded.
+    int wd = inotify_add_watch(tree_inotify_fd, node->path,
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK);
+    if (wd == -1) return;
+    if (wd >= tree_watches_cap) {
+        int new_cap = tree_watches_cap ? tree_watches_cap * 2 : 64;
+        while (new_cap <= wd) new_cap *= 2;
+        FileTreeNode **new_watches = realloc(tree_watches, new_cap * sizeof(FileTreeNode *));
+        if (!new_watches) {
+            inotify_rm_watch(tree_inotify_fd, wd);
+            return;
+        }
+        memset(new_watches + tree_watches_cap, 0, (new_cap - tree_watches_cap) * sizeof(FileTreeNode *));
+        tree_watches = new_watches;
+        tree_watches_cap = new_cap;
+    }
+    // A directory reached twice through a symlink shares one watch; the
+    // node that got it first keeps it.
+    if (tree_watches[wd]) return;
+    tree_watches[wd] = node;
+    node->watch = wd;
+}
+
+static void file_tree_unwatch(FileTreeNode *node) {
+    inotify_rm_watch(tree_inotify_fd, node->watch);
+    tree_watches[node->watch] = NULL;
+    node->watch = -1;
+}
+
+static FileTreeNode *file_tree_child(FileTreeNode *dir, const char *name, int *index) {
+    for (int i = 0; i < dir->num_children; i++) {
+        if (strcmp(dir->children[i]->name, name) == 0) {
+            if (index) *index = i;
+            return dir->children[i];
         }
-        depth -= root_depth;
-        if (depth < 0) depth = 0;
     }
-    return depth;
+    return NULL;
 }
 
+static void file_tree_add_entry(FileTreeNode *dir, const char *name, bool is_dir) {
+    // A directory still being paged in will list the entry itself, if its
+    // stream has not gone past it.
+    if (dir->dir || file_tree_child(dir, name, NULL)) return;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+    struct stat st;
+    if (!is_dir) is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+
+    FileTreeNode **children = realloc(dir->children, (dir->num_children + 1) * sizeof(FileTreeNode *));
+    if (!children) return;
+    dir->children = children;
+    FileTreeNode *child = create_file_tree_node(path, is_dir);
+    if (!child) return;
+    child->parent = dir;
+    child->depth = dir->depth + 1;
+    child->ignored = dir->ignore && ignore_match(dir->ignore, path, strlen(path), name, is_dir);
+    dir->children[dir->num_children++] = child;
+
+    int at = file_tree_flat_index(dir);
+    if (at != -1 && dir->expanded && file_tree_shown(child)) file_tree_flat_insert(at + file_tree_visible_rows(dir) - 1, child);
+}
+
+static void file_tree_remove_entry(FileTreeNode *dir, const char *name) {
+    int index;
+    FileTreeNode *child = file_tree_child(dir, name, &index);
+    if (!child) return;
+
+    int at = file_tree_flat_index(child);
+    if (at != -1) file_tree_flat_remove(at, file_tree_visible_rows(child));
+    memmove(&dir->children[index], &dir->children[index + 1], (dir->num_children - index - 1) * sizeof(FileTreeNode *));
+    dir->num_children--;
+    free_file_tree(child);
+}
+
+static void file_tree_inotify_ready(int fd, void *data) {
+    (void)data;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + len; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                editor_set_status_message("File tree: too many changes at once, some are not shown.");
+                continue;
+            }
+            FileTreeNode *dir = event->wd >= 0 && event->wd < tree_watches_cap ? tree_watches[event->wd] : NULL;
+            if (!dir) continue;
+            if (event->mask & IN_IGNORED) {
+                tree_watches[event->wd] = NULL;
+                dir->watch = -1;
+            } else if (event->len == 0) {
+                continue;
+            } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                file_tree_add_entry(dir, event->name, event->mask & IN_ISDIR);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                file_tree_remove_entry(dir, event->name);
+            }
+        }
+    }
+}
+
+#else
+
+static void file_tree_watch(FileTreeNode *node) {
+    (void)node;
+}
+
+static void file_tree_unwatch(FileTreeNode *node) {
+    node->watch = -1;
+}
+
+#endif
+
 void draw_file_tree() {
-    if (!E.file_tree_visible || !FT.flat_nodes) return;
+    if (!E.file_tree_visible) return;
+    if (!FT.flat_nodes) {
+        // The scan job hasn't delivered the tree yet.
+        for (int y = 0; y < E.screen_rows; y++) {
+            mvhline(y, 0, ' ', FILE_TREE_WIDTH - 1);
+            mvaddch(y, FILE_TREE_WIDTH - 1, ACS_VLINE);
+        }
+        if (tree_scan_pending) mvprintw(0, 1, "Loading...");
+        return;
+    }
 
     int max_rows = E.screen_rows;
     int start = E.file_tree_offset;
@@ -149,31 +430,35 @@ void draw_file_tree() {
     for (int i = start; i < end; i++) {
         FileTreeNode *node = FT.flat_nodes[i];
         int y = i - start;
-        move(y, 0);
-        clrtoeol();
+        // Only the tree's own columns are touched, so the text rows next to
+        // it keep what editor_draw_rows() last drew there.
+        mvhline(y, 0, ' ', FILE_TREE_WIDTH - 1);
 
-        int indent = get_node_depth(node) * 2;
+        int indent = node->depth * 2;
         if (indent > 20) indent = 20;
 
-        if (node->is_dir) {
+        int name_width = FILE_TREE_WIDTH - 1 - indent - (node->is_dir ? 4 : 1);
+        if (name_width < 0) name_width = 0;
+        if (node->is_more) {
+            mvprintw(y, indent, " %.*s", name_width, "...");
+        } else if (node->is_dir) {
             if (node->expanded)
-                mvprintw(y, indent, "[-] %s", node->name);
+                mvprintw(y, indent, "[-] %.*s", name_width, node->name);
             else
-                mvprintw(y, indent, "[+] %s", node->name);
+                mvprintw(y, indent, "[+] %.*s", name_width, node->name);
         } else {
-            mvprintw(y, indent, " %s", node->name);
+            mvprintw(y, indent, " %.*s", name_width, node->name);
         }
 
         if (i == E.file_tree_cursor) {
             attron(A_REVERSE);
-            mvchgat(y, 0, -1, A_REVERSE, 0, NULL);
+            mvchgat(y, 0, FILE_TREE_WIDTH - 1, A_REVERSE, 0, NULL);
             attroff(A_REVERSE);
         }
     }
 
     for (int i = end; i < max_rows; i++) {
-        move(i, 0);
-        clrtoeol();
+        mvhline(i, 0, ' ', FILE_TREE_WIDTH - 1);
     }
 
     for (int y = 0; y < E.screen_rows; y++) {
@@ -181,18 +466,47 @@ void draw_file_tree() {
     }
 }
 
+typedef struct {
+    char path[PATH_MAX];
+    FileTreeNode *root;
+} TreeScanJob;
+
+// Reads the top level on a worker; the tree only touches its own nodes
+// until the UI thread adopts it.
+static void tree_scan_job_run(Job *job) {
+    TreeScanJob *scan = job->data;
+    scan->root = load_directory_tree(scan->path);
+}
+
+static void tree_scan_job_finish(Job *job, bool cancelled) {
+    TreeScanJob *scan = job->data;
+    tree_scan_pending = false;
+    if (!cancelled && scan->root && !FT.root) {
+        FT.root = scan->root;
+        FT.root->expanded = true;
+        file_tree_watch(FT.root);
+        refresh_flat_file_tree();
+        E.file_tree_cursor = 0;
+        E.file_tree_offset = 0;
+    } else {
+        free_file_tree(scan->root);
+    }
+    free(scan);
+}
+
 void toggle_file_tree() {
     E.file_tree_visible = !E.file_tree_visible;
     if (E.file_tree_visible) {
-        if (!FT.root) {
-            char cwd[PATH_MAX];
-            if (!getcwd(cwd, sizeof(cwd))) strcpy(cwd, ".");
-            FT.root = load_directory_tree(cwd);
-            if (FT.root) {
-                FT.root->expanded = true;
-                refresh_flat_file_tree();
-                E.file_tree_cursor = 0;
-                E.file_tree_offset = 0;
+        if (!FT.root && !tree_scan_pending) {
+            TreeScanJob *scan = malloc(sizeof(TreeScanJob));
+            if (scan) {
+                if (!getcwd(scan->path, sizeof(scan->path))) strcpy(scan->path, ".");
+                scan->root = NULL;
+                tree_scan_pending = true;
+                if (job_submit(JOB_TREE_SCAN, tree_scan_job_run, tree_scan_job_finish, scan) == -1) {
+                    tree_scan_pending = false;
+                    free(scan);
+                }
             }
         }
     }
@@ -200,6 +514,35 @@ void toggle_file_tree() {
     editor_refresh_screen();
 }
 
+// Flattens `node`'s children from `first` on, and its "..." row, into a
+// new array for splicing in under it.
+static FileTreeNode **file_tree_flatten_children(FileTreeNode *node, int first, int *count) {
+    FileTreeNode **rows = NULL;
+    int capacity = 0;
+    *count = 0;
+    for (int i = first; i < node->num_children; i++) {
+        if (file_tree_shown(node->children[i])) flatten_file_tree(node->children[i], &rows, count, &capacity);
+    }
+    if (node->more) flatten_file_tree(node->more, &rows, count, &capacity);
+    return rows;
+}
+
+// Reads the next page of the directory whose "..." row is at `row` and
+// splices it in there. The cursor lands on the first entry read.
+static void file_tree_load_more(int row) {
+    FileTreeNode *dir = FT.flat_nodes[row]->parent;
+    int first = dir->num_children;
+    file_tree_load_page(dir);
+
+    // A directory read to the end has freed its "..." row; only the stale
+    // pointer is left in the flat view.
+    int count;
+    FileTreeNode **rows = file_tree_flatten_children(dir, first, &count);
+    file_tree_flat_splice(row, 1, rows, count);
+    free(rows);
+    E.file_tree_cursor = row < FT.flat_node_count ? row : FT.flat_node_count - 1;
+}
+
 void file_tree_move_cursor(int direction) {
     if (!E.file_tree_visible || !FT.flat_nodes) return;
 
@@ -208,6 +551,11 @@ void file_tree_move_cursor(int direction) {
     if (E.file_tree_cursor >= FT.flat_node_count)
         E.file_tree_cursor = FT.flat_node_count - 1;
 
+    // Scrolling onto the "..." row pages the rest of the directory in.
+    if (FT.flat_nodes[E.file_tree_cursor]->is_more) {
+        file_tree_load_more(E.file_tree_cursor);
+    }
+
     if (E.file_tree_cursor < E.file_tree_offset) {
         E.file_tree_offset = E.file_tree_cursor;
     } else if (E.file_tree_cursor >= E.file_tree_offset + E.screen_rows) {
@@ -218,12 +566,27 @@ void file_tree_move_cursor(int direction) {
 void file_tree_toggle_expand() {
     if (!E.file_tree_visible || !FT.flat_nodes || E.file_tree_cursor >= FT.flat_node_count) return;
 
-    FileTreeNode *node = FT.flat_nodes[E.file_tree_cursor];
-    if (node->is_dir) {
-        node->expanded = !node->expanded;
-        refresh_flat_file_tree();
-        if (E.file_tree_cursor >= FT.flat_node_count)
-            E.file_tree_cursor = FT.flat_node_count - 1;
+    int row = E.file_tree_cursor;
+    FileTreeNode *node = FT.flat_nodes[row];
+    if (node->is_more) {
+        file_tree_load_more(row);
+    } else if (node->is_dir && node->expanded) {
+        // Everything shown under the directory is deeper than it.
+        node->expanded = false;
+        int end = row + 1;
+        while (end < FT.flat_node_count && FT.flat_nodes[end]->depth > node->depth) end++;
+        file_tree_flat_remove(row + 1, end - row - 1);
+    } else if (node->is_dir) {
+        node->expanded = true;
+        if (!node->loaded) {
+            // Watched first, so nothing created meanwhile is missed.
+            file_tree_watch(node);
+            file_tree_load_page(node);
+        }
+        int count;
+        FileTreeNode **rows = file_tree_flatten_children(node, 0, &count);
+        file_tree_flat_splice(row + 1, 0, rows, count);
+        free(rows);
     }
 }
 
@@ -231,123 +594,274 @@ void file_tree_open_file() {
     if (!E.file_tree_visible || !FT.flat_nodes || E.file_tree_cursor >= FT.flat_node_count) return;
 
     FileTreeNode *node = FT.flat_nodes[E.file_tree_cursor];
-    if (!node->is_dir) {
+    if (node->is_more) {
+        file_tree_load_more(E.file_tree_cursor);
+    } else if (!node->is_dir) {
         editor_read_file(node->path);
         toggle_file_tree();
     }
 }
 
-void editor_find() {
-    char *query = editor_prompt("Search (Use arrows to navigate, ESC to cancel): %s",
-                                 E.search_query ? E.search_query : "");
+// Shows or hides what ignore files leave out, in the tree and in the next
+// find in files. The cursor stays on its entry, or moves up to the nearest
+// directory above it still shown.
+void toggle_show_ignored() {
+    E.show_ignored = !E.show_ignored;
+    editor_set_status_message("Ignored files %s", E.show_ignored ? "shown" : "hidden");
+    if (!FT.root || !FT.flat_nodes || E.file_tree_cursor >= FT.flat_node_count) return;
 
-    if (query == NULL) {
-        editor_set_status_message("");
-        E.find_active = false;
-        for (int i = 0; i < E.num_lines; i++) {
-            editor_update_syntax(i);
-        }
-        editor_refresh_screen();
-        return;
+    FileTreeNode *node = FT.flat_nodes[E.file_tree_cursor];
+    for (FileTreeNode *up = node; up; up = up->parent) {
+        if (!file_tree_shown(up)) node = up->parent;
+    }
+    refresh_flat_file_tree();
+    int at = file_tree_flat_index(node);
+    E.file_tree_cursor = at != -1 ? at : 0;
+    if (E.file_tree_cursor < E.file_tree_offset) {
+        E.file_tree_offset = E.file_tree_cursor;
+    } else if (E.file_tree_cursor >= E.file_tree_offset + E.screen_rows) {
+        E.file_tree_offset = E.file_tree_cursor - E.screen_rows + 1;
     }
+}
 
-    if (E.search_query) {
-        if (strcmp(E.search_query, query) != 0) {
-            free(E.search_query);
-            E.search_query = query;
-            E.last_match_row = -1;
-            E.last_match_col = -1;
-        } else {
-            free(query);
-        }
-    } else {
-        E.search_query = query;
+// Where the cursor was when the find prompt opened; each new query searches
+// from here, and ESC returns to it.
+static int find_origin_row, find_origin_col;
+
+// Searches as the query is typed, and moves between matches on the arrow
+// keys without leaving the prompt.
+static const char *editor_find_callback(const char *input, int key) {
+    static char note[64];
+
+    if ((key == KEY_UP || key == KEY_DOWN) && E.search_query) {
+        editor_find_next(key == KEY_DOWN ? 1 : -1);
+    } else if (input[0] == '\0' ? E.search_query != NULL : !E.search_query || strcmp(input, E.search_query) != 0) {
+        free(E.search_query);
+        E.search_query = input[0] ? strdup(input) : NULL;
         E.last_match_row = -1;
         E.last_match_col = -1;
+        E.cy = find_origin_row;
+        E.cx = find_origin_col;
+        job_cancel(JOB_SEARCH);
+        E.find_active = E.search_query != NULL;
+        if (E.search_query) editor_find_next(1);
     }
 
-    E.find_active = true;
-    editor_find_next(1);
+    if (!E.search_query || !match_index_describe(E.search_query, E.last_match_row, E.last_match_col, note, sizeof(note))) {
+        return NULL;
+    }
+    return note;
 }
 
-void editor_find_next(int direction) {
-    if (E.search_query == NULL) return;
+void editor_find() {
+    find_origin_row = E.cy;
+    find_origin_col = E.cx;
+    char *query = editor_prompt("Search (/regex/, arrows to navigate, ESC to cancel): ",
+                                 editor_find_callback);
 
-    int current_row = E.last_match_row;
-    int current_col = E.last_match_col;
+    if (query == NULL || query[0] == '\0') {
+        free(query);
+        editor_set_status_message("");
+        E.find_active = false;
+        job_cancel(JOB_SEARCH);
+        match_index_stop();
+        E.cy = find_origin_row;
+        E.cx = find_origin_col;
+        editor_refresh_screen();
+        return;
+    }
+    free(query);
 
-    if (current_row == -1) {
-        current_row = E.cy;
-        current_col = E.cx;
-        E.search_direction = direction;
+    // The callback has already searched for the query; report where it
+    // got to, or search again if nothing came back yet.
+    E.find_active = true;
+    if (E.last_match_row != -1) {
+        editor_find_report();
     } else {
-        current_col += direction;
+        editor_find_next(1);
     }
+}
 
-    size_t query_len = strlen(E.search_query);
-    int original_row = current_row;
-    int original_col = current_col;
+// Puts the find result on the status bar, with the match's place among
+// all of them once the match index has it.
+void editor_find_report() {
+    char note[64];
+    if (match_index_describe(E.search_query, E.last_match_row, E.last_match_col, note, sizeof(note))) {
+        editor_set_status_message("Found '%s': %s", E.search_query, note);
+    } else {
+        editor_set_status_message("Found '%s' at %d:%d", E.search_query, E.cy + 1, E.cx + 1);
+    }
+}
 
-    while (1) {
-        if (current_row < 0 || current_row >= E.num_lines) break;
+static void editor_find_goto(int row, int col) {
+    E.cy = row;
+    E.cx = col;
+    E.last_match_row = row;
+    E.last_match_col = col;
+    editor_find_report();
+}
 
-        EditorLine *line = &E.lines[current_row];
-        char *match = NULL;
+// Bytes a search job scans per hold of the buffer lock.
+#define SEARCH_JOB_CHUNK (1 << 20)
+// How long a search runs before the status bar says it is still going.
+#define SEARCH_NOTICE_MS 200
+
+typedef struct {
+    char *query;
+    SearchPattern pattern;
+    int row;
+    int col;
+    int direction;
+    bool found;
+    int match_row;
+    int match_col;
+} SearchJob;
+
+static long long search_clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
+// Scans from the start position in the search direction, wrapping around
+// once. A file that is still being indexed is streamed: missing lines are
+// waited for rather than treated as the end.
+static void search_job_run(Job *job) {
+    SearchJob *search = job->data;
+    int direction = search->direction;
+    int row = search->row;
+    int col = search->col;
+    bool wrapped = false;
+    long long started = search_clock_ms();
+    bool announced = false;
+
+    buffer_lock();
+    while (!job_cancelled(job)) {
+        int limit;
         if (direction == 1) {
-            if (current_col >= (int)line->len) {
-                current_row++;
-                current_col = 0;
-                continue;
-            }
-            match = strstr(line->text + current_col, E.search_query);
+            limit = wrapped && search->row + 1 < E.num_lines ? search->row + 1 : E.num_lines;
         } else {
-            if (current_col < 0) {
-                current_row--;
-                if (current_row < 0) break;
-                current_col = (int)E.lines[current_row].len - 1;
+            if (row >= E.num_lines) {
+                row = E.num_lines - 1;
+                col = INT_MAX;
+            }
+            limit = wrapped ? search->row - 1 : -1;
+        }
+
+        size_t budget = SEARCH_JOB_CHUNK;
+        if (search_buffer(&search->pattern, direction, &row, &col, limit, &budget)) {
+            search->found = true;
+            search->match_row = row;
+            search->match_col = col;
+            break;
+        }
+
+        if (row == limit) {
+            if (direction == 1 && !wrapped && E.indexing) {
+                buffer_wait_grown();
                 continue;
             }
-            for (int i = current_col; i >= 0; i--) {
-                if ((size_t)i + query_len <= line->len && strncmp(line->text + i, E.search_query, query_len) == 0) {
-                    match = line->text + i;
-                    break;
-                }
+            if (wrapped) break;
+            if (direction == 1) {
+                row = 0;
+                col = 0;
+            } else {
+                while (E.indexing && !job_cancelled(job)) buffer_wait_grown();
+                row = E.num_lines - 1;
+                col = INT_MAX;
             }
+            wrapped = true;
+            continue;
         }
 
-        if (match) {
-            E.cy = current_row;
-            E.cx = match - line->text;
-            E.last_match_row = E.cy;
-            E.last_match_col = E.cx;
-            editor_set_status_message("Found '%s' at %d:%d", E.search_query, E.cy + 1, E.cx + 1);
-            editor_refresh_screen();
-            return;
+        if (!announced && search_clock_ms() - started >= SEARCH_NOTICE_MS) {
+            editor_set_status_message("Searching for '%s'...", search->query);
+            event_wake();
+            announced = true;
         }
+        buffer_yield();
+    }
+    buffer_unlock();
+}
 
-        if (direction == 1) {
-            current_row++;
-            current_col = 0;
+static void search_job_finish(Job *job, bool cancelled) {
+    SearchJob *search = job->data;
+    if (!cancelled) {
+        EditorLine *line = search->found ? buffer_line(search->match_row) : NULL;
+        size_t match_start, match_len;
+        if (line && search_pattern_match(&search->pattern, line->text, line->len, search->match_col, 1, &match_start, &match_len) &&
+            match_start == (size_t)search->match_col) {
+            editor_find_goto(search->match_row, search->match_col);
+        } else if (search->found) {
+            // An edit moved the match while the job ran; look again.
+            editor_find_next(search->direction);
         } else {
-            current_row--;
-            current_col = (int)E.lines[current_row].len - 1;
+            editor_set_status_message("No more matches for '%s'", search->query);
+            E.last_match_row = -1;
+            E.last_match_col = -1;
         }
+    }
+    search_pattern_free(&search->pattern);
+    free(search->query);
+    free(search);
+}
 
-        if (current_row >= E.num_lines) {
-            current_row = 0;
-            current_col = 0;
-        } else if (current_row < 0) {
-            current_row = E.num_lines - 1;
-            current_col = (int)E.lines[E.num_lines - 1].len - 1;
-        }
+// Moves to the match after the last one, or after the cursor. The match
+// index answers straight away when it covers that stretch of the buffer;
+// otherwise a search job scans for it, superseding any still running, and
+// its result moves the cursor when it comes back to the event loop.
+void editor_find_next(int direction) {
+    if (E.search_query == NULL) return;
 
-        if (current_row == original_row && current_col == original_col) {
-            break;
-        }
+    int current_row = E.last_match_row;
+    int current_col = E.last_match_col;
+
+    if (current_row == -1) {
+        current_row = E.cy;
+        current_col = E.cx;
+        E.search_direction = direction;
+    } else {
+        current_col += direction;
     }
-    editor_set_status_message("No more matches for '%s'", E.search_query);
-    E.last_match_row = -1;
-    E.last_match_col = -1;
-    editor_refresh_screen();
+
+    int match_row, match_col;
+    if (match_index_next(current_row, current_col, direction, &match_row, &match_col)) {
+        job_cancel(JOB_SEARCH);
+        editor_find_goto(match_row, match_col);
+        // Picks up counting again if leaving find stopped it.
+        match_index_update(E.search_query);
+        return;
+    }
+
+    SearchJob *search = malloc(sizeof(SearchJob));
+    char *query = strdup(E.search_query);
+    if (search == NULL || query == NULL) {
+        free(search);
+        free(query);
+        editor_set_status_message("Search error: Out of memory.");
+        return;
+    }
+    char error[128];
+    if (search_pattern_init(&search->pattern, query, error, sizeof(error)) == -1) {
+        free(search);
+        free(query);
+        editor_set_status_message("Regex error: %s", error);
+        return;
+    }
+    search->query = query;
+    search->row = current_row;
+    search->col = current_col;
+    search->direction = direction;
+    search->found = false;
+
+    job_cancel(JOB_SEARCH);
+    if (job_submit(JOB_SEARCH, search_job_run, search_job_finish, search) == -1) {
+        search_pattern_free(&search->pattern);
+        free(search->query);
+        free(search);
+        editor_set_status_message("Search error: Out of memory.");
+        return;
+    }
+    // Queued after the search, which usually needs to look much less far.
+    match_index_update(E.search_query);
 }
@@ -0,0 +1,610 @@
+#include"common.h"
+#include<stdint.h>
+
+extern EditorConfig E;
+
+// Languages can be added without recompiling by dropping a grammar file in
+// ~/.nimki/syntax/. Each line is a directive; '#' starts a comment line:
+//
+//     name rust
+//     extensions .rs
+//     keywords1 fn let mut if else match loop while for return
+//     keywords2 i32 u32 i64 u64 bool str String
+//     line_comment //
+//     preproc #
+//     numbers on
+//     region comment /* */ multiline nested
+//     region string " " escape=\ multiline
+//     region string r#" "#
+//
+// A region is a delimited span painted in one class (comment, string,
+// keyword1, keyword2, number, preproc). Regions only continue onto the next
+// line when marked multiline, and nested ones count their openers so
+// `/* /* */ */` closes where it should. Files are compiled into the same
+// transition tables the built-in languages use, and the compiled form is
+// cached in ~/.nimki/syntax/.cache so later startups skip the parsing as long
+// as no grammar file changed.
+
+#define GRAMMAR_CACHE_MAGIC "NIMKIGR1"
+// Bounds on a cached keyword pool and hash table; anything bigger is taken
+// for a corrupt cache rather than allocated.
+#define GRAMMAR_CACHE_MAX_WORDS (1 << 24)
+#define GRAMMAR_CACHE_MAX_SLOTS (1 << 22)
+
+// One grammar source file, as recorded in the cache to detect changes.
+typedef struct {
+    char name[256];
+    int64_t mtime;
+    int64_t size;
+} GrammarSource;
+
+static Grammar **user_grammars = NULL;
+static int num_user_grammars = 0;
+static bool user_grammars_loaded = false;
+
+char* get_home_directory();
+
+void grammar_free(Grammar *grammar) {
+    if (grammar == NULL) return;
+    free(grammar->keywords);
+    free(grammar->special);
+    free(grammar->words);
+    free(grammar);
+}
+
+static unsigned int grammar_keyword_hash(const char *s, size_t len, unsigned int seed) {
+    unsigned int h = seed ^ 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h ^ (unsigned int)len;
+}
+
+static bool grammar_has_separator(const char *word) {
+    for (const char *p = word; *p; p++) {
+        if (is_separator((unsigned char)*p)) return true;
+    }
+    return false;
+}
+
+// Finds the keyword starting at `i` and ending at a separator or the end of
+// the line, or returns NULL. `text` need not be NUL-terminated.
+const GrammarKeyword *grammar_match_keyword(Grammar *grammar, const char *text, size_t len, size_t i) {
+    size_t end = i;
+    while (end < len && !(grammar->code_action[(unsigned char)text[end]] & GRAMMAR_SEPARATOR)) end++;
+
+    const GrammarKeyword *found = NULL;
+    if (end > i) {
+        const GrammarKeyword *slot = &grammar->keywords[grammar_keyword_hash(&text[i], end - i, grammar->keyword_seed) & grammar->keyword_mask];
+        if (slot->len == end - i && memcmp(grammar->words + slot->offset, &text[i], slot->len) == 0) {
+            found = slot;
+        }
+    }
+
+    for (int k = 0; k < grammar->num_special; k++) {
+        const GrammarKeyword *entry = &grammar->special[k];
+        if (found && found->order < entry->order) break;
+        if (i + entry->len <= len && memcmp(grammar->words + entry->offset, &text[i], entry->len) == 0 &&
+            (i + entry->len == len || (grammar->code_action[(unsigned char)text[i + entry->len]] & GRAMMAR_SEPARATOR))) {
+            found = entry;
+            break;
+        }
+    }
+    return found;
+}
+
+// Tries seeds until every plain keyword lands in its own slot, growing the
+// table if none works, so a lookup is one hash and one memcmp. Returns
+// false only when out of memory.
+static bool grammar_place_keywords(Grammar *grammar, GrammarKeyword *plain, int num_plain) {
+    unsigned int size = 8;
+    while (size < (unsigned int)num_plain * 2) size *= 2;
+
+    for (;;) {
+        GrammarKeyword *slots = calloc(size, sizeof(GrammarKeyword));
+        if (slots == NULL) return false;
+
+        for (unsigned int seed = 0; seed < 256; seed++) {
+            bool collided = false;
+            for (int k = 0; k < num_plain && !collided; k++) {
+                const char *word = grammar->words + plain[k].offset;
+                GrammarKeyword *slot = &slots[grammar_keyword_hash(word, plain[k].len, seed) & (size - 1)];
+                if (slot->len) {
+                    collided = true;
+                } else {
+                    *slot = plain[k];
+                }
+            }
+            if (!collided) {
+                grammar->keywords = slots;
+                grammar->keyword_mask = size - 1;
+                grammar->keyword_seed = seed;
+                return true;
+            }
+            memset(slots, 0, size * sizeof(GrammarKeyword));
+        }
+        free(slots);
+        size *= 2;
+    }
+}
+
+// Copies both keyword lists into the grammar's word pool and hashes them.
+// Keywords containing a separator (CSS's "font-size", the shell's ".") can't
+// be found by scanning to the next separator and go on the special list.
+static bool grammar_add_keywords(Grammar *grammar, char **keywords1, int count1, char **keywords2, int count2) {
+    int total = count1 + count2;
+    size_t pool = 0;
+    for (int k = 0; k < total; k++) {
+        pool += strlen(k < count1 ? keywords1[k] : keywords2[k - count1]);
+    }
+
+    grammar->words = malloc(pool + 1);
+    grammar->special = malloc((total + 1) * sizeof(GrammarKeyword));
+    GrammarKeyword *plain = malloc((total + 1) * sizeof(GrammarKeyword));
+    if (grammar->words == NULL || grammar->special == NULL || plain == NULL) {
+        free(plain);
+        return false;
+    }
+
+    int num_plain = 0;
+    for (int k = 0; k < total; k++) {
+        const char *word = k < count1 ? keywords1[k] : keywords2[k - count1];
+        size_t len = strlen(word);
+        if (len == 0 || len > USHRT_MAX) continue;
+
+        GrammarKeyword entry = { grammar->words_len, (unsigned short)len, k < count1 ? HL_KEYWORD1 : HL_KEYWORD2, (unsigned short)k };
+        memcpy(grammar->words + grammar->words_len, word, len);
+        grammar->words_len += len;
+
+        if (grammar_has_separator(word)) {
+            grammar->special[grammar->num_special++] = entry;
+            continue;
+        }
+        bool duplicate = false;
+        for (int j = 0; j < num_plain && !duplicate; j++) {
+            duplicate = plain[j].len == len && memcmp(grammar->words + plain[j].offset, word, len) == 0;
+        }
+        if (!duplicate) plain[num_plain++] = entry;
+    }
+
+    bool placed = grammar_place_keywords(grammar, plain, num_plain);
+    free(plain);
+    return placed;
+}
+
+// Fills in the per-byte action tables the scanner runs on.
+static void grammar_build_tables(Grammar *grammar) {
+    memset(grammar->code_action, 0, sizeof(grammar->code_action));
+    memset(grammar->region_action, 0, sizeof(grammar->region_action));
+    memset(grammar->open_first, 0, sizeof(grammar->open_first));
+
+    for (int c = 0; c < 256; c++) {
+        if (is_separator(c)) grammar->code_action[c] |= GRAMMAR_SEPARATOR;
+        if (isdigit(c) && grammar->numbers) grammar->code_action[c] |= GRAMMAR_DIGIT;
+    }
+    if (grammar->line_comment_len) {
+        grammar->code_action[(unsigned char)grammar->line_comment[0]] |= GRAMMAR_LINE_COMMENT;
+    }
+    if (grammar->preproc) grammar->code_action[grammar->preproc] |= GRAMMAR_PREPROC;
+
+    for (int r = 0; r < grammar->num_regions; r++) grammar->open_order[r] = r;
+    for (int a = 1; a < grammar->num_regions; a++) {
+        unsigned char r = grammar->open_order[a];
+        int b = a;
+        while (b > 0) {
+            GrammarRegion *prev = &grammar->regions[grammar->open_order[b - 1]];
+            GrammarRegion *cur = &grammar->regions[r];
+            unsigned char pc = prev->open[0], cc = cur->open[0];
+            if (pc < cc || (pc == cc && prev->open_len >= cur->open_len)) break;
+            grammar->open_order[b] = grammar->open_order[b - 1];
+            b--;
+        }
+        grammar->open_order[b] = r;
+    }
+
+    for (int k = grammar->num_regions - 1; k >= 0; k--) {
+        GrammarRegion *region = &grammar->regions[grammar->open_order[k]];
+        unsigned char first = region->open[0];
+        grammar->open_first[first] = k + 1;
+        grammar->code_action[first] |= GRAMMAR_OPEN;
+    }
+
+    for (int r = 0; r < grammar->num_regions; r++) {
+        GrammarRegion *region = &grammar->regions[r];
+        unsigned char *action = grammar->region_action[r];
+        action[(unsigned char)region->close[0]] |= GRAMMAR_CLOSE;
+        if (region->escape) action[region->escape] |= GRAMMAR_ESCAPE;
+        if (region->flags & REGION_NESTED) action[(unsigned char)region->open[0]] |= GRAMMAR_NEST;
+    }
+}
+
+static bool grammar_add_region(Grammar *grammar, int hl, const char *open, const char *close, int escape, int flags) {
+    size_t open_len = strlen(open);
+    size_t close_len = strlen(close);
+    if (grammar->num_regions == GRAMMAR_MAX_REGIONS) return false;
+    if (open_len == 0 || close_len == 0 || open_len >= GRAMMAR_MAX_DELIM || close_len >= GRAMMAR_MAX_DELIM) return false;
+    // Nesting is meaningless when the opener and closer are the same.
+    if (strcmp(open, close) == 0) flags &= ~REGION_NESTED;
+
+    GrammarRegion *region = &grammar->regions[grammar->num_regions++];
+    memset(region, 0, sizeof(GrammarRegion));
+    region->hl = hl;
+    region->flags = flags;
+    region->escape = escape;
+    region->open_len = open_len;
+    region->close_len = close_len;
+    memcpy(region->open, open, open_len);
+    memcpy(region->close, close, close_len);
+    return true;
+}
+
+// Compiles one of the built-in EditorSyntax definitions. Strings, the '#'
+// preprocessor line and numbers behave the same for all of them.
+Grammar *grammar_from_syntax(EditorSyntax *syntax) {
+    Grammar *grammar = calloc(1, sizeof(Grammar));
+    if (grammar == NULL) return NULL;
+
+    for (int i = 0; syntax->filetype_extensions[i] && i < GRAMMAR_MAX_EXTENSIONS; i++) {
+        snprintf(grammar->extensions[i], sizeof(grammar->extensions[i]), "%s", syntax->filetype_extensions[i]);
+        grammar->num_extensions++;
+    }
+    if (syntax->singleline_comment_start) {
+        grammar->line_comment_len = snprintf(grammar->line_comment, sizeof(grammar->line_comment), "%s", syntax->singleline_comment_start);
+    }
+    grammar->preproc = '#';
+    grammar->numbers = true;
+
+    if (syntax->multiline_comment_start && syntax->multiline_comment_end) {
+        grammar_add_region(grammar, HL_COMMENT, syntax->multiline_comment_start, syntax->multiline_comment_end, 0, REGION_MULTILINE);
+    }
+    grammar_add_region(grammar, HL_STRING, "\"", "\"", '\\', 0);
+    grammar_add_region(grammar, HL_STRING, "'", "'", '\\', 0);
+
+    int count1 = 0, count2 = 0;
+    while (syntax->keywords1[count1]) count1++;
+    while (syntax->keywords2[count2]) count2++;
+    if (!grammar_add_keywords(grammar, syntax->keywords1, count1, syntax->keywords2, count2)) {
+        grammar_free(grammar);
+        return NULL;
+    }
+
+    grammar_build_tables(grammar);
+    return grammar;
+}
+
+static int grammar_class(const char *name) {
+    if (strcmp(name, "comment") == 0) return HL_COMMENT;
+    if (strcmp(name, "string") == 0) return HL_STRING;
+    if (strcmp(name, "keyword1") == 0) return HL_KEYWORD1;
+    if (strcmp(name, "keyword2") == 0) return HL_KEYWORD2;
+    if (strcmp(name, "number") == 0) return HL_NUMBER;
+    if (strcmp(name, "preproc") == 0) return HL_PREPROC;
+    return -1;
+}
+
+static bool grammar_push_word(char ***list, int *count, const char *word) {
+    char *copy = strdup(word);
+    char **new_list = realloc(*list, (*count + 1) * sizeof(char *));
+    if (copy == NULL || new_list == NULL) {
+        free(copy);
+        if (new_list) *list = new_list;
+        return false;
+    }
+    *list = new_list;
+    (*list)[(*count)++] = copy;
+    return true;
+}
+
+// Parses a grammar file. Returns NULL and reports the line on errors.
+static Grammar *grammar_parse_file(const char *path, const char *file_name) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return NULL;
+
+    Grammar *grammar = calloc(1, sizeof(Grammar));
+    char **keywords[2] = { NULL, NULL };
+    int counts[2] = { 0, 0 };
+    // Keyword lines can be long, so the token list grows as needed.
+    char **tokens = NULL;
+    int tokens_cap = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    int line_no = 0;
+    bool ok = grammar != NULL;
+
+    if (grammar) {
+        snprintf(grammar->name, sizeof(grammar->name), "%s", file_name);
+        grammar->numbers = true;
+    }
+
+    while (ok && getline(&line, &cap, fp) != -1) {
+        line_no++;
+        int num_tokens = 0;
+        for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+            if (num_tokens == tokens_cap) {
+                int new_cap = tokens_cap ? tokens_cap * 2 : 64;
+                char **new_tokens = realloc(tokens, new_cap * sizeof(char *));
+                if (new_tokens == NULL) {
+                    ok = false;
+                    break;
+                }
+                tokens = new_tokens;
+                tokens_cap = new_cap;
+            }
+            tokens[num_tokens++] = tok;
+        }
+        if (!ok) {
+            editor_set_status_message("Error: %s:%d: out of memory reading grammar.", file_name, line_no);
+            break;
+        }
+        if (num_tokens == 0 || tokens[0][0] == '#') continue;
+
+        const char *directive = tokens[0];
+        if (strcmp(directive, "name") == 0 && num_tokens == 2) {
+            snprintf(grammar->name, sizeof(grammar->name), "%s", tokens[1]);
+        } else if (strcmp(directive, "extensions") == 0) {
+            for (int t = 1; t < num_tokens && grammar->num_extensions < GRAMMAR_MAX_EXTENSIONS; t++) {
+                snprintf(grammar->extensions[grammar->num_extensions++], sizeof(grammar->extensions[0]), "%s", tokens[t]);
+            }
+        } else if (strcmp(directive, "keywords1") == 0 || strcmp(directive, "keywords2") == 0) {
+            int list = directive[8] == '2';
+            for (int t = 1; t < num_tokens && ok; t++) {
+                ok = grammar_push_word(&keywords[list], &counts[list], tokens[t]);
+            }
+        } else if (strcmp(directive, "line_comment") == 0 && num_tokens == 2 && strlen(tokens[1]) < GRAMMAR_MAX_DELIM) {
+            grammar->line_comment_len = snprintf(grammar->line_comment, sizeof(grammar->line_comment), "%s", tokens[1]);
+        } else if (strcmp(directive, "preproc") == 0 && num_tokens == 2 && strlen(tokens[1]) == 1) {
+            grammar->preproc = tokens[1][0];
+        } else if (strcmp(directive, "numbers") == 0 && num_tokens == 2) {
+            grammar->numbers = strcmp(tokens[1], "off") != 0;
+        } else if (strcmp(directive, "region") == 0 && num_tokens >= 4 && grammar_class(tokens[1]) >= 0) {
+            int flags = 0;
+            int escape = 0;
+            for (int t = 4; t < num_tokens; t++) {
+                if (strcmp(tokens[t], "multiline") == 0) flags |= REGION_MULTILINE;
+                else if (strcmp(tokens[t], "nested") == 0) flags |= REGION_NESTED;
+                else if (strncmp(tokens[t], "escape=", 7) == 0 && strlen(tokens[t]) == 8) escape = (unsigned char)tokens[t][7];
+                else ok = false;
+            }
+            if (ok) ok = grammar_add_region(grammar, grammar_class(tokens[1]), tokens[2], tokens[3], escape, flags);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            editor_set_status_message("Error: %s:%d: invalid grammar directive.", file_name, line_no);
+        }
+    }
+    free(tokens);
+    free(line);
+    fclose(fp);
+
+    if (ok) ok = grammar_add_keywords(grammar, keywords[0], counts[0], keywords[1], counts[1]);
+    for (int list = 0; list < 2; list++) {
+        for (int k = 0; k < counts[list]; k++) free(keywords[list][k]);
+        free(keywords[list]);
+    }
+    if (!ok) {
+        grammar_free(grammar);
+        return NULL;
+    }
+
+    grammar_build_tables(grammar);
+    return grammar;
+}
+
+static int grammar_source_compare(const void *a, const void *b) {
+    return strcmp(((const GrammarSource *)a)->name, ((const GrammarSource *)b)->name);
+}
+
+// Lists the grammar files with their mtime and size, sorted by name.
+static int grammar_list_sources(const char *dir_path, GrammarSource **out) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) return 0;
+
+    GrammarSource *sources = NULL;
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) >= sizeof(sources[0].name)) continue;
+
+        char path[PATH_MAX];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(path) ||
+            stat(path, &st) == -1 || !S_ISREG(st.st_mode)) continue;
+
+        GrammarSource *new_sources = realloc(sources, (count + 1) * sizeof(GrammarSource));
+        if (new_sources == NULL) break;
+        sources = new_sources;
+        memset(&sources[count], 0, sizeof(GrammarSource));
+        snprintf(sources[count].name, sizeof(sources[count].name), "%s", entry->d_name);
+        sources[count].mtime = st.st_mtime;
+        sources[count].size = st.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    if (count > 1) qsort(sources, count, sizeof(GrammarSource), grammar_source_compare);
+    *out = sources;
+    return count;
+}
+
+// Checks the flat part of a grammar read from the cache before anything is
+// sized or indexed by it. The tables derived from it are rebuilt rather
+// than trusted.
+static bool grammar_cache_valid(Grammar *grammar) {
+    if (memchr(grammar->name, '\0', sizeof(grammar->name)) == NULL ||
+        grammar->num_extensions < 0 || grammar->num_extensions > GRAMMAR_MAX_EXTENSIONS ||
+        grammar->line_comment_len >= GRAMMAR_MAX_DELIM ||
+        grammar->num_regions < 0 || grammar->num_regions > GRAMMAR_MAX_REGIONS ||
+        grammar->num_special < 0 || grammar->num_special > USHRT_MAX ||
+        grammar->words_len > GRAMMAR_CACHE_MAX_WORDS ||
+        // The hash table's size is a power of two.
+        grammar->keyword_mask >= GRAMMAR_CACHE_MAX_SLOTS || (grammar->keyword_mask & (grammar->keyword_mask + 1)) != 0) {
+        return false;
+    }
+    for (int i = 0; i < grammar->num_extensions; i++) {
+        if (memchr(grammar->extensions[i], '\0', sizeof(grammar->extensions[i])) == NULL) return false;
+    }
+    for (int r = 0; r < grammar->num_regions; r++) {
+        GrammarRegion *region = &grammar->regions[r];
+        if (region->open_len == 0 || region->open_len >= GRAMMAR_MAX_DELIM ||
+            region->close_len == 0 || region->close_len >= GRAMMAR_MAX_DELIM || region->hl > HL_SELECTION) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool grammar_cache_keywords_valid(Grammar *grammar, GrammarKeyword *keywords, size_t count) {
+    for (size_t k = 0; k < count; k++) {
+        if ((size_t)keywords[k].offset + keywords[k].len > grammar->words_len || keywords[k].hl > HL_SELECTION) return false;
+    }
+    return true;
+}
+
+// Loads the compiled grammars if the cache was written for exactly these
+// source files by a build with the same Grammar layout, and holds together.
+static bool grammar_read_cache(const char *cache_path, GrammarSource *sources, int num_sources) {
+    FILE *fp = fopen(cache_path, "rb");
+    if (fp == NULL) return false;
+
+    char magic[8];
+    uint32_t layout, count, num_grammars;
+    bool ok = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, GRAMMAR_CACHE_MAGIC, 8) == 0 &&
+              fread(&layout, sizeof(layout), 1, fp) == 1 && layout == sizeof(Grammar) &&
+              fread(&count, sizeof(count), 1, fp) == 1 && count == (uint32_t)num_sources;
+
+    for (int i = 0; ok && i < num_sources; i++) {
+        GrammarSource cached;
+        ok = fread(&cached, sizeof(cached), 1, fp) == 1 && memcmp(&cached, &sources[i], sizeof(cached)) == 0;
+    }
+    ok = ok && fread(&num_grammars, sizeof(num_grammars), 1, fp) == 1 && num_grammars <= (uint32_t)num_sources;
+
+    Grammar **grammars = ok ? calloc(num_grammars + 1, sizeof(Grammar *)) : NULL;
+    ok = ok && grammars != NULL;
+    for (uint32_t g = 0; ok && g < num_grammars; g++) {
+        Grammar *grammar = malloc(sizeof(Grammar));
+        ok = grammar != NULL && fread(grammar, sizeof(Grammar), 1, fp) == 1;
+        if (!ok) {
+            free(grammar);
+            break;
+        }
+        // The pointers are the writer's; nothing may free them.
+        grammar->keywords = NULL;
+        grammar->special = NULL;
+        grammar->words = NULL;
+        grammars[g] = grammar;
+        if (!grammar_cache_valid(grammar)) {
+            ok = false;
+            break;
+        }
+
+        size_t num_slots = (size_t)grammar->keyword_mask + 1;
+        grammar->keywords = malloc(num_slots * sizeof(GrammarKeyword));
+        grammar->special = malloc((grammar->num_special + 1) * sizeof(GrammarKeyword));
+        grammar->words = malloc(grammar->words_len + 1);
+        ok = grammar->keywords && grammar->special && grammar->words &&
+             fread(grammar->keywords, sizeof(GrammarKeyword), num_slots, fp) == num_slots &&
+             fread(grammar->special, sizeof(GrammarKeyword), grammar->num_special, fp) == (size_t)grammar->num_special &&
+             fread(grammar->words, 1, grammar->words_len, fp) == grammar->words_len &&
+             grammar_cache_keywords_valid(grammar, grammar->keywords, num_slots) &&
+             grammar_cache_keywords_valid(grammar, grammar->special, grammar->num_special);
+        if (ok) grammar_build_tables(grammar);
+    }
+    // Anything after the last grammar means the file is not what we wrote.
+    ok = ok && fgetc(fp) == EOF;
+    fclose(fp);
+
+    if (!ok) {
+        for (uint32_t g = 0; grammars && g < num_grammars; g++) grammar_free(grammars[g]);
+        free(grammars);
+        return false;
+    }
+    user_grammars = grammars;
+    num_user_grammars = num_grammars;
+    return true;
+}
+
+static void grammar_write_cache(const char *cache_path, GrammarSource *sources, int num_sources) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path) >= (int)sizeof(tmp_path)) return;
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) return;
+
+    uint32_t layout = sizeof(Grammar);
+    uint32_t count = num_sources;
+    uint32_t num_grammars = num_user_grammars;
+    bool ok = fwrite(GRAMMAR_CACHE_MAGIC, 8, 1, fp) == 1 &&
+              fwrite(&layout, sizeof(layout), 1, fp) == 1 &&
+              fwrite(&count, sizeof(count), 1, fp) == 1 &&
+              (num_sources == 0 || fwrite(sources, sizeof(GrammarSource), num_sources, fp) == (size_t)num_sources) &&
+              fwrite(&num_grammars, sizeof(num_grammars), 1, fp) == 1;
+
+    for (int g = 0; ok && g < num_user_grammars; g++) {
+        Grammar *grammar = user_grammars[g];
+        size_t num_slots = (size_t)grammar->keyword_mask + 1;
+        ok = fwrite(grammar, sizeof(Grammar), 1, fp) == 1 &&
+             fwrite(grammar->keywords, sizeof(GrammarKeyword), num_slots, fp) == num_slots &&
+             fwrite(grammar->special, sizeof(GrammarKeyword), grammar->num_special, fp) == (size_t)grammar->num_special &&
+             fwrite(grammar->words, 1, grammar->words_len, fp) == grammar->words_len;
+    }
+
+    if (fclose(fp) != 0) ok = false;
+    if (ok) {
+        rename(tmp_path, cache_path);
+    } else {
+        unlink(tmp_path);
+    }
+}
+
+// Reads ~/.nimki/syntax/ once, from the cache when it is still current.
+static void grammar_load_user() {
+    user_grammars_loaded = true;
+
+    char *home_dir = get_home_directory();
+    if (!home_dir) return;
+
+    char dir_path[PATH_MAX];
+    char cache_path[PATH_MAX];
+    if (snprintf(dir_path, sizeof(dir_path), "%s/.nimki/syntax", home_dir) >= (int)sizeof(dir_path) ||
+        snprintf(cache_path, sizeof(cache_path), "%s/.cache", dir_path) >= (int)sizeof(cache_path)) return;
+
+    GrammarSource *sources = NULL;
+    int num_sources = grammar_list_sources(dir_path, &sources);
+    if (num_sources == 0) {
+        free(sources);
+        return;
+    }
+
+    if (!grammar_read_cache(cache_path, sources, num_sources)) {
+        // A file that does not parse is left out of the cache, which would
+        // then hide its error on later startups; so only cache a clean set.
+        bool all_parsed = true;
+        user_grammars = calloc(num_sources, sizeof(Grammar *));
+        for (int i = 0; user_grammars && i < num_sources; i++) {
+            char path[PATH_MAX];
+            Grammar *grammar = NULL;
+            if (snprintf(path, sizeof(path), "%s/%s", dir_path, sources[i].name) < (int)sizeof(path)) {
+                grammar = grammar_parse_file(path, sources[i].name);
+            }
+            if (grammar) {
+                user_grammars[num_user_grammars++] = grammar;
+            } else {
+                all_parsed = false;
+            }
+        }
+        if (user_grammars && all_parsed) grammar_write_cache(cache_path, sources, num_sources);
+    }
+    free(sources);
+}
+
+// Returns the user grammar registered for a file extension, if any.
+Grammar *grammar_find(const char *ext) {
+    if (!user_grammars_loaded) grammar_load_user();
+
+    for (int g = 0; g < num_user_grammars; g++) {
+        for (int i = 0; i < user_grammars[g]->num_extensions; i++) {
+            if (strcmp(ext, user_grammars[g]->extensions[i]) == 0) return user_grammars[g];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,524 @@
+#include"common.h"
+
+// Find in files. A run walks the working directory on every job worker at
+// once: each worker is a scan.c worker too, and the files the scan turns
+// up go on one stack that all of them search from, each file mmap'd whole
+// and scanned with search_forward(). Each worker runs as a job slot that
+// goes back on the queue every GREP_SLICE_MS, so highlighting and search
+// jobs are not starved, and every time a slice ends its results are moved
+// into the list on screen while the walk carries on.
+
+#define GREP_SLICE_MS 50
+// Results kept at most; the walk stops once it has this many.
+#define GREP_MAX_RESULTS 100000
+// Bytes of the matching line kept for the list.
+#define GREP_PREVIEW_LEN 200
+// A file with a NUL byte this near its start is taken as binary and skipped.
+#define GREP_BINARY_PROBE 8192
+
+typedef struct {
+    char *path;
+    int row;
+    int col;
+    char *preview;
+} GrepResult;
+
+typedef struct GrepPath {
+    char *path;
+    struct GrepPath *next;
+} GrepPath;
+
+typedef struct {
+    char *root;
+    char *query;
+    ScanTree *scan;
+
+    // Shared by the workers, under `mutex`.
+    pthread_mutex_t mutex;
+    GrepPath *pending;
+    GrepResult *found;
+    int found_count;
+    int found_cap;
+    int files_searched;
+    bool full;
+
+    // The UI thread's side: results moved out of `found`, and the list.
+    GrepResult *results;
+    int count;
+    int cap;
+    int live_slots;
+    int cursor;
+    int offset;
+} GrepRun;
+
+typedef struct {
+    GrepRun *run;
+    // This slot's worker index in run->scan.
+    int worker;
+    SearchPattern pattern;
+    bool retired;
+} GrepSlot;
+
+// The run shown in the list; superseded runs are freed once their last
+// slot comes back.
+static GrepRun *grep_run = NULL;
+
+void editor_grep();
+void editor_grep_key(int c);
+void editor_draw_grep_results();
+
+static long long grep_clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void grep_results_free(GrepResult *results, int count) {
+    for (int i = 0; i < count; i++) {
+        free(results[i].path);
+        free(results[i].preview);
+    }
+    free(results);
+}
+
+static void grep_run_free(GrepRun *run) {
+    scan_tree_free(run->scan);
+    while (run->pending) {
+        GrepPath *next = run->pending->next;
+        free(run->pending->path);
+        free(run->pending);
+        run->pending = next;
+    }
+    grep_results_free(run->found, run->found_count);
+    grep_results_free(run->results, run->count);
+    pthread_mutex_destroy(&run->mutex);
+    free(run->root);
+    free(run->query);
+    free(run);
+}
+
+// Called with run->mutex held. Takes ownership of path and preview.
+static void grep_add_result(GrepRun *run, char *path, int row, int col, char *preview) {
+    if (run->found_count + run->count >= GREP_MAX_RESULTS) __atomic_store_n(&run->full, true, __ATOMIC_RELAXED);
+    if (!run->full && run->found_count == run->found_cap) {
+        int new_cap = run->found_cap ? run->found_cap * 2 : 64;
+        GrepResult *new_found = realloc(run->found, new_cap * sizeof(GrepResult));
+        if (new_found == NULL) {
+            __atomic_store_n(&run->full, true, __ATOMIC_RELAXED);
+        } else {
+            run->found = new_found;
+            run->found_cap = new_cap;
+        }
+    }
+    if (run->full) {
+        scan_tree_stop(run->scan);
+        free(path);
+        free(preview);
+        return;
+    }
+    run->found[run->found_count].path = path;
+    run->found[run->found_count].row = row;
+    run->found[run->found_count].col = col;
+    run->found[run->found_count].preview = preview;
+    run->found_count++;
+}
+
+// Queues a file the scan found for searching.
+static void grep_visit(const char *path, size_t path_len, void *data) {
+    GrepRun *run = data;
+    GrepPath *entry = malloc(sizeof(GrepPath));
+    char *copy = strndup(path, path_len);
+    if (entry == NULL || copy == NULL) {
+        free(entry);
+        free(copy);
+        return;
+    }
+    entry->path = copy;
+    pthread_mutex_lock(&run->mutex);
+    entry->next = run->pending;
+    run->pending = entry;
+    pthread_mutex_unlock(&run->mutex);
+}
+
+static void grep_record(GrepRun *run, const char *path, int row, int col, const char *line, size_t line_len) {
+    if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+    if (line_len > GREP_PREVIEW_LEN) line_len = GREP_PREVIEW_LEN;
+    char *path_copy = strdup(path);
+    char *preview = strndup(line, line_len);
+    pthread_mutex_lock(&run->mutex);
+    if (path_copy && preview) {
+        grep_add_result(run, path_copy, row, col, preview);
+    } else {
+        free(path_copy);
+        free(preview);
+    }
+    pthread_mutex_unlock(&run->mutex);
+}
+
+// Reports the first match on each matching line of a file. A literal
+// query is searched for across the whole mapping, counting line breaks
+// only up to each hit; a regex goes line by line.
+static void grep_file(GrepSlot *slot, const char *path) {
+    GrepRun *run = slot->run;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    pthread_mutex_lock(&run->mutex);
+    run->files_searched++;
+    pthread_mutex_unlock(&run->mutex);
+
+    if (memchr(data, '\0', size < GREP_BINARY_PROBE ? size : GREP_BINARY_PROBE)) {
+        munmap((void *)data, size);
+        return;
+    }
+
+    const char *end = data + size;
+    const char *line = data;
+    int row = 0;
+    if (slot->pattern.regex == NULL) {
+        const char *from = data;
+        const char *hit;
+        while (!__atomic_load_n(&run->full, __ATOMIC_RELAXED) &&
+               (hit = search_forward(from, end - from, slot->pattern.needle, slot->pattern.needle_len))) {
+            const char *nl;
+            while ((nl = memchr(line, '\n', hit - line)) != NULL) {
+                line = nl + 1;
+                row++;
+            }
+            const char *line_end = memchr(hit, '\n', end - hit);
+            if (line_end == NULL) line_end = end;
+            grep_record(run, path, row, (int)(hit - line), line, line_end - line);
+            if (line_end == end) break;
+            from = line = line_end + 1;
+            row++;
+        }
+    } else {
+        while (line < end && !__atomic_load_n(&run->full, __ATOMIC_RELAXED)) {
+            const char *line_end = memchr(line, '\n', end - line);
+            if (line_end == NULL) line_end = end;
+            size_t line_len = line_end - line;
+            if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+            size_t match_start, match_len;
+            if (search_pattern_match(&slot->pattern, line, line_len, 0, 1, &match_start, &match_len)) {
+                grep_record(run, path, row, (int)match_start, line, line_len);
+            }
+            line = line_end + 1;
+            row++;
+        }
+    }
+    munmap((void *)data, size);
+}
+
+// Searches queued files until the slice is up, reading another directory
+// whenever the queue is empty. A slot retires once the scan is over and
+// nothing is left queued.
+static void grep_job_run(Job *job) {
+    GrepSlot *slot = job->data;
+    GrepRun *run = slot->run;
+    // Without workers the job runs inline, and slicing would only recurse.
+    long long until = jobs_worker_count() > 0 ? grep_clock_ms() + GREP_SLICE_MS : LLONG_MAX;
+
+    while (!job_cancelled(job) && grep_clock_ms() < until) {
+        pthread_mutex_lock(&run->mutex);
+        bool full = run->full;
+        GrepPath *entry = full ? NULL : run->pending;
+        if (entry) run->pending = entry->next;
+        pthread_mutex_unlock(&run->mutex);
+        if (entry) {
+            grep_file(slot, entry->path);
+            free(entry->path);
+            free(entry);
+            continue;
+        }
+        if (full) {
+            slot->retired = true;
+            break;
+        }
+
+        int step = scan_tree_step(run->scan, slot->worker);
+        if (step == -1) {
+            // The last directory read may have queued files meanwhile.
+            pthread_mutex_lock(&run->mutex);
+            bool drained = run->pending == NULL;
+            pthread_mutex_unlock(&run->mutex);
+            if (drained) {
+                slot->retired = true;
+                break;
+            }
+        } else if (step == 0) {
+            // Other slots are reading the directories that are left.
+            usleep(1000);
+        }
+    }
+}
+
+static int grep_result_compare(const void *a, const void *b) {
+    const GrepResult *ra = a, *rb = b;
+    int order = strcmp(ra->path, rb->path);
+    if (order != 0) return order;
+    return (ra->row > rb->row) - (ra->row < rb->row);
+}
+
+// Moves what the workers found into the list.
+static void grep_collect(GrepRun *run) {
+    pthread_mutex_lock(&run->mutex);
+    int found = run->found_count;
+    if (found > 0 && run->count + found > run->cap) {
+        int new_cap = run->cap ? run->cap : 256;
+        while (new_cap < run->count + found) new_cap *= 2;
+        GrepResult *new_results = realloc(run->results, new_cap * sizeof(GrepResult));
+        if (new_results == NULL) {
+            pthread_mutex_unlock(&run->mutex);
+            return;
+        }
+        run->results = new_results;
+        run->cap = new_cap;
+    }
+    if (found > 0) {
+        // Each batch is sorted on its own; results already on screen stay
+        // where they are.
+        qsort(run->found, found, sizeof(GrepResult), grep_result_compare);
+        memcpy(run->results + run->count, run->found, found * sizeof(GrepResult));
+        run->count += found;
+        run->found_count = 0;
+    }
+    pthread_mutex_unlock(&run->mutex);
+}
+
+static void grep_report(GrepRun *run) {
+    pthread_mutex_lock(&run->mutex);
+    int files_searched = run->files_searched;
+    pthread_mutex_unlock(&run->mutex);
+    editor_set_status_message("Find in files '%s': %d match%s in %d files%s", run->query, run->count,
+                              run->count == 1 ? "" : "es", files_searched,
+                              run->live_slots > 0 ? ", searching..." : run->full ? " (stopped at the limit)" : "");
+}
+
+static void grep_job_finish(Job *job, bool cancelled) {
+    GrepSlot *slot = job->data;
+    GrepRun *run = slot->run;
+
+    if (!cancelled && run == grep_run) {
+        grep_collect(run);
+        if (!slot->retired && job_submit(JOB_GREP, grep_job_run, grep_job_finish, slot) == 0) {
+            if (E.grep_active) grep_report(run);
+            return;
+        }
+    }
+
+    search_pattern_free(&slot->pattern);
+    free(slot);
+    run->live_slots--;
+    if (run != grep_run) {
+        if (run->live_slots == 0) grep_run_free(run);
+    } else if (run->live_slots == 0) {
+        grep_report(run);
+    }
+}
+
+// Starts a run for `query` over the working directory, replacing the last
+// one, with a job slot per worker.
+static void grep_start(const char *query) {
+    job_cancel(JOB_GREP);
+    if (grep_run && grep_run->live_slots == 0) grep_run_free(grep_run);
+    grep_run = NULL;
+
+    GrepRun *run = calloc(1, sizeof(GrepRun));
+    char cwd[PATH_MAX];
+    if (run == NULL) {
+        editor_set_status_message("Find in files error: Out of memory.");
+        return;
+    }
+    pthread_mutex_init(&run->mutex, NULL);
+    run->root = strdup(getcwd(cwd, sizeof(cwd)) ? cwd : ".");
+    run->query = strdup(query);
+    int slots = jobs_worker_count() > 0 ? jobs_worker_count() : 1;
+    if (run->root) run->scan = scan_tree_start(run->root, slots, !E.show_ignored, grep_visit, run);
+    if (run->root == NULL || run->query == NULL || run->scan == NULL) {
+        grep_run_free(run);
+        editor_set_status_message("Find in files error: Out of memory.");
+        return;
+    }
+
+    char error[128];
+    for (int i = 0; i < slots; i++) {
+        GrepSlot *slot = malloc(sizeof(GrepSlot));
+        if (slot == NULL) break;
+        slot->run = run;
+        slot->worker = i;
+        slot->retired = false;
+        // Lazily built regex DFAs are not shared between threads, so each
+        // slot compiles its own.
+        if (search_pattern_init(&slot->pattern, run->query, error, sizeof(error)) == -1) {
+            free(slot);
+            if (i == 0) {
+                grep_run_free(run);
+                editor_set_status_message("Regex error: %s", error);
+                return;
+            }
+            break;
+        }
+        run->live_slots++;
+        grep_run = run;
+        if (job_submit(JOB_GREP, grep_job_run, grep_job_finish, slot) == -1) {
+            run->live_slots--;
+            search_pattern_free(&slot->pattern);
+            free(slot);
+            break;
+        }
+    }
+    if (grep_run != run) {
+        grep_run_free(run);
+        editor_set_status_message("Find in files error: Out of memory.");
+        return;
+    }
+    E.grep_active = true;
+    grep_report(run);
+}
+
+// Asks for a query and lists its matches across the working directory. An
+// empty answer shows the last list again.
+void editor_grep() {
+    char *query = editor_prompt("Find in files (/regex/, ESC to cancel): ", NULL);
+    if (query == NULL) return;
+    if (query[0] == '\0') {
+        if (grep_run) {
+            E.grep_active = true;
+            grep_report(grep_run);
+        }
+    } else {
+        grep_start(query);
+    }
+    free(query);
+}
+
+// Opens the result under the cursor and puts find on its match, so the
+// usual find keys carry on from there.
+static void grep_open_result(GrepResult *result) {
+    if (E.filename == NULL || strcmp(E.filename, result->path) != 0) {
+        if (E.dirty) {
+            editor_set_status_message("Unsaved changes; save (Ctrl+S) before opening %s.", result->path);
+            return;
+        }
+        editor_read_file(result->path);
+    }
+    E.grep_active = false;
+    editor_wait_for_lines(result->row);
+    if (result->row >= E.num_lines) {
+        editor_set_status_message("%s no longer has line %d.", result->path, result->row + 1);
+        return;
+    }
+
+    E.cy = result->row;
+    E.cx = result->col;
+    EditorLine *line = buffer_line(E.cy);
+    if (E.cx > (int)line->len) E.cx = (int)line->len;
+
+    char *query = strdup(grep_run->query);
+    if (query == NULL) return;
+    free(E.search_query);
+    E.search_query = query;
+    E.last_match_row = E.cy;
+    E.last_match_col = E.cx;
+    E.find_active = true;
+    editor_find_report();
+}
+
+// Keys while the result list is open.
+void editor_grep_key(int c) {
+    GrepRun *run = grep_run;
+    if (run == NULL) {
+        E.grep_active = false;
+        return;
+    }
+
+    int page = E.screen_rows > 1 ? E.screen_rows - 1 : 1;
+    switch (c) {
+        case KEY_UP:
+            run->cursor--;
+            break;
+        case KEY_DOWN:
+            run->cursor++;
+            break;
+        case KEY_PPAGE:
+            run->cursor -= page;
+            break;
+        case KEY_NPAGE:
+            run->cursor += page;
+            break;
+        case KEY_HOME:
+            run->cursor = 0;
+            break;
+        case KEY_END:
+            run->cursor = run->count - 1;
+            break;
+        case '\r':
+        case '\n':
+        case KEY_ENTER:
+            if (run->cursor < run->count) grep_open_result(&run->results[run->cursor]);
+            return;
+        case 27:
+        case CTRL('g'):
+            E.grep_active = false;
+            editor_set_status_message("");
+            return;
+    }
+    if (run->cursor >= run->count) run->cursor = run->count - 1;
+    if (run->cursor < 0) run->cursor = 0;
+}
+
+// Draws the result list over the text rows: a header, then one row per
+// matching line as path:line: text.
+void editor_draw_grep_results() {
+    if (!E.grep_active || grep_run == NULL) return;
+    GrepRun *run = grep_run;
+
+    int x = E.file_tree_visible ? FILE_TREE_WIDTH : 0;
+    int width = E.screen_cols - x;
+    if (width <= 0 || E.screen_rows <= 0) return;
+
+    attron(A_BOLD);
+    mvhline(0, x, ' ', width);
+    mvprintw(0, x, "%.*s", width, "Find in files -- Enter opens, ESC closes");
+    attroff(A_BOLD);
+
+    int rows = E.screen_rows - 1;
+    if (run->cursor < run->offset) run->offset = run->cursor;
+    if (run->cursor >= run->offset + rows) run->offset = run->cursor - rows + 1;
+
+    size_t root_len = strlen(run->root);
+    char label[PATH_MAX + 32];
+    for (int y = 0; y < rows; y++) {
+        int i = run->offset + y;
+        mvhline(y + 1, x, ' ', width);
+        if (i >= run->count) continue;
+
+        GrepResult *result = &run->results[i];
+        const char *path = result->path;
+        if (strncmp(path, run->root, root_len) == 0 && path[root_len] == '/') path += root_len + 1;
+        int label_len = snprintf(label, sizeof(label), "%s:%d: ", path, result->row + 1);
+        if (label_len > width) label_len = width;
+
+        if (i == run->cursor) attron(A_REVERSE);
+        mvaddnstr(y + 1, x, label, label_len);
+        int col = x + label_len;
+        for (const char *p = result->preview; *p && col < x + width; p++) {
+            mvaddch(y + 1, col++, *p == '\t' || (unsigned char)*p < 32 ? ' ' : (unsigned char)*p);
+        }
+        if (i == run->cursor) {
+            mvchgat(y + 1, x, width, A_REVERSE, 0, NULL);
+            attroff(A_REVERSE);
+        }
+    }
+    move(run->cursor - run->offset + 1, x);
+}
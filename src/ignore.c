@@ -0,0 +1,321 @@
+#include"common.h"
+
+// Decides which files the file tree and the tree walkers leave out, from
+// .gitignore and .ignore files and the ignore= lines of ~/.nimkirc.
+//
+// Each directory that has ignore files of its own gets an IgnoreDir with
+// their rules, chained to the one above it; directories without any share
+// their parent's. A path is checked against the innermost rules first, and
+// within a file the last rule that matches wins, as in git. The walk root's
+// IgnoreDir also holds the global rules, ahead of its own so that a
+// .gitignore can re-include what they leave out.
+//
+// Rules are classified when read, so the common patterns - a plain name
+// such as node_modules, or *.o - are a string compare rather than a glob
+// match. An IgnoreDir never changes once made and is reference counted, so
+// scan workers share them freely.
+
+// Ignore files larger than this are not read.
+#define IGNORE_FILE_MAX (1024 * 1024)
+
+enum IgnoreKind {
+    // Unanchored pattern without wildcards; compared with the name.
+    IGNORE_NAME,
+    // Unanchored "*literal"; compared with the end of the name.
+    IGNORE_SUFFIX,
+    // Anything else, matched by ignore_glob() against the name, or against
+    // the path below the rules' directory when anchored.
+    IGNORE_GLOB
+};
+
+typedef struct {
+    char *pattern;
+    size_t len;
+    int kind;
+    bool anchored;
+    bool negate;
+    bool dir_only;
+} IgnoreRule;
+
+struct IgnoreDir {
+    struct IgnoreDir *parent;
+    // Length of the directory's path; the paths checked start with it.
+    size_t base_len;
+    IgnoreRule *rules;
+    int num_rules;
+    int cap_rules;
+    int refs;
+};
+
+// Rules from ~/.nimkirc, for every walk root.
+static IgnoreDir global_rules = {0};
+
+void ignore_add_global(const char *pattern);
+IgnoreDir *ignore_dir_open(IgnoreDir *parent, int dir_fd, size_t path_len);
+IgnoreDir *ignore_dir_retain(IgnoreDir *dir);
+void ignore_dir_release(IgnoreDir *dir);
+bool ignore_match(const IgnoreDir *dir, const char *path, size_t path_len, const char *name, bool is_dir);
+
+// gitignore's wildcards: * and ? stop at '/', ** crosses it, [...] is a
+// class with ! or ^ to negate, and \ quotes the next character.
+static bool ignore_glob(const char *p, const char *s) {
+    for (;;) {
+        switch (*p) {
+        case '\0':
+            return *s == '\0';
+        case '*':
+            if (p[1] == '*') {
+                p += 2;
+                if (*p == '/') {
+                    // "**/" is zero or more whole directories.
+                    p++;
+                    for (;;) {
+                        if (ignore_glob(p, s)) return true;
+                        s = strchr(s, '/');
+                        if (s == NULL) return false;
+                        s++;
+                    }
+                }
+                for (;; s++) {
+                    if (ignore_glob(p, s)) return true;
+                    if (*s == '\0') return false;
+                }
+            }
+            p++;
+            for (;; s++) {
+                if (ignore_glob(p, s)) return true;
+                if (*s == '\0' || *s == '/') return false;
+            }
+        case '?':
+            if (*s == '\0' || *s == '/') return false;
+            p++;
+            s++;
+            break;
+        case '[': {
+            if (*s == '\0' || *s == '/') return false;
+            const char *q = p + 1;
+            bool negate = *q == '!' || *q == '^';
+            if (negate) q++;
+            bool found = false;
+            // A ']' right after the '[' is part of the class.
+            const char *first = q;
+            while (*q && (*q != ']' || q == first)) {
+                char lo = *q == '\\' && q[1] ? *++q : *q;
+                char hi = lo;
+                if (q[1] == '-' && q[2] && q[2] != ']') {
+                    q += 2;
+                    hi = *q == '\\' && q[1] ? *++q : *q;
+                }
+                if ((unsigned char)*s >= (unsigned char)lo && (unsigned char)*s <= (unsigned char)hi) found = true;
+                q++;
+            }
+            // An unterminated '[' is just a character.
+            if (*q != ']') {
+                if (*s != '[') return false;
+                p++;
+                s++;
+                break;
+            }
+            if (found == negate) return false;
+            p = q + 1;
+            s++;
+            break;
+        }
+        case '\\':
+            if (p[1]) p++;
+            // fall through
+        default:
+            if (*p != *s) return false;
+            p++;
+            s++;
+            break;
+        }
+    }
+}
+
+static int ignore_push_rule(IgnoreDir *dir, const IgnoreRule *rule) {
+    if (dir->num_rules == dir->cap_rules) {
+        int new_cap = dir->cap_rules ? dir->cap_rules * 2 : 8;
+        IgnoreRule *new_rules = realloc(dir->rules, new_cap * sizeof(IgnoreRule));
+        if (new_rules == NULL) return -1;
+        dir->rules = new_rules;
+        dir->cap_rules = new_cap;
+    }
+    dir->rules[dir->num_rules++] = *rule;
+    return 0;
+}
+
+// Parses one line of an ignore file into `dir`. Returns -1 when out of
+// memory.
+static int ignore_add_rule(IgnoreDir *dir, const char *line, size_t len) {
+    // Trailing spaces go unless quoted with a backslash.
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\r' || line[len - 1] == '\t') &&
+           !(len > 1 && line[len - 2] == '\\')) {
+        len--;
+    }
+    if (len == 0 || line[0] == '#') return 0;
+
+    IgnoreRule rule = {0};
+    if (line[0] == '!') {
+        rule.negate = true;
+        line++;
+        len--;
+    } else if (line[0] == '\\' && len > 1 && (line[1] == '#' || line[1] == '!')) {
+        line++;
+        len--;
+    }
+    if (len > 0 && line[len - 1] == '/') {
+        rule.dir_only = true;
+        len--;
+    }
+    if (len > 0 && line[0] == '/') {
+        rule.anchored = true;
+        line++;
+        len--;
+    }
+    if (len == 0) return 0;
+    if (memchr(line, '/', len)) rule.anchored = true;
+
+    bool wild = false;
+    for (size_t i = 0; i < len; i++) {
+        if (strchr("*?[\\", line[i])) wild = true;
+    }
+    bool suffix = len > 1 && line[0] == '*' && line[1] != '*';
+    for (size_t i = 1; suffix && i < len; i++) {
+        if (strchr("*?[\\", line[i])) suffix = false;
+    }
+    if (rule.anchored || (wild && !suffix)) {
+        rule.kind = IGNORE_GLOB;
+    } else if (suffix) {
+        rule.kind = IGNORE_SUFFIX;
+        line++;
+        len--;
+    } else {
+        rule.kind = IGNORE_NAME;
+    }
+
+    rule.pattern = strndup(line, len);
+    if (rule.pattern == NULL) return -1;
+    rule.len = len;
+    if (ignore_push_rule(dir, &rule) == -1) {
+        free(rule.pattern);
+        return -1;
+    }
+    return 0;
+}
+
+static void ignore_read_file(IgnoreDir *dir, int dir_fd, const char *name) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size > IGNORE_FILE_MAX) {
+        close(fd);
+        return;
+    }
+    char *text = malloc(st.st_size + 1);
+    ssize_t len = text ? read(fd, text, st.st_size) : -1;
+    close(fd);
+    if (len <= 0) {
+        free(text);
+        return;
+    }
+    text[len] = '\0';
+
+    for (char *line = text; line < text + len; ) {
+        char *end = memchr(line, '\n', text + len - line);
+        if (end == NULL) end = text + len;
+        if (ignore_add_rule(dir, line, end - line) == -1) break;
+        line = end + 1;
+    }
+    free(text);
+}
+
+static void ignore_free_rules(IgnoreDir *dir) {
+    for (int i = 0; i < dir->num_rules; i++) free(dir->rules[i].pattern);
+    free(dir->rules);
+}
+
+// Adds a pattern from an ignore= line of ~/.nimkirc, in .gitignore syntax.
+// Only called while loading the config, before any walk starts.
+void ignore_add_global(const char *pattern) {
+    ignore_add_rule(&global_rules, pattern, strlen(pattern));
+}
+
+// The rules for the entries of the directory open as `dir_fd`, whose path
+// is `path_len` long: its own ignore files chained to `parent`, or with no
+// parent, a walk root's with the global rules. Returns a reference the
+// caller releases; NULL only when a root's could not be made.
+IgnoreDir *ignore_dir_open(IgnoreDir *parent, int dir_fd, size_t path_len) {
+    IgnoreDir *dir = calloc(1, sizeof(IgnoreDir));
+    if (dir == NULL) return ignore_dir_retain(parent);
+    dir->base_len = path_len;
+    dir->refs = 1;
+
+    if (parent == NULL) {
+        // git never descends into its own directory.
+        if (ignore_add_rule(dir, ".git/", 5) == -1) {
+            free(dir);
+            return NULL;
+        }
+        for (int i = 0; i < global_rules.num_rules; i++) {
+            IgnoreRule rule = global_rules.rules[i];
+            rule.pattern = strdup(rule.pattern);
+            if (rule.pattern == NULL) break;
+            if (ignore_push_rule(dir, &rule) == -1) {
+                free(rule.pattern);
+                break;
+            }
+        }
+    }
+    ignore_read_file(dir, dir_fd, ".gitignore");
+    ignore_read_file(dir, dir_fd, ".ignore");
+
+    if (parent != NULL && dir->num_rules == 0) {
+        free(dir->rules);
+        free(dir);
+        return ignore_dir_retain(parent);
+    }
+    dir->parent = ignore_dir_retain(parent);
+    return dir;
+}
+
+IgnoreDir *ignore_dir_retain(IgnoreDir *dir) {
+    if (dir) __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+    return dir;
+}
+
+void ignore_dir_release(IgnoreDir *dir) {
+    while (dir && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        IgnoreDir *parent = dir->parent;
+        ignore_free_rules(dir);
+        free(dir);
+        dir = parent;
+    }
+}
+
+static bool ignore_rule_matches(const IgnoreRule *rule, const char *relative, const char *name, size_t name_len) {
+    switch (rule->kind) {
+    case IGNORE_NAME:
+        return name_len == rule->len && memcmp(name, rule->pattern, name_len) == 0;
+    case IGNORE_SUFFIX:
+        return name_len >= rule->len && memcmp(name + name_len - rule->len, rule->pattern, rule->len) == 0;
+    default:
+        return ignore_glob(rule->pattern, rule->anchored ? relative : name);
+    }
+}
+
+// Whether the entry `name` at `path`, which lies below every directory
+// `dir` chains to, is ignored.
+bool ignore_match(const IgnoreDir *dir, const char *path, size_t path_len, const char *name, bool is_dir) {
+    size_t name_len = strlen(name);
+    for (; dir; dir = dir->parent) {
+        if (dir->base_len >= path_len) continue;
+        const char *relative = path + dir->base_len + 1;
+        for (int i = dir->num_rules - 1; i >= 0; i--) {
+            const IgnoreRule *rule = &dir->rules[i];
+            if (rule->dir_only && !is_dir) continue;
+            if (ignore_rule_matches(rule, relative, name, name_len)) return !rule->negate;
+        }
+    }
+    return false;
+}
@@ -5,7 +5,8 @@ extern FileTreeState FT;
 extern char status_message[80];
 extern time_t status_message_time;
 
-void editor_process_keypress();
+void editor_process_keypress(int c);
+void editor_init_keys();
 void handle_winch(int sig);
 void editor_find();
 void editor_find_next(int direction);
@@ -25,12 +26,97 @@ void file_tree_open_file();
 void toggle_file_tree();
 void draw_file_tree();
 
-void editor_process_keypress() {
-    MEVENT event;
+// Ctrl+Home and Ctrl+End have no KEY_ constant; look up the code curses
+// assigned to their terminfo sequence instead.
+static int editor_terminfo_key(const char *capname) {
+    char *seq = tigetstr(capname);
+    if (seq == NULL || seq == (char *)-1) return -1;
+    int code = key_defined(seq);
+    return code > 0 ? code : -1;
+}
+
+// Codes of Ctrl+Home and Ctrl+End, or -1 where the terminal has none.
+static int key_ctrl_home = -1;
+static int key_ctrl_end = -1;
+
+// Looks the codes up once keypad() has set up the keymap, rather than on
+// every key that reaches the default case.
+void editor_init_keys() {
+    key_ctrl_home = editor_terminfo_key("kHOM5");
+    key_ctrl_end = editor_terminfo_key("kEND5");
+}
+
+// Waits up to `timeout_ms` (-1 for ever, 0 to only poll) for the next key
+// with the buffer unlocked so the background indexer can publish lines
+// meanwhile. Returns ERR when nothing arrived in time.
+int editor_read_key_timeout(int timeout_ms) {
+    timeout(timeout_ms);
+    buffer_unlock();
     int c = getch();
-    bool cursor_moved = false;
-    int original_cx = E.cx;
-    int original_cy = E.cy;
+    buffer_lock();
+    return c;
+}
+
+// Waits for the next key in the event loop. Returns ERR when the wait ends
+// without one -- a resize, a clock tick, or the indexer's 100ms progress
+// tick -- so the caller can repaint.
+int editor_read_key() {
+    int c = editor_read_key_timeout(0);
+    if (c != ERR) return c;
+
+    int wait_ms = editor_next_timer_ms();
+    if (E.indexing && wait_ms > 100) wait_ms = 100;
+    event_wait(wait_ms);
+    return editor_read_key_timeout(0);
+}
+
+// Gives up on a paste whose closing ESC[201~ never arrives.
+#define PASTE_TIMEOUT_MS 1000
+
+// Collects a bracketed paste up to its closing ESC[201~ and inserts it in
+// one go. Keypad translation is off meanwhile so escape sequences inside
+// the pasted text stay text.
+static void editor_read_paste() {
+    static const char end_marker[] = "\033[201~";
+    size_t end_len = sizeof(end_marker) - 1;
+    size_t len = 0, cap = 4096;
+    char *text = malloc(cap);
+    if (text == NULL) {
+        editor_set_status_message("Paste error: Out of memory.");
+        return;
+    }
+
+    keypad(stdscr, FALSE);
+    while (1) {
+        int c = editor_read_key_timeout(PASTE_TIMEOUT_MS);
+        if (c == ERR) break;
+        if (len == cap) {
+            char *new_text = realloc(text, cap * 2);
+            if (new_text == NULL) break;
+            text = new_text;
+            cap *= 2;
+        }
+        text[len++] = (char)c;
+        if (len >= end_len && memcmp(text + len - end_len, end_marker, end_len) == 0) {
+            len -= end_len;
+            break;
+        }
+    }
+    keypad(stdscr, TRUE);
+
+    editor_paste_text(text, len);
+    free(text);
+}
+
+// Applies one key. Drawing is left to the main loop, which runs every key
+// that is already waiting through here before it renders a frame.
+void editor_process_keypress(int c) {
+    MEVENT event;
+
+    if (E.grep_active && c != CTRL('q') && c != CTRL('c')) {
+        editor_grep_key(c);
+        return;
+    }
 
     if (E.context_menu_active) {
         switch (c) {
@@ -71,19 +157,13 @@ void editor_process_keypress() {
         !(c == KEY_BACKSPACE || c == KEY_DC || c == 127)) {
         E.selection_active = false;
         editor_set_status_message("");
-        for (int i = 0; i < E.num_lines; i++) {
-            editor_update_syntax(i);
-        }
-        editor_refresh_screen(); // Refresh immediately when selection is cleared
     }
 
-    if (E.find_active && c != KEY_UP && c != KEY_DOWN && c != CTRL('f')) {
+    if (E.find_active && c != KEY_UP && c != KEY_DOWN && c != CTRL('f') && c != CTRL('r')) {
         E.find_active = false;
+        job_cancel(JOB_SEARCH);
+        match_index_stop();
         editor_set_status_message("");
-        for (int i = 0; i < E.num_lines; i++) {
-            editor_update_syntax(i);
-        }
-        editor_refresh_screen();
     }
 
     if (E.select_all_active && c != KEY_BACKSPACE && c != 127 && c != KEY_DC) {
@@ -97,7 +177,11 @@ void editor_process_keypress() {
             if (E.dirty) {
                 editor_set_status_message("WARNING! File has unsaved changes. Press Ctrl+Q/C again to force quit.");
                 editor_refresh_screen();
-                int c2 = getch();
+                int c2;
+                while ((c2 = editor_read_key()) == ERR) {
+                    editor_poll_indexer();
+                    editor_refresh_screen();
+                }
                 if (c2 != CTRL('q') && c2 != CTRL('c')) return;
             }
             cleanup_editor();
@@ -110,11 +194,14 @@ void editor_process_keypress() {
 
         case CTRL('a'):
             editor_select_all();
-            cursor_moved = true;
             break;
 
         case CTRL('v'):
-            editor_set_status_message("Use terminal paste (Ctrl+Shift+V or right-click)");
+            paste_from_clipboard();
+            break;
+
+        case KEY_PASTE_BEGIN:
+            editor_read_paste();
             break;
 
         case CTRL('w'):
@@ -129,9 +216,16 @@ void editor_process_keypress() {
             editor_find();
             break;
 
+        case CTRL('r'):
+            editor_replace();
+            break;
+
+        case CTRL('g'):
+            editor_grep();
+            break;
+
         case CTRL('k'):
             editor_set_status_message("Use terminal copy/paste (Ctrl+Shift+C/V or right-click)");
-            cursor_moved = true;
             break;
 
         case KEY_BACKSPACE:
@@ -143,7 +237,6 @@ void editor_process_keypress() {
         case '\t':
             if (E.file_tree_visible) {
                 file_tree_toggle_expand();
-                editor_refresh_screen();
                 return;
             } else {
                 editor_insert_char('\t');
@@ -164,14 +257,12 @@ void editor_process_keypress() {
         case KEY_END:
             if (E.file_tree_visible) {
                 editor_move_cursor(c);
-                cursor_moved = true;
                 if (E.selection_active) {
                     E.selection_end_cy = E.cy;
                     E.selection_end_cx = E.cx;
                 }
             } else {
                 editor_move_cursor(c);
-                cursor_moved = true;
                 if (E.selection_active) {
                     E.selection_end_cy = E.cy;
                     E.selection_end_cx = E.cx;
@@ -186,11 +277,9 @@ void editor_process_keypress() {
                 } else if (c == KEY_NPAGE) {
                     file_tree_move_cursor(E.screen_rows);
                 }
-                editor_refresh_screen();
                 return;
             } else {
                 editor_move_cursor(c);
-                cursor_moved = true;
                 if (E.selection_active) {
                     E.selection_end_cy = E.cy;
                     E.selection_end_cx = E.cx;
@@ -201,7 +290,9 @@ void editor_process_keypress() {
         case KEY_DOWN:
         case KEY_LEFT:
         case KEY_RIGHT:
-            if (E.file_tree_visible) {
+            if (E.find_active && (c == KEY_UP || c == KEY_DOWN)) {
+                editor_find_next(c == KEY_DOWN ? 1 : -1);
+            } else if (E.file_tree_visible) {
                 if (c == KEY_UP) {
                     file_tree_move_cursor(-1);
                 } else if (c == KEY_DOWN) {
@@ -209,11 +300,9 @@ void editor_process_keypress() {
                 } else if (c == KEY_LEFT || c == KEY_RIGHT) {
                     file_tree_toggle_expand();
                 }
-                editor_refresh_screen();
                 return;
             } else {
                 editor_move_cursor(c);
-                cursor_moved = true;
                 if (E.selection_active) {
                     E.selection_end_cy = E.cy;
                     E.selection_end_cx = E.cx;
@@ -223,12 +312,14 @@ void editor_process_keypress() {
         case CTRL('t'):
             E.show_line_numbers = !E.show_line_numbers;
             editor_set_status_message("Line numbers %s", E.show_line_numbers ? "ON" : "OFF");
-            cursor_moved = true;
+            break;
+
+        case CTRL('e'):
+            toggle_show_ignored();
             break;
 
         case CTRL('n'):
             toggle_file_tree();
-            editor_refresh_screen();
             return;
 
         case KEY_MOUSE:
@@ -255,7 +346,6 @@ void editor_process_keypress() {
                         } else {
                             file_tree_open_file();
                         }
-                        editor_refresh_screen();
                         return;
                     }
                 } else if (event.bstate &
@@ -271,7 +361,6 @@ void editor_process_keypress() {
                             E.row_offset--;
                         }
                     }
-                    cursor_moved = true;
                 } else if (event.bstate &
 #ifdef BUTTON5_PRESSED
                     BUTTON5_PRESSED
@@ -287,7 +376,6 @@ void editor_process_keypress() {
                             E.row_offset++;
                         }
                     }
-                    cursor_moved = true;
                 } else if (event.bstate &
 #ifdef BUTTON1_PRESSED
                     BUTTON1_PRESSED
@@ -301,7 +389,7 @@ void editor_process_keypress() {
                     int clicked_cx = 0;
 
                     if (clicked_cy < E.num_lines) {
-                        EditorLine *line = &E.lines[clicked_cy];
+                        EditorLine *line = buffer_line(clicked_cy);
                         int current_display_cx = 0;
                         for (int char_idx = 0; char_idx < (int)line->len; char_idx++) {
                             int char_display_width = 1;
@@ -319,7 +407,7 @@ void editor_process_keypress() {
                     if (clicked_cy >= E.num_lines) {
                         clicked_cy = E.num_lines > 0 ? E.num_lines - 1 : 0;
                     }
-                    EditorLine *line = (clicked_cy < E.num_lines) ? &E.lines[clicked_cy] : NULL;
+                    EditorLine *line = buffer_line(clicked_cy);
                     int line_len = line ? (int)line->len : 0;
                     if (clicked_cx > line_len) {
                         clicked_cx = line_len;
@@ -333,7 +421,6 @@ void editor_process_keypress() {
                     E.selection_active = false;
                     // Don't set selection coordinates for single click
 
-                    cursor_moved = true;
                 } else if ((event.bstate & REPORT_MOUSE_POSITION) && (event.bstate &
 #ifdef BUTTON1_PRESSED
                     BUTTON1_PRESSED
@@ -347,7 +434,7 @@ void editor_process_keypress() {
                     int drag_cx = 0;
 
                     if (drag_cy < E.num_lines) {
-                        EditorLine *line = &E.lines[drag_cy];
+                        EditorLine *line = buffer_line(drag_cy);
                         int current_display_cx = 0;
                         for (int char_idx = 0; char_idx < (int)line->len; char_idx++) {
                             int char_display_width = 1;
@@ -365,7 +452,7 @@ void editor_process_keypress() {
                     if (drag_cy >= E.num_lines) {
                         drag_cy = E.num_lines > 0 ? E.num_lines - 1 : 0;
                     }
-                    EditorLine *line = (drag_cy < E.num_lines) ? &E.lines[drag_cy] : NULL;
+                    EditorLine *line = buffer_line(drag_cy);
                     int line_len = line ? (int)line->len : 0;
                     if (drag_cx > line_len) {
                         drag_cx = line_len;
@@ -387,7 +474,6 @@ void editor_process_keypress() {
                     E.selection_end_cx = drag_cx;
                     E.cy = drag_cy;
                     E.cx = drag_cx;
-                    cursor_moved = true;
                 } else if (event.bstate &
 #ifdef BUTTON3_PRESSED
                     BUTTON3_PRESSED
@@ -406,20 +492,27 @@ void editor_process_keypress() {
         default:
             if (c >= 32 && c <= 126) {
                  editor_insert_char(c);
+            } else if (key_ctrl_home != -1 && c == key_ctrl_home) {
+                E.cy = 0;
+                E.cx = 0;
+            } else if (key_ctrl_end != -1 && c == key_ctrl_end) {
+                // The real last line only exists once indexing is done.
+                editor_wait_for_indexer();
+                E.cy = E.num_lines > 0 ? E.num_lines - 1 : 0;
+                E.cx = E.num_lines > 0 ? (int)buffer_line(E.cy)->len : 0;
             }
             break;
     }
 
-    if (E.dirty || cursor_moved || original_cx != E.cx || original_cy != E.cy || time(NULL) - status_message_time < 5 || E.context_menu_active) {
-        editor_refresh_screen();
-    }
 }
 
+// Runs from the event loop after a SIGWINCH, with the buffer locked. The
+// repaint is left to the loop's next frame.
 void handle_winch(int sig) {
     (void)sig;
     endwin();
     refresh();
     getmaxyx(stdscr, E.screen_rows, E.screen_cols);
     E.screen_rows -= 2;
-    editor_refresh_screen();
+    editor_invalidate_screen();
 }
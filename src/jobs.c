@@ -0,0 +1,179 @@
+#include"common.h"
+
+// A fixed pool of worker threads fed from one FIFO queue. Finished jobs go
+// on a done list and a byte is written to done_pipe, which the event loop
+// watches, so each job's finish callback runs on the UI thread.
+
+#define MAX_JOB_WORKERS 4
+
+static pthread_t workers[MAX_JOB_WORKERS];
+static int num_workers = 0;
+
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static Job *queue_head = NULL;
+static Job *queue_tail = NULL;
+static Job *done_head = NULL;
+static Job *done_tail = NULL;
+static bool jobs_stopping = false;
+static int done_pipe[2] = {-1, -1};
+
+static unsigned int job_generations[JOB_KINDS];
+
+int jobs_init();
+void jobs_shutdown();
+int job_submit(int kind, void (*run)(Job *job), void (*finish)(Job *job, bool cancelled), void *data);
+void job_cancel(int kind);
+bool job_cancelled(Job *job);
+int jobs_worker_count();
+
+static void job_list_push(Job **head, Job **tail, Job *job) {
+    job->next = NULL;
+    if (*tail) (*tail)->next = job;
+    else *head = job;
+    *tail = job;
+}
+
+static void *job_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&job_mutex);
+    while (1) {
+        while (queue_head == NULL && !jobs_stopping) {
+            pthread_cond_wait(&job_cond, &job_mutex);
+        }
+        if (jobs_stopping) break;
+
+        Job *job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL) queue_tail = NULL;
+        pthread_mutex_unlock(&job_mutex);
+
+        if (!job_cancelled(job)) job->run(job);
+
+        pthread_mutex_lock(&job_mutex);
+        job_list_push(&done_head, &done_tail, job);
+        char byte = 0;
+        ssize_t written = write(done_pipe[1], &byte, 1);
+        (void)written;
+    }
+    pthread_mutex_unlock(&job_mutex);
+    return NULL;
+}
+
+// Hands finished jobs to their finish callbacks.
+static void jobs_dispatch_done(int fd, void *data) {
+    (void)data;
+    char drain[64];
+    while (read(fd, drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&job_mutex);
+    Job *job = done_head;
+    done_head = done_tail = NULL;
+    pthread_mutex_unlock(&job_mutex);
+
+    while (job) {
+        Job *next = job->next;
+        job->finish(job, job_cancelled(job));
+        free(job);
+        job = next;
+    }
+}
+
+// Starts one worker per spare core, up to MAX_JOB_WORKERS. Without any,
+// job_submit() runs jobs inline.
+int jobs_init() {
+    if (pipe(done_pipe) == -1) {
+        done_pipe[0] = done_pipe[1] = -1;
+        return -1;
+    }
+    fcntl(done_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(done_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(done_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(done_pipe[1], F_SETFD, FD_CLOEXEC);
+    if (event_watch_fd(done_pipe[0], jobs_dispatch_done, NULL) == -1) return -1;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cores > 2 ? (int)cores - 1 : 1;
+    if (wanted > MAX_JOB_WORKERS) wanted = MAX_JOB_WORKERS;
+    while (num_workers < wanted) {
+        if (pthread_create(&workers[num_workers], NULL, job_worker, NULL) != 0) break;
+        num_workers++;
+    }
+    return num_workers > 0 ? 0 : -1;
+}
+
+// Cancels everything, waits for the workers, and finishes whatever was
+// left queued or done. Called with the buffer lock held.
+void jobs_shutdown() {
+    for (int kind = 0; kind < JOB_KINDS; kind++) job_cancel(kind);
+
+    pthread_mutex_lock(&job_mutex);
+    jobs_stopping = true;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_mutex);
+
+    // Running jobs need the buffer lock to notice they were cancelled.
+    buffer_unlock();
+    for (int i = 0; i < num_workers; i++) pthread_join(workers[i], NULL);
+    buffer_lock();
+    num_workers = 0;
+
+    Job *job = queue_head;
+    queue_head = queue_tail = NULL;
+    while (job) {
+        Job *next = job->next;
+        job_list_push(&done_head, &done_tail, job);
+        job = next;
+    }
+    if (done_pipe[0] != -1) {
+        jobs_dispatch_done(done_pipe[0], NULL);
+        event_unwatch_fd(done_pipe[0]);
+        close(done_pipe[0]);
+        close(done_pipe[1]);
+        done_pipe[0] = done_pipe[1] = -1;
+    }
+}
+
+// Queues a job under the current generation of `kind`. `data` belongs to
+// the job from here on and is released by `finish`.
+int job_submit(int kind, void (*run)(Job *job), void (*finish)(Job *job, bool cancelled), void *data) {
+    Job *job = malloc(sizeof(Job));
+    if (job == NULL) return -1;
+    job->kind = kind;
+    job->generation = __atomic_load_n(&job_generations[kind], __ATOMIC_ACQUIRE);
+    job->run = run;
+    job->finish = finish;
+    job->data = data;
+    job->next = NULL;
+
+    if (num_workers == 0) {
+        buffer_unlock();
+        job->run(job);
+        buffer_lock();
+        job->finish(job, job_cancelled(job));
+        free(job);
+        return 0;
+    }
+
+    pthread_mutex_lock(&job_mutex);
+    job_list_push(&queue_head, &queue_tail, job);
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_mutex);
+    return 0;
+}
+
+// Supersedes every job of `kind` submitted so far. Jobs blocked waiting
+// for the indexer are woken so they can notice.
+void job_cancel(int kind) {
+    __atomic_add_fetch(&job_generations[kind], 1, __ATOMIC_RELEASE);
+    buffer_signal_grown();
+}
+
+bool job_cancelled(Job *job) {
+    return __atomic_load_n(&job_generations[job->kind], __ATOMIC_ACQUIRE) != job->generation;
+}
+
+// How many jobs can run at once; 0 when they run inline.
+int jobs_worker_count() {
+    return num_workers;
+}
@@ -2,38 +2,78 @@
 
 extern EditorConfig E;
 
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 int main(int argc, char *argv[]) {
+    // The UI thread owns the buffer except while it waits for input.
+    buffer_lock();
     init_editor();
 
     if (argc >= 2) {
         editor_read_file(argv[1]);
     } else {
-        E.lines = malloc(sizeof(EditorLine));
-        if (E.lines == NULL) {
+        if (buffer_insert_line(0, "", 0) == -1) {
             cleanup_editor();
             fprintf(stderr, "Fatal error: out of memory (main empty line).\n");
             exit(1);
         }
-        E.lines[0].text = strdup("");
-        if (E.lines[0].text == NULL) {
-            free(E.lines);
-            E.lines = NULL;
-            cleanup_editor();
-            fprintf(stderr, "Fatal error: out of memory (main empty line text).\n");
-            exit(1);
-        }
-        E.lines[0].len = 0;
-        E.lines[0].hl = NULL;
-        E.lines[0].hl_open_comment = 0;
-        E.num_lines = 1;
-        editor_update_syntax(0);
         editor_set_status_message("Welcome to Nimki! Press Ctrl+Q to quit. Ctrl+S to save. Ctrl+F to find. Ctrl+K to select/copy. Ctrl+T to toggle line numbers.");
     }
 
     editor_refresh_screen();
 
+    // Every key that is already waiting is applied before the next frame is
+    // drawn, and frames are at least frame_ms apart, so a paste typed out by
+    // the terminal costs a handful of redraws instead of one per byte.
+    long long frame_ms = 1000 / E.max_fps;
+    long long last_frame = now_ms();
+    bool frame_pending = false;
+    // A burst stays open across frames until the input queue runs dry, so
+    // one paste is still one undo record.
+    bool in_burst = false;
+
     while (1) {
-        editor_process_keypress();
+        // Between bursts, sleep until input, a resize, a worker wakeup, the
+        // next clock or status-message change, or the pending frame is due.
+        if (!in_burst) {
+            editor_schedule_highlight();
+            int wait_ms = editor_next_timer_ms();
+            if (E.indexing && wait_ms > 100) wait_ms = 100;
+            if (frame_pending) {
+                long long until_frame = last_frame + frame_ms - now_ms();
+                if (until_frame < wait_ms) wait_ms = until_frame > 0 ? (int)until_frame : 0;
+            }
+            event_wait(wait_ms);
+            editor_poll_indexer();
+        }
+
+        // Always drained without waiting: curses may hold keys that poll()
+        // cannot see, and a burst left open at the last frame ends here
+        // rather than absorbing a key typed later into its undo record.
+        int c = editor_read_key_timeout(0);
+        if (c != ERR) {
+            if (!in_burst) editor_undo_group_begin();
+            in_burst = true;
+            do {
+                editor_process_keypress(c);
+                if (now_ms() - last_frame >= frame_ms) break;
+            } while ((c = editor_read_key_timeout(0)) != ERR);
+        }
+        if (c == ERR && in_burst) {
+            editor_undo_group_end();
+            in_burst = false;
+        }
+        frame_pending = true;
+
+        if (now_ms() - last_frame >= frame_ms) {
+            editor_refresh_screen();
+            last_frame = now_ms();
+            frame_pending = false;
+        }
     }
 
     return 0;
@@ -0,0 +1,322 @@
+#include"common.h"
+
+// Every position where the find query matches, sorted, built by a
+// background job while the user types or navigates. With it next and
+// previous are binary searches and the status bar can say "match 37 /
+// 12,408". The index only ever covers a prefix of the buffer: it holds all
+// matches before its frontier, so lookups are exact there and fall back to
+// a scan beyond it.
+//
+// The job appends to the index directly, always with the buffer lock held
+// and only after checking it has not been cancelled, so the UI thread can
+// read it at any time without further locking.
+
+// Bytes scanned per hold of the buffer lock.
+#define MATCH_INDEX_CHUNK (1 << 20)
+// Matches recorded, or earlier ones rechecked, per hold of the lock.
+#define MATCH_INDEX_CANDIDATES 65536
+// Matches kept at most; past that the index stays partial.
+#define MATCH_INDEX_MAX (1 << 21)
+// How often a running job wakes the UI so counts shown update.
+#define MATCH_INDEX_PROGRESS_MS 100
+
+typedef struct {
+    int row;
+    int col;
+} MatchPosition;
+
+typedef struct {
+    char *query;
+    MatchPosition *positions;
+    int count;
+    int cap;
+    // All matches before (frontier_row, frontier_col) are in `positions`.
+    int frontier_row;
+    int frontier_col;
+    unsigned int edit_version;
+    bool running;
+    bool complete;
+    bool truncated;
+} MatchIndex;
+
+typedef struct {
+    char *query;
+    SearchPattern pattern;
+    // Matches of a query this one extends, valid before the old frontier.
+    MatchPosition *candidates;
+    int num_candidates;
+    int candidates_row;
+    int candidates_col;
+} MatchIndexJob;
+
+static MatchIndex match_index = {0};
+
+void match_index_update(const char *query);
+bool match_index_next(int row, int col, int direction, int *match_row, int *match_col);
+bool match_index_describe(const char *query, int row, int col, char *buffer, size_t size);
+void match_index_stop();
+
+static long long match_index_clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int position_compare(int row_a, int col_a, int row_b, int col_b) {
+    if (row_a != row_b) return row_a < row_b ? -1 : 1;
+    return (col_a > col_b) - (col_a < col_b);
+}
+
+// Index of the first position at or after (row, col).
+static int match_index_lower_bound(int row, int col) {
+    int lo = 0, hi = match_index.count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (position_compare(match_index.positions[mid].row, match_index.positions[mid].col, row, col) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool match_index_before_frontier(int row, int col) {
+    return match_index.complete || position_compare(row, col, match_index.frontier_row, match_index.frontier_col) < 0;
+}
+
+// Records a match and moves the frontier past it. Returns false once the
+// index is full.
+static bool match_index_add(int row, int col) {
+    if (match_index.count == MATCH_INDEX_MAX) {
+        match_index.truncated = true;
+        return false;
+    }
+    if (match_index.count == match_index.cap) {
+        int new_cap = match_index.cap ? match_index.cap * 2 : 256;
+        MatchPosition *new_positions = realloc(match_index.positions, new_cap * sizeof(MatchPosition));
+        if (new_positions == NULL) {
+            match_index.truncated = true;
+            return false;
+        }
+        match_index.positions = new_positions;
+        match_index.cap = new_cap;
+    }
+    match_index.positions[match_index.count].row = row;
+    match_index.positions[match_index.count].col = col;
+    match_index.count++;
+    match_index.frontier_row = row;
+    match_index.frontier_col = col + 1;
+    return true;
+}
+
+// Keeps the candidates the new literal query still matches at.
+static bool match_index_narrow(Job *job, MatchIndexJob *data) {
+    for (int i = 0; i < data->num_candidates; ) {
+        int end = i + MATCH_INDEX_CANDIDATES < data->num_candidates ? i + MATCH_INDEX_CANDIDATES : data->num_candidates;
+        for (; i < end; i++) {
+            MatchPosition *candidate = &data->candidates[i];
+            EditorLine *line = buffer_line(candidate->row);
+            if ((size_t)candidate->col + data->pattern.needle_len <= line->len &&
+                memcmp(line->text + candidate->col, data->pattern.needle, data->pattern.needle_len) == 0 &&
+                !match_index_add(candidate->row, candidate->col)) {
+                return false;
+            }
+        }
+        buffer_yield();
+        if (job_cancelled(job) || buffer_edit_version() != match_index.edit_version) return false;
+    }
+    match_index.frontier_row = data->candidates_row;
+    match_index.frontier_col = data->candidates_col;
+    return true;
+}
+
+static void match_index_run(Job *job) {
+    MatchIndexJob *data = job->data;
+    long long last_progress = match_index_clock_ms();
+
+    buffer_lock();
+    if (job_cancelled(job) || (data->candidates && !match_index_narrow(job, data))) {
+        buffer_unlock();
+        return;
+    }
+
+    int row = match_index.frontier_row;
+    int col = match_index.frontier_col;
+    while (!job_cancelled(job) && buffer_edit_version() == match_index.edit_version) {
+        if (row >= E.num_lines) {
+            if (E.indexing) {
+                buffer_wait_grown();
+                continue;
+            }
+            match_index.complete = true;
+            break;
+        }
+
+        // A match ends a search_buffer() call before it charges the budget,
+        // so dense matches are capped separately.
+        size_t budget = MATCH_INDEX_CHUNK;
+        bool full = false;
+        for (int found = 0; found < MATCH_INDEX_CANDIDATES && budget > 0 &&
+                            search_buffer(&data->pattern, 1, &row, &col, E.num_lines, &budget); found++) {
+            if (!match_index_add(row, col)) {
+                full = true;
+                break;
+            }
+            col++;
+        }
+        if (full) break;
+        match_index.frontier_row = row;
+        match_index.frontier_col = col;
+
+        if (match_index_clock_ms() - last_progress >= MATCH_INDEX_PROGRESS_MS) {
+            event_wake();
+            last_progress = match_index_clock_ms();
+        }
+        buffer_yield();
+    }
+    buffer_unlock();
+}
+
+static void match_index_finish(Job *job, bool cancelled) {
+    MatchIndexJob *data = job->data;
+    if (!cancelled) {
+        match_index.running = false;
+        // The final count replaces the running one.
+        if (E.find_active && E.last_match_row != -1) editor_find_report();
+    }
+    search_pattern_free(&data->pattern);
+    free(data->candidates);
+    free(data->query);
+    free(data);
+}
+
+static bool match_index_is_regex(const char *query, size_t len) {
+    return len > 2 && query[0] == '/' && query[len - 1] == '/';
+}
+
+// Makes the index follow `query`, starting a job unless it already covers
+// it. A literal query that extends the previous one only rechecks the
+// previous matches, and scanning resumes where the old index stopped.
+void match_index_update(const char *query) {
+    unsigned int edit_version = buffer_edit_version();
+    bool same_buffer = match_index.query && match_index.edit_version == edit_version;
+    bool same_query = same_buffer && strcmp(match_index.query, query) == 0;
+    if (same_query && (match_index.running || match_index.complete || match_index.truncated)) return;
+
+    match_index_stop();
+
+    MatchIndexJob *data = calloc(1, sizeof(MatchIndexJob));
+    char *index_query = strdup(query);
+    if (data) data->query = strdup(query);
+    if (data == NULL || index_query == NULL || data->query == NULL ||
+        search_pattern_init(&data->pattern, data->query, NULL, 0) == -1) {
+        // Bad regexes are reported by find itself; the index stays empty.
+        if (data) free(data->query);
+        free(data);
+        data = NULL;
+    }
+
+    size_t old_len = same_buffer ? strlen(match_index.query) : 0;
+    bool extends = data && same_buffer && old_len > 0 && data->pattern.regex == NULL &&
+                   !match_index_is_regex(match_index.query, old_len) &&
+                   strncmp(match_index.query, query, old_len) == 0;
+    if (data && (same_query || extends)) {
+        data->candidates = match_index.positions;
+        data->num_candidates = match_index.count;
+        data->candidates_row = match_index.complete ? INT_MAX : match_index.frontier_row;
+        data->candidates_col = match_index.complete ? 0 : match_index.frontier_col;
+        match_index.positions = NULL;
+    }
+
+    free(match_index.positions);
+    free(match_index.query);
+    memset(&match_index, 0, sizeof(match_index));
+    match_index.query = index_query;
+    match_index.edit_version = edit_version;
+    if (data == NULL) return;
+
+    match_index.running = true;
+    if (job_submit(JOB_MATCH_INDEX, match_index_run, match_index_finish, data) == -1) {
+        match_index.running = false;
+        search_pattern_free(&data->pattern);
+        free(data->candidates);
+        free(data->query);
+        free(data);
+    }
+}
+
+// Cancels the job building the index. What it found so far stays, and the
+// next update for the same query carries on from there.
+void match_index_stop() {
+    job_cancel(JOB_MATCH_INDEX);
+    match_index.running = false;
+}
+
+// Finds the nearest indexed match after (row, col) going forward, or before
+// it going backward, wrapping around once the index is complete. Returns
+// false when the answer lies beyond the frontier and needs a scan.
+bool match_index_next(int row, int col, int direction, int *match_row, int *match_col) {
+    if (match_index.query == NULL || match_index.edit_version != buffer_edit_version() ||
+        strcmp(match_index.query, E.search_query) != 0) {
+        return false;
+    }
+
+    int i = match_index_lower_bound(row, col);
+    if (direction == 1) {
+        if (i == match_index.count) {
+            if (!match_index.complete || match_index.count == 0) return false;
+            i = 0;
+        }
+    } else {
+        // The match at (row, col) itself counts going backward too.
+        if (i < match_index.count && position_compare(match_index.positions[i].row, match_index.positions[i].col, row, col) == 0) {
+            i++;
+        }
+        if (!match_index_before_frontier(row, col)) return false;
+        if (i == 0) {
+            if (!match_index.complete || match_index.count == 0) return false;
+            i = match_index.count;
+        }
+        i--;
+    }
+    *match_row = match_index.positions[i].row;
+    *match_col = match_index.positions[i].col;
+    return true;
+}
+
+static void format_count(char *buffer, size_t size, int n) {
+    char digits[16];
+    int len = snprintf(digits, sizeof(digits), "%d", n);
+    size_t out = 0;
+    for (int i = 0; i < len && out + 1 < size; i++) {
+        if (i > 0 && (len - i) % 3 == 0 && out + 2 < size) buffer[out++] = ',';
+        buffer[out++] = digits[i];
+    }
+    buffer[out] = '\0';
+}
+
+// Describes where (row, col) stands among the matches of `query`, as in
+// "match 37 / 12,408", with a + on the total while it is still growing.
+// Returns false when the index does not cover `query`.
+bool match_index_describe(const char *query, int row, int col, char *buffer, size_t size) {
+    if (query == NULL || match_index.query == NULL || strcmp(match_index.query, query) != 0 ||
+        match_index.edit_version != buffer_edit_version()) {
+        return false;
+    }
+
+    char total[32];
+    format_count(total, sizeof(total), match_index.count);
+    const char *partial = match_index.complete ? "" : "+";
+    int i = row >= 0 ? match_index_lower_bound(row, col) : match_index.count;
+    if (i < match_index.count && match_index.positions[i].row == row && match_index.positions[i].col == col) {
+        char ordinal[32];
+        format_count(ordinal, sizeof(ordinal), i + 1);
+        snprintf(buffer, size, "match %s / %s%s", ordinal, total, partial);
+    } else if (match_index.count == 0) {
+        snprintf(buffer, size, "%s", match_index.complete ? "no matches" : "counting...");
+    } else {
+        snprintf(buffer, size, "%s%s matches", total, partial);
+    }
+    return true;
+}
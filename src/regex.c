@@ -0,0 +1,839 @@
+#include"common.h"
+#include<stdint.h>
+
+// Regular expressions for find. A pattern is parsed into a small syntax
+// tree and compiled twice into Thompson NFAs, once as written and once
+// reversed. Each NFA is run as a DFA whose states are built lazily, one
+// transition at a time, the first time the scan needs them. There is no
+// backtracking, so every scan is linear in the text.
+//
+// Matches are leftmost-longest. Searching forward takes two passes that
+// both stay near the match. A leftmost DFA runs from the search column and
+// keeps its threads in groups by where they started; once a group accepts,
+// the later ones are dropped, and the scan goes on only while an earlier or
+// the accepting group can still match. Where it last accepted is the end of
+// the leftmost-longest match, and the reversed DFA, run back from there,
+// finds its start. Searching backward, and patterns anchored with ^ or $,
+// use the reversed DFA from the end of the line to mark every position
+// where a match starts, and the forward DFA from the chosen start.
+//
+// Supported: literals, ., [...] and [^...] classes with ranges, \d \w \s
+// and their negations, escapes, groups, |, *, +, ?, {m}, {m,} and {m,n}.
+// ^ and $ anchor the whole pattern when they are its first or last
+// character. A DFA mutates its cache while scanning, so a Regex must not be
+// used by two threads at once.
+
+#define REGEX_MAX_NODES 20000
+#define REGEX_MAX_REPEAT 1000
+// Cached DFA states per DFA. When full the cache is dropped and rebuilt as
+// the scan goes, so memory stays bounded on any pattern.
+#define DFA_MAX_STATES 1024
+// Markers in a leftmost DFA state's NFA state list: the end of a group of
+// threads that started at the same position, and, last, that threads are
+// still being started at every position.
+#define DFA_GROUP_END -1
+#define DFA_RESTART -2
+
+enum RegexNodeType {
+    NODE_SET,
+    NODE_EMPTY,
+    NODE_CONCAT,
+    NODE_ALT,
+    NODE_STAR,
+    NODE_PLUS,
+    NODE_QUEST
+};
+
+typedef struct {
+    int type;
+    int left;
+    int right;
+    uint64_t set[4];
+} RegexNode;
+
+enum NfaStateType {
+    NFA_SET,
+    NFA_EPSILON,
+    NFA_SPLIT,
+    NFA_MATCH
+};
+
+typedef struct {
+    int type;
+    int out;
+    int out1;
+    int node;
+} NfaState;
+
+typedef struct {
+    NfaState *states;
+    int num_states;
+    int cap;
+    int start;
+} Nfa;
+
+typedef struct {
+    int *nfa_states;
+    int count;
+    unsigned int hash;
+    bool accepting;
+    // Next DFA state per byte: -2 not built yet, -1 dead.
+    int next[256];
+} DfaState;
+
+typedef struct {
+    Nfa *nfa;
+    const RegexNode *nodes;
+    // Unanchored DFAs restart the NFA at every position.
+    bool unanchored;
+    // Leftmost DFAs restart it too, as a new group, until a group accepts.
+    bool leftmost;
+    DfaState **states;
+    int num_states;
+    int *table;
+    int table_cap;
+    int start;
+    unsigned int flushes;
+    // Scratch space for building a state: visit marks and the state list.
+    unsigned int *marks;
+    unsigned int mark;
+    int *list;
+    int *stack;
+} Dfa;
+
+struct Regex {
+    RegexNode *nodes;
+    int num_nodes;
+    int cap;
+    bool anchored_start;
+    bool anchored_end;
+    Nfa nfa_forward;
+    Nfa nfa_reverse;
+    // Longest match from a given start.
+    Dfa forward;
+    // Every match start, scanning leftward from the end of the line.
+    Dfa reverse;
+    // End of the leftmost-longest match at or after a column.
+    Dfa leftmost;
+    // Starts of the matches that end at a given position.
+    Dfa reverse_anchored;
+};
+
+typedef struct {
+    const char *p;
+    const char *end;
+    Regex *re;
+    const char *error;
+    // Group nesting, to tell a top-level | from one inside ( ).
+    int depth;
+    bool top_level_alternation;
+} RegexParser;
+
+Regex *regex_compile(const char *pattern, size_t len, char *error, size_t error_size);
+void regex_free(Regex *re);
+bool regex_search(Regex *re, const char *text, size_t len, size_t col, int direction, size_t *match_start, size_t *match_len);
+
+static void set_add(uint64_t *set, unsigned char c) {
+    set[c >> 6] |= 1ULL << (c & 63);
+}
+
+static bool set_has(const uint64_t *set, unsigned char c) {
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+static void set_add_range(uint64_t *set, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) set_add(set, (unsigned char)c);
+}
+
+static void set_negate(uint64_t *set) {
+    for (int i = 0; i < 4; i++) set[i] = ~set[i];
+}
+
+static int node_new(RegexParser *parser, int type, int left, int right) {
+    Regex *re = parser->re;
+    if (re->num_nodes == REGEX_MAX_NODES) {
+        parser->error = "pattern too large";
+        return -1;
+    }
+    if (re->num_nodes == re->cap) {
+        int new_cap = re->cap ? re->cap * 2 : 64;
+        RegexNode *new_nodes = realloc(re->nodes, new_cap * sizeof(RegexNode));
+        if (new_nodes == NULL) {
+            parser->error = "out of memory";
+            return -1;
+        }
+        re->nodes = new_nodes;
+        re->cap = new_cap;
+    }
+    RegexNode *node = &re->nodes[re->num_nodes];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return re->num_nodes++;
+}
+
+static int node_clone(RegexParser *parser, int index) {
+    if (index < 0) return index;
+    RegexNode copy = parser->re->nodes[index];
+    int left = node_clone(parser, copy.left);
+    int right = node_clone(parser, copy.right);
+    if ((copy.left >= 0 && left < 0) || (copy.right >= 0 && right < 0)) return -1;
+    int clone = node_new(parser, copy.type, left, right);
+    if (clone >= 0) memcpy(parser->re->nodes[clone].set, copy.set, sizeof(copy.set));
+    return clone;
+}
+
+// Adds the class of a \d, \w or \s escape, negated for \D, \W, \S. Returns
+// false when `c` is not a class escape.
+static bool parse_class_escape(char c, uint64_t *set) {
+    uint64_t class_set[4] = {0, 0, 0, 0};
+    switch (tolower((unsigned char)c)) {
+        case 'd':
+            set_add_range(class_set, '0', '9');
+            break;
+        case 'w':
+            set_add_range(class_set, '0', '9');
+            set_add_range(class_set, 'a', 'z');
+            set_add_range(class_set, 'A', 'Z');
+            set_add(class_set, '_');
+            break;
+        case 's':
+            set_add(class_set, ' ');
+            set_add_range(class_set, '\t', '\r');
+            break;
+        default:
+            return false;
+    }
+    if (isupper((unsigned char)c)) set_negate(class_set);
+    for (int i = 0; i < 4; i++) set[i] |= class_set[i];
+    return true;
+}
+
+static unsigned char parse_escaped_char(char c) {
+    switch (c) {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        default: return (unsigned char)c;
+    }
+}
+
+static int parse_alternation(RegexParser *parser);
+
+static int parse_class(RegexParser *parser) {
+    int node = node_new(parser, NODE_SET, -1, -1);
+    if (node < 0) return -1;
+    uint64_t set[4] = {0, 0, 0, 0};
+    bool negate = false;
+
+    parser->p++;
+    if (parser->p < parser->end && *parser->p == '^') {
+        negate = true;
+        parser->p++;
+    }
+    bool first = true;
+    while (parser->p < parser->end && (*parser->p != ']' || first)) {
+        first = false;
+        unsigned char lo = (unsigned char)*parser->p++;
+        if (lo == '\\' && parser->p < parser->end) {
+            char escaped = *parser->p++;
+            if (parse_class_escape(escaped, set)) continue;
+            lo = parse_escaped_char(escaped);
+        }
+        if (parser->p + 1 < parser->end && *parser->p == '-' && parser->p[1] != ']') {
+            parser->p++;
+            unsigned char hi = (unsigned char)*parser->p++;
+            if (hi == '\\' && parser->p < parser->end) hi = parse_escaped_char(*parser->p++);
+            if (hi < lo) {
+                parser->error = "bad range in []";
+                return -1;
+            }
+            set_add_range(set, lo, hi);
+        } else {
+            set_add(set, lo);
+        }
+    }
+    if (parser->p == parser->end) {
+        parser->error = "missing ]";
+        return -1;
+    }
+    parser->p++;
+    if (negate) set_negate(set);
+    memcpy(parser->re->nodes[node].set, set, sizeof(set));
+    return node;
+}
+
+static int parse_atom(RegexParser *parser) {
+    char c = *parser->p;
+    if (c == '(') {
+        parser->p++;
+        parser->depth++;
+        int inner = parse_alternation(parser);
+        parser->depth--;
+        if (inner < 0) return -1;
+        if (parser->p == parser->end || *parser->p != ')') {
+            parser->error = "missing )";
+            return -1;
+        }
+        parser->p++;
+        return inner;
+    }
+    if (c == '[') return parse_class(parser);
+    if (c == '*' || c == '+' || c == '?' || c == '{') {
+        parser->error = "nothing to repeat";
+        return -1;
+    }
+    if (c == '^' || c == '$') {
+        parser->error = "^ and $ only anchor the whole pattern";
+        return -1;
+    }
+
+    int node = node_new(parser, NODE_SET, -1, -1);
+    if (node < 0) return -1;
+    uint64_t *set = parser->re->nodes[node].set;
+    parser->p++;
+    if (c == '.') {
+        set_negate(set);
+    } else if (c == '\\') {
+        if (parser->p == parser->end) {
+            parser->error = "trailing \\";
+            return -1;
+        }
+        char escaped = *parser->p++;
+        if (!parse_class_escape(escaped, set)) set_add(set, parse_escaped_char(escaped));
+    } else {
+        set_add(set, (unsigned char)c);
+    }
+    return node;
+}
+
+// Reads the number of a {m,n} repeat. Returns false when there is none, or
+// with parser->error set when it is above REGEX_MAX_REPEAT.
+static bool parse_count(RegexParser *parser, int *value) {
+    if (parser->p == parser->end || !isdigit((unsigned char)*parser->p)) return false;
+    *value = 0;
+    while (parser->p < parser->end && isdigit((unsigned char)*parser->p)) {
+        *value = *value * 10 + (*parser->p++ - '0');
+        if (*value > REGEX_MAX_REPEAT) {
+            parser->error = "repeat count too large";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Expands x{min,max} into min copies of x followed by max-min optional
+// ones, or a star when there is no upper bound (max == -1).
+static int expand_repeat(RegexParser *parser, int atom, int min, int max) {
+    int result = -1;
+    for (int i = 0; i < min; i++) {
+        int copy = i == 0 ? atom : node_clone(parser, atom);
+        if (copy < 0) return -1;
+        result = result < 0 ? copy : node_new(parser, NODE_CONCAT, result, copy);
+        if (result < 0) return -1;
+    }
+    if (max == -1) {
+        int copy = min == 0 ? atom : node_clone(parser, atom);
+        if (copy < 0) return -1;
+        int star = node_new(parser, NODE_STAR, copy, -1);
+        if (star < 0) return -1;
+        return result < 0 ? star : node_new(parser, NODE_CONCAT, result, star);
+    }
+    for (int i = min; i < max; i++) {
+        int copy = i == 0 ? atom : node_clone(parser, atom);
+        if (copy < 0) return -1;
+        int quest = node_new(parser, NODE_QUEST, copy, -1);
+        if (quest < 0) return -1;
+        result = result < 0 ? quest : node_new(parser, NODE_CONCAT, result, quest);
+        if (result < 0) return -1;
+    }
+    return result < 0 ? node_new(parser, NODE_EMPTY, -1, -1) : result;
+}
+
+static int parse_repeat(RegexParser *parser) {
+    int node = parse_atom(parser);
+    while (node >= 0 && parser->p < parser->end) {
+        char c = *parser->p;
+        if (c == '*' || c == '+' || c == '?') {
+            parser->p++;
+            int type = c == '*' ? NODE_STAR : c == '+' ? NODE_PLUS : NODE_QUEST;
+            node = node_new(parser, type, node, -1);
+        } else if (c == '{') {
+            const char *brace = parser->p++;
+            int min, max;
+            if (!parse_count(parser, &min)) {
+                if (parser->error) return -1;
+                // Not a valid bound; take the brace literally.
+                parser->p = brace;
+                break;
+            }
+            max = min;
+            if (parser->p < parser->end && *parser->p == ',') {
+                parser->p++;
+                if (!parse_count(parser, &max)) {
+                    if (parser->error) return -1;
+                    max = -1;
+                }
+            }
+            if (parser->p == parser->end || *parser->p != '}' || (max != -1 && max < min)) {
+                parser->error = "bad {m,n} repeat";
+                return -1;
+            }
+            parser->p++;
+            node = expand_repeat(parser, node, min, max);
+        } else {
+            break;
+        }
+    }
+    return node;
+}
+
+static int parse_concatenation(RegexParser *parser) {
+    int node = -1;
+    while (parser->p < parser->end && *parser->p != '|' && *parser->p != ')') {
+        // A literal brace that parse_repeat() handed back.
+        if (*parser->p == '{') {
+            int literal = node_new(parser, NODE_SET, -1, -1);
+            if (literal < 0) return -1;
+            set_add(parser->re->nodes[literal].set, '{');
+            parser->p++;
+            node = node < 0 ? literal : node_new(parser, NODE_CONCAT, node, literal);
+            if (node < 0) return -1;
+            continue;
+        }
+        int next = parse_repeat(parser);
+        if (next < 0) return -1;
+        node = node < 0 ? next : node_new(parser, NODE_CONCAT, node, next);
+        if (node < 0) return -1;
+    }
+    return node < 0 ? node_new(parser, NODE_EMPTY, -1, -1) : node;
+}
+
+static int parse_alternation(RegexParser *parser) {
+    int node = parse_concatenation(parser);
+    while (node >= 0 && parser->p < parser->end && *parser->p == '|') {
+        if (parser->depth == 0) parser->top_level_alternation = true;
+        parser->p++;
+        int next = parse_concatenation(parser);
+        if (next < 0) return -1;
+        node = node_new(parser, NODE_ALT, node, next);
+    }
+    return node;
+}
+
+static int nfa_add(Nfa *nfa, int type, int out, int out1, int node) {
+    if (nfa->num_states == nfa->cap) {
+        int new_cap = nfa->cap ? nfa->cap * 2 : 64;
+        NfaState *new_states = realloc(nfa->states, new_cap * sizeof(NfaState));
+        if (new_states == NULL) return -1;
+        nfa->states = new_states;
+        nfa->cap = new_cap;
+    }
+    NfaState *state = &nfa->states[nfa->num_states];
+    state->type = type;
+    state->out = out;
+    state->out1 = out1;
+    state->node = node;
+    return nfa->num_states++;
+}
+
+// Builds the fragment for `index`, returning its entry state and setting
+// *exit to an epsilon state whose `out` is still to be connected. With
+// `reverse` set, concatenations are laid out back to front.
+static int nfa_build(Nfa *nfa, const RegexNode *nodes, int index, bool reverse, int *exit) {
+    const RegexNode *node = &nodes[index];
+    int end = nfa_add(nfa, NFA_EPSILON, -1, -1, -1);
+    if (end < 0) return -1;
+    *exit = end;
+
+    switch (node->type) {
+        case NODE_SET: {
+            return nfa_add(nfa, NFA_SET, end, -1, index);
+        }
+        case NODE_EMPTY:
+            return end;
+        case NODE_CONCAT: {
+            int first_exit, second_exit;
+            int first = nfa_build(nfa, nodes, reverse ? node->right : node->left, reverse, &first_exit);
+            if (first < 0) return -1;
+            int second = nfa_build(nfa, nodes, reverse ? node->left : node->right, reverse, &second_exit);
+            if (second < 0) return -1;
+            nfa->states[first_exit].out = second;
+            nfa->states[second_exit].out = end;
+            return first;
+        }
+        case NODE_ALT: {
+            int left_exit, right_exit;
+            int left = nfa_build(nfa, nodes, node->left, reverse, &left_exit);
+            if (left < 0) return -1;
+            int right = nfa_build(nfa, nodes, node->right, reverse, &right_exit);
+            if (right < 0) return -1;
+            nfa->states[left_exit].out = end;
+            nfa->states[right_exit].out = end;
+            return nfa_add(nfa, NFA_SPLIT, left, right, -1);
+        }
+        case NODE_STAR:
+        case NODE_PLUS:
+        case NODE_QUEST: {
+            int inner_exit;
+            int inner = nfa_build(nfa, nodes, node->left, reverse, &inner_exit);
+            if (inner < 0) return -1;
+            int split = nfa_add(nfa, NFA_SPLIT, inner, end, -1);
+            if (split < 0) return -1;
+            nfa->states[inner_exit].out = node->type == NODE_QUEST ? end : split;
+            return node->type == NODE_PLUS ? inner : split;
+        }
+    }
+    return -1;
+}
+
+static int nfa_compile(Nfa *nfa, const RegexNode *nodes, int root, bool reverse) {
+    int exit;
+    int start = nfa_build(nfa, nodes, root, reverse, &exit);
+    if (start < 0) return -1;
+    int match = nfa_add(nfa, NFA_MATCH, -1, -1, -1);
+    if (match < 0) return -1;
+    nfa->states[exit].out = match;
+    nfa->start = start;
+    return 0;
+}
+
+static int dfa_init(Dfa *dfa, Nfa *nfa, const RegexNode *nodes, bool unanchored, bool leftmost) {
+    memset(dfa, 0, sizeof(*dfa));
+    dfa->nfa = nfa;
+    dfa->nodes = nodes;
+    dfa->unanchored = unanchored;
+    dfa->leftmost = leftmost;
+    dfa->start = -1;
+    dfa->states = malloc(DFA_MAX_STATES * sizeof(DfaState *));
+    dfa->table_cap = DFA_MAX_STATES * 2;
+    dfa->table = calloc(dfa->table_cap, sizeof(int));
+    dfa->marks = calloc(nfa->num_states, sizeof(unsigned int));
+    // Room for a group marker after every state, and DFA_RESTART.
+    dfa->list = malloc((nfa->num_states * 2 + 1) * sizeof(int));
+    dfa->stack = malloc(nfa->num_states * sizeof(int));
+    if (!dfa->states || !dfa->table || !dfa->marks || !dfa->list || !dfa->stack) return -1;
+    return 0;
+}
+
+static void dfa_flush(Dfa *dfa) {
+    for (int i = 0; i < dfa->num_states; i++) {
+        free(dfa->states[i]->nfa_states);
+        free(dfa->states[i]);
+    }
+    dfa->num_states = 0;
+    memset(dfa->table, 0, dfa->table_cap * sizeof(int));
+    dfa->start = -1;
+    dfa->flushes++;
+}
+
+static void dfa_free(Dfa *dfa) {
+    if (dfa->states) dfa_flush(dfa);
+    free(dfa->states);
+    free(dfa->table);
+    free(dfa->marks);
+    free(dfa->list);
+    free(dfa->stack);
+}
+
+// Adds the epsilon closure of `state` to dfa->list, keeping only the states
+// that consume a byte or accept.
+static void dfa_closure(Dfa *dfa, int state, int *count) {
+    int top = 0;
+    if (dfa->marks[state] == dfa->mark) return;
+    dfa->marks[state] = dfa->mark;
+    dfa->stack[top++] = state;
+    while (top > 0) {
+        NfaState *s = &dfa->nfa->states[dfa->stack[--top]];
+        int idx = (int)(s - dfa->nfa->states);
+        if (s->type == NFA_SET || s->type == NFA_MATCH) {
+            dfa->list[(*count)++] = idx;
+            continue;
+        }
+        int outs[2] = {s->out, s->type == NFA_SPLIT ? s->out1 : -1};
+        for (int i = 1; i >= 0; i--) {
+            if (outs[i] >= 0 && dfa->marks[outs[i]] != dfa->mark) {
+                dfa->marks[outs[i]] = dfa->mark;
+                dfa->stack[top++] = outs[i];
+            }
+        }
+    }
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Ends the group of a leftmost state that starts at dfa->list[group],
+// sorting it so that equal groups compare equal. Returns whether the group
+// accepts; an empty group is left out.
+static bool dfa_end_group(Dfa *dfa, int group, int *count) {
+    if (*count == group) return false;
+    qsort(&dfa->list[group], *count - group, sizeof(int), compare_ints);
+    bool accepting = false;
+    for (int i = group; i < *count; i++) {
+        if (dfa->nfa->states[dfa->list[i]].type == NFA_MATCH) accepting = true;
+    }
+    dfa->list[(*count)++] = DFA_GROUP_END;
+    return accepting;
+}
+
+// Returns the DFA state for the NFA states in dfa->list, creating it when
+// it is new. Returns -1 for the empty set and -2 when out of memory.
+static int dfa_state_for(Dfa *dfa, int count) {
+    if (count == 0) return -1;
+    // A leftmost state's list is ordered by group and sorted within them.
+    if (!dfa->leftmost) qsort(dfa->list, count, sizeof(int), compare_ints);
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < count; i++) hash = (hash ^ (unsigned int)dfa->list[i]) * 16777619u;
+
+    int slot = hash % dfa->table_cap;
+    while (dfa->table[slot]) {
+        DfaState *state = dfa->states[dfa->table[slot] - 1];
+        if (state->hash == hash && state->count == count &&
+            memcmp(state->nfa_states, dfa->list, count * sizeof(int)) == 0) {
+            return dfa->table[slot] - 1;
+        }
+        slot = (slot + 1) % dfa->table_cap;
+    }
+
+    if (dfa->num_states == DFA_MAX_STATES) {
+        dfa_flush(dfa);
+        slot = hash % dfa->table_cap;
+    }
+    DfaState *state = malloc(sizeof(DfaState));
+    int *nfa_states = malloc(count * sizeof(int));
+    if (state == NULL || nfa_states == NULL) {
+        free(state);
+        free(nfa_states);
+        return -2;
+    }
+    memcpy(nfa_states, dfa->list, count * sizeof(int));
+    state->nfa_states = nfa_states;
+    state->count = count;
+    state->hash = hash;
+    state->accepting = false;
+    for (int i = 0; i < count; i++) {
+        if (nfa_states[i] >= 0 && dfa->nfa->states[nfa_states[i]].type == NFA_MATCH) state->accepting = true;
+    }
+    for (int i = 0; i < 256; i++) state->next[i] = -2;
+
+    dfa->states[dfa->num_states] = state;
+    dfa->table[slot] = dfa->num_states + 1;
+    return dfa->num_states++;
+}
+
+static int dfa_start(Dfa *dfa) {
+    if (dfa->start < 0) {
+        int count = 0;
+        dfa->mark++;
+        dfa_closure(dfa, dfa->nfa->start, &count);
+        if (dfa->leftmost) {
+            dfa_end_group(dfa, 0, &count);
+            dfa->list[count++] = DFA_RESTART;
+        }
+        dfa->start = dfa_state_for(dfa, count);
+    }
+    return dfa->start;
+}
+
+// Steps a leftmost state's groups, earliest start first. A thread that
+// reaches an NFA state an earlier group already holds is dropped, as it
+// can only match where that group does. Once a group accepts, the groups
+// after it, and the restarts, could only give matches further right.
+static int dfa_leftmost_step(Dfa *dfa, const DfaState *state, unsigned char c) {
+    int count = 0;
+    int group = 0;
+    bool restart = false;
+    bool accepted = false;
+    for (int i = 0; i < state->count && !accepted; i++) {
+        int index = state->nfa_states[i];
+        if (index == DFA_RESTART) {
+            restart = true;
+        } else if (index == DFA_GROUP_END) {
+            accepted = dfa_end_group(dfa, group, &count);
+            group = count;
+        } else {
+            NfaState *s = &dfa->nfa->states[index];
+            if (s->type == NFA_SET && set_has(dfa->nodes[s->node].set, c)) dfa_closure(dfa, s->out, &count);
+        }
+    }
+    if (restart) {
+        dfa_closure(dfa, dfa->nfa->start, &count);
+        dfa_end_group(dfa, group, &count);
+        dfa->list[count++] = DFA_RESTART;
+    }
+    return count;
+}
+
+// Builds the transition on byte `c` out of `from` the first time it is
+// taken.
+static int dfa_build_step(Dfa *dfa, int from, unsigned char c) {
+    DfaState *state = dfa->states[from];
+    int count = 0;
+    dfa->mark++;
+    if (dfa->leftmost) {
+        count = dfa_leftmost_step(dfa, state, c);
+    } else {
+        for (int i = 0; i < state->count; i++) {
+            NfaState *s = &dfa->nfa->states[state->nfa_states[i]];
+            if (s->type == NFA_SET && set_has(dfa->nodes[s->node].set, c)) dfa_closure(dfa, s->out, &count);
+        }
+        if (dfa->unanchored) dfa_closure(dfa, dfa->nfa->start, &count);
+    }
+
+    unsigned int flushes = dfa->flushes;
+    int next = dfa_state_for(dfa, count);
+    // A flush freed `from`; its edge is rebuilt on the next visit.
+    if (next != -2 && dfa->flushes == flushes) dfa->states[from]->next[c] = next;
+    return next;
+}
+
+// Follows byte `c` out of `from`. Returns -1 on the dead state, and -2 when
+// out of memory, which scans treat like the dead state.
+static inline int dfa_step(Dfa *dfa, int from, unsigned char c) {
+    int next = dfa->states[from]->next[c];
+    return next != -2 ? next : dfa_build_step(dfa, from, c);
+}
+
+static void regex_set_error(char *error, size_t error_size, const char *message) {
+    if (error && error_size > 0) snprintf(error, error_size, "%s", message);
+}
+
+// Compiles `pattern`. On failure returns NULL and describes the problem in
+// `error`.
+Regex *regex_compile(const char *pattern, size_t len, char *error, size_t error_size) {
+    Regex *re = calloc(1, sizeof(Regex));
+    if (re == NULL) {
+        regex_set_error(error, error_size, "out of memory");
+        return NULL;
+    }
+
+    const char *end = pattern + len;
+    if (len > 0 && pattern[0] == '^') {
+        re->anchored_start = true;
+        pattern++;
+    }
+    if (end > pattern && end[-1] == '$' && (end - 1 == pattern || end[-2] != '\\')) {
+        re->anchored_end = true;
+        end--;
+    }
+
+    RegexParser parser = {pattern, end, re, NULL, 0, false};
+    int root = parse_alternation(&parser);
+    if (root >= 0 && parser.p != parser.end) parser.error = "unmatched )";
+    if (root >= 0 && !parser.error && (re->anchored_start || re->anchored_end) && parser.top_level_alternation) {
+        parser.error = "put alternatives in ( ) to anchor them";
+    }
+    if (root < 0 || parser.error) {
+        regex_set_error(error, error_size, parser.error ? parser.error : "out of memory");
+        regex_free(re);
+        return NULL;
+    }
+
+    if (nfa_compile(&re->nfa_forward, re->nodes, root, false) == -1 ||
+        nfa_compile(&re->nfa_reverse, re->nodes, root, true) == -1 ||
+        dfa_init(&re->forward, &re->nfa_forward, re->nodes, false, false) == -1 ||
+        dfa_init(&re->reverse, &re->nfa_reverse, re->nodes, !re->anchored_end, false) == -1 ||
+        dfa_init(&re->leftmost, &re->nfa_forward, re->nodes, false, true) == -1 ||
+        dfa_init(&re->reverse_anchored, &re->nfa_reverse, re->nodes, false, false) == -1) {
+        regex_set_error(error, error_size, "out of memory");
+        regex_free(re);
+        return NULL;
+    }
+
+    // An empty match would pin find to the cursor.
+    int start = dfa_start(&re->forward);
+    if (start < 0 || re->forward.states[start]->accepting) {
+        regex_set_error(error, error_size, start < 0 ? "out of memory" : "pattern matches empty text");
+        regex_free(re);
+        return NULL;
+    }
+    return re;
+}
+
+void regex_free(Regex *re) {
+    if (re == NULL) return;
+    dfa_free(&re->forward);
+    dfa_free(&re->reverse);
+    dfa_free(&re->leftmost);
+    dfa_free(&re->reverse_anchored);
+    free(re->nfa_forward.states);
+    free(re->nfa_reverse.states);
+    free(re->nodes);
+    free(re);
+}
+
+// Returns where the longest match starting at `start` ends, or -1.
+static ssize_t regex_longest(Regex *re, const char *text, size_t len, size_t start) {
+    int state = dfa_start(&re->forward);
+    ssize_t end = -1;
+    for (size_t i = start; i < len && state >= 0; i++) {
+        state = dfa_step(&re->forward, state, (unsigned char)text[i]);
+        if (state >= 0 && re->forward.states[state]->accepting && (!re->anchored_end || i + 1 == len)) {
+            end = (ssize_t)i + 1;
+        }
+    }
+    return end;
+}
+
+// Finds the leftmost-longest match starting at or after `col` without
+// looking at the text beyond where that match, or the threads that could
+// still beat it, end.
+static bool regex_search_forward(Regex *re, const char *text, size_t len, size_t col, size_t *match_start, size_t *match_len) {
+    int state = dfa_start(&re->leftmost);
+    ssize_t end = -1;
+    for (size_t i = col; i < len && state >= 0; i++) {
+        state = dfa_step(&re->leftmost, state, (unsigned char)text[i]);
+        if (state >= 0 && re->leftmost.states[state]->accepting) end = (ssize_t)i + 1;
+    }
+    if (end < 0) return false;
+
+    // No match starts before the leftmost one, so the furthest start of a
+    // match ending at `end` is its start.
+    ssize_t start = -1;
+    state = dfa_start(&re->reverse_anchored);
+    for (size_t p = (size_t)end; p > col && state >= 0; p--) {
+        state = dfa_step(&re->reverse_anchored, state, (unsigned char)text[p - 1]);
+        if (state >= 0 && re->reverse_anchored.states[state]->accepting) start = (ssize_t)p - 1;
+    }
+    if (start < 0) return false;
+    *match_start = (size_t)start;
+    *match_len = (size_t)(end - start);
+    return true;
+}
+
+// Finds the leftmost-longest match starting at or after `col` (direction
+// 1), or the rightmost one starting at or before it (direction -1).
+bool regex_search(Regex *re, const char *text, size_t len, size_t col, int direction, size_t *match_start, size_t *match_len) {
+    if (direction == 1 && !re->anchored_start && !re->anchored_end) {
+        return regex_search_forward(re, text, len, col, match_start, match_len);
+    }
+    ssize_t start = -1;
+
+    if (re->anchored_start) {
+        if (direction == 1 && col > 0) return false;
+        start = 0;
+    } else {
+        // Scan leftward from the end; the reversed DFA accepts after
+        // reading text[p] exactly when a match starts at p.
+        size_t lo = direction == 1 ? col : 0;
+        int state = dfa_start(&re->reverse);
+        for (size_t p = len; p > lo && state >= 0; p--) {
+            state = dfa_step(&re->reverse, state, (unsigned char)text[p - 1]);
+            if (state >= 0 && re->reverse.states[state]->accepting) {
+                start = (ssize_t)p - 1;
+                if (direction == -1 && (size_t)start <= col) break;
+            }
+        }
+        if (start < 0 || (direction == -1 && (size_t)start > col)) return false;
+    }
+
+    ssize_t end = regex_longest(re, text, len, (size_t)start);
+    if (end < 0) return false;
+    *match_start = (size_t)start;
+    *match_len = (size_t)(end - start);
+    return true;
+}
@@ -0,0 +1,355 @@
+#include"common.h"
+
+// Replace and replace-all. Matches are collected first, then every line
+// they touch is rebuilt once, so replacing a hundred thousand occurrences
+// costs one pass over those lines rather than a delete and an insert per
+// character. The whole batch goes into the journal as a single
+// UNDO_REPLACE op whose text packs, for each match, a ReplaceEntry
+// followed by the bytes it replaced; undoing it is the same rebuild in
+// reverse.
+
+typedef struct {
+    int row;
+    int col;
+    // Bytes removed at (row, col), and the text put there instead.
+    size_t len;
+    const char *text;
+    size_t text_len;
+} ReplaceSplice;
+
+// Journal layout of one replaced match. col is where the replacement
+// starts in the new text.
+typedef struct {
+    int row;
+    int col;
+    int new_len;
+    int old_len;
+} ReplaceEntry;
+
+typedef struct {
+    int row;
+    int col;
+    int len;
+} ReplaceMatch;
+
+typedef struct {
+    ReplaceMatch *items;
+    int count;
+    int cap;
+} ReplaceMatches;
+
+void editor_replace();
+void editor_undo_replace(const UndoOp *op);
+
+// Rebuilds every line the splices touch, each exactly once. Splices must
+// be sorted by position and must not overlap. With `journal` set, the old
+// text is packed into it for editor_undo_replace(); the caller frees it.
+static int replace_apply(const ReplaceSplice *splices, int count, char **journal, size_t *journal_len) {
+    size_t packed_len = 0;
+    if (journal) {
+        for (int i = 0; i < count; i++) packed_len += sizeof(ReplaceEntry) + splices[i].len;
+        *journal = malloc(packed_len ? packed_len : 1);
+        *journal_len = packed_len;
+        if (*journal == NULL) {
+            editor_set_status_message("Replace error: Out of memory for undo journal.");
+            return -1;
+        }
+    }
+
+    size_t packed = 0;
+    int dirty_start = -1, dirty_end = -1;
+    for (int first = 0; first < count; ) {
+        int row = splices[first].row;
+        int last = first;
+        while (last < count && splices[last].row == row) last++;
+
+        EditorLine *line = buffer_line(row);
+        size_t new_len = line->len;
+        for (int i = first; i < last; i++) new_len += splices[i].text_len - splices[i].len;
+
+        char *text = malloc(new_len + 1);
+        if (text == NULL) {
+            // Lines already rebuilt stay so, and are journalled, so undo
+            // still brings them back.
+            if (journal) *journal_len = packed;
+            editor_set_status_message("Replace error: Out of memory for line %d.", row + 1);
+            if (dirty_start != -1) editor_invalidate_syntax(dirty_start, dirty_end);
+            return -1;
+        }
+
+        size_t from = 0, to = 0;
+        for (int i = first; i < last; i++) {
+            const ReplaceSplice *splice = &splices[i];
+            size_t keep = (size_t)splice->col - from;
+            memcpy(text + to, line->text + from, keep);
+            to += keep;
+            if (journal) {
+                ReplaceEntry entry = {row, (int)to, (int)splice->text_len, (int)splice->len};
+                memcpy(*journal + packed, &entry, sizeof(entry));
+                memcpy(*journal + packed + sizeof(entry), line->text + splice->col, splice->len);
+                packed += sizeof(entry) + splice->len;
+            }
+            memcpy(text + to, splice->text, splice->text_len);
+            to += splice->text_len;
+            from = (size_t)splice->col + splice->len;
+        }
+        memcpy(text + to, line->text + from, line->len - from);
+        text[new_len] = '\0';
+
+        if (!line->mapped) free(line->text);
+        line->text = text;
+        line->len = new_len;
+        line->mapped = false;
+        buffer_line_changed(line);
+
+        // Touched lines are re-highlighted in runs, not one range each.
+        if (row != dirty_end) {
+            if (dirty_start != -1) editor_invalidate_syntax(dirty_start, dirty_end);
+            dirty_start = row;
+        }
+        dirty_end = row + 1;
+        first = last;
+    }
+    if (dirty_start != -1) editor_invalidate_syntax(dirty_start, dirty_end);
+    E.dirty = 1;
+    return 0;
+}
+
+static int replace_matches_push(ReplaceMatches *matches, int row, int col, int len) {
+    if (matches->count == matches->cap) {
+        int new_cap = matches->cap ? matches->cap * 2 : 256;
+        ReplaceMatch *new_items = realloc(matches->items, new_cap * sizeof(ReplaceMatch));
+        if (new_items == NULL) return -1;
+        matches->items = new_items;
+        matches->cap = new_cap;
+    }
+    matches->items[matches->count].row = row;
+    matches->items[matches->count].col = col;
+    matches->items[matches->count].len = len;
+    matches->count++;
+    return 0;
+}
+
+// Collects the non-overlapping matches that start between (row, col) and
+// (end_row, end_col). search_buffer() skips the lines without a match;
+// each line that has one is then walked match by match.
+static int replace_collect(SearchPattern *pattern, int row, int col, int end_row, int end_col, ReplaceMatches *matches) {
+    while (row <= end_row && row < E.num_lines) {
+        size_t budget = SIZE_MAX;
+        int limit = end_row + 1 < E.num_lines ? end_row + 1 : E.num_lines;
+        if (!search_buffer(pattern, 1, &row, &col, limit, &budget)) break;
+
+        EditorLine *line = buffer_line(row);
+        size_t match_start, match_len;
+        while (search_pattern_match(pattern, line->text, line->len, (size_t)col, 1, &match_start, &match_len)) {
+            if (row == end_row && (int)match_start >= end_col) return 0;
+            if (replace_matches_push(matches, row, (int)match_start, (int)match_len) == -1) {
+                editor_set_status_message("Replace error: Out of memory for matches.");
+                return -1;
+            }
+            col = (int)(match_start + match_len);
+        }
+        row++;
+        col = 0;
+    }
+    return 0;
+}
+
+// Replaces the collected matches as one batch and journals it. Returns
+// how many were replaced, or -1.
+static int replace_matches_apply(ReplaceMatches *matches, const char *replacement) {
+    if (matches->count == 0) return 0;
+
+    ReplaceSplice *splices = malloc(matches->count * sizeof(ReplaceSplice));
+    if (splices == NULL) {
+        editor_set_status_message("Replace error: Out of memory for matches.");
+        return -1;
+    }
+    size_t replacement_len = strlen(replacement);
+    int count = 0;
+    for (int i = 0; i < matches->count; i++) {
+        ReplaceMatch *match = &matches->items[i];
+        // The two stretches of a wrapped search can meet inside a match.
+        if (count > 0 && splices[count - 1].row == match->row &&
+            (size_t)splices[count - 1].col + splices[count - 1].len > (size_t)match->col) {
+            continue;
+        }
+        splices[count].row = match->row;
+        splices[count].col = match->col;
+        splices[count].len = (size_t)match->len;
+        splices[count].text = replacement;
+        splices[count].text_len = replacement_len;
+        count++;
+    }
+
+    char *journal = NULL;
+    size_t journal_len = 0;
+    int result = replace_apply(splices, count, &journal, &journal_len);
+    if (journal) {
+        editor_undo_record(UNDO_REPLACE, splices[0].row, splices[0].col, journal, journal_len);
+    }
+    free(journal);
+    free(splices);
+    return result == -1 ? -1 : count;
+}
+
+// Puts back what an UNDO_REPLACE op replaced.
+void editor_undo_replace(const UndoOp *op) {
+    int count = 0;
+    for (size_t offset = 0; offset < op->len; count++) {
+        ReplaceEntry entry;
+        memcpy(&entry, op->text + offset, sizeof(entry));
+        offset += sizeof(entry) + (size_t)entry.old_len;
+    }
+
+    ReplaceSplice *splices = malloc((count ? count : 1) * sizeof(ReplaceSplice));
+    if (splices == NULL) {
+        editor_set_status_message("Undo error: Out of memory for replaced text.");
+        return;
+    }
+    size_t offset = 0;
+    for (int i = 0; i < count; i++) {
+        ReplaceEntry entry;
+        memcpy(&entry, op->text + offset, sizeof(entry));
+        splices[i].row = entry.row;
+        splices[i].col = entry.col;
+        splices[i].len = (size_t)entry.new_len;
+        splices[i].text = op->text + offset + sizeof(entry);
+        splices[i].text_len = (size_t)entry.old_len;
+        offset += sizeof(entry) + (size_t)entry.old_len;
+    }
+    replace_apply(splices, count, NULL, NULL);
+    free(splices);
+}
+
+// Finds the next match at or after (*row, *col), wrapping around once.
+// Stops at the origin after the wrap.
+static bool replace_find(SearchPattern *pattern, int *row, int *col, bool *wrapped, int origin_row, int origin_col,
+                         size_t *match_len) {
+    while (1) {
+        int r = *row, c = *col;
+        size_t budget = SIZE_MAX;
+        int limit = *wrapped ? (origin_row + 1 < E.num_lines ? origin_row + 1 : E.num_lines) : E.num_lines;
+        if (search_buffer(pattern, 1, &r, &c, limit, &budget)) {
+            if (*wrapped && (r > origin_row || (r == origin_row && c >= origin_col))) return false;
+            EditorLine *line = buffer_line(r);
+            size_t match_start;
+            search_pattern_match(pattern, line->text, line->len, (size_t)c, 1, &match_start, match_len);
+            *row = r;
+            *col = c;
+            return true;
+        }
+        if (*wrapped) return false;
+        *wrapped = true;
+        *row = 0;
+        *col = 0;
+    }
+}
+
+static void replace_finish(int replaced) {
+    E.find_active = false;
+    E.last_match_row = -1;
+    E.last_match_col = -1;
+    job_cancel(JOB_SEARCH);
+    match_index_stop();
+    if (E.cy >= E.num_lines) E.cy = E.num_lines > 0 ? E.num_lines - 1 : 0;
+    EditorLine *line = buffer_line(E.cy);
+    if (line && E.cx > (int)line->len) E.cx = (int)line->len;
+    editor_set_status_message("Replaced %d occurrence%s.", replaced, replaced == 1 ? "" : "s");
+}
+
+// Asks for a query, unless find already has one, and its replacement,
+// then steps through the matches from the cursor: y replaces one, n skips
+// it, a replaces it and all the rest in one batch. Everything replaced in
+// one session is undone together.
+void editor_replace() {
+    char *query;
+    if (E.find_active && E.search_query) {
+        query = strdup(E.search_query);
+    } else {
+        query = editor_prompt("Replace (/regex/, ESC to cancel): ", NULL);
+        if (query && query[0] == '\0') {
+            free(query);
+            query = NULL;
+        }
+    }
+    if (query == NULL) return;
+
+    SearchPattern pattern;
+    char error[128];
+    if (search_pattern_init(&pattern, query, error, sizeof(error)) == -1) {
+        editor_set_status_message("Regex error: %s", error);
+        free(query);
+        return;
+    }
+
+    char prompt[256];
+    snprintf(prompt, sizeof(prompt), "Replace '%s' with (ESC to cancel): ", query);
+    char *replacement = editor_prompt(prompt, NULL);
+    if (replacement == NULL) {
+        search_pattern_free(&pattern);
+        free(query);
+        return;
+    }
+
+    // Matches are counted to the real end of the file.
+    editor_wait_for_indexer();
+    job_cancel(JOB_SEARCH);
+    match_index_stop();
+    editor_undo_begin();
+
+    free(E.search_query);
+    E.search_query = query;
+    int replacement_len = (int)strlen(replacement);
+    int origin_row = E.cy, origin_col = E.cx;
+    int row = E.cy, col = E.cx;
+    bool wrapped = false;
+    int replaced = 0;
+    size_t match_len;
+
+    while (replace_find(&pattern, &row, &col, &wrapped, origin_row, origin_col, &match_len)) {
+        E.cy = row;
+        E.cx = col;
+        E.last_match_row = row;
+        E.last_match_col = col;
+        E.find_active = true;
+        editor_set_status_message("Replace with '%s'? (y)es (n)o (a)ll (q)uit", replacement);
+        editor_refresh_screen();
+
+        int c = editor_read_key();
+        if (c == 'y' || c == 'Y') {
+            ReplaceMatches one = {0};
+            if (replace_matches_push(&one, row, col, (int)match_len) == -1 ||
+                replace_matches_apply(&one, replacement) <= 0) {
+                free(one.items);
+                break;
+            }
+            free(one.items);
+            replaced++;
+            // The origin moves with text replaced before it on its line.
+            if (wrapped && row == origin_row && col < origin_col) origin_col += replacement_len - (int)match_len;
+            col += replacement_len;
+        } else if (c == 'n' || c == 'N') {
+            col += (int)match_len;
+        } else if (c == 'a' || c == 'A' || c == '!') {
+            ReplaceMatches matches = {0};
+            // Before the wrap the rest is the stretch after the cursor plus
+            // the one before the origin; collected in buffer order.
+            int collected = wrapped ? 0 : replace_collect(&pattern, 0, 0, origin_row, origin_col, &matches);
+            if (collected == 0) {
+                collected = wrapped ? replace_collect(&pattern, row, col, origin_row, origin_col, &matches)
+                                    : replace_collect(&pattern, row, col, E.num_lines - 1, INT_MAX, &matches);
+            }
+            int applied = collected == 0 ? replace_matches_apply(&matches, replacement) : -1;
+            if (applied > 0) replaced += applied;
+            free(matches.items);
+            break;
+        } else {
+            break;
+        }
+    }
+
+    search_pattern_free(&pattern);
+    free(replacement);
+    replace_finish(replaced);
+}
@@ -0,0 +1,314 @@
+#include"common.h"
+
+#ifdef __linux__
+#include<sys/syscall.h>
+#endif
+
+// Walks a directory tree for operations that need every file under it:
+// find in files, and anything else that indexes the whole tree.
+// Directories are read in raw getdents64() batches and entry types are
+// taken from d_type, so the only stat() calls are fstatat()s for entries
+// the filesystem leaves as DT_UNKNOWN.
+//
+// Directories still to read sit in one deque per worker. A worker pushes
+// the subdirectories it finds onto the back of its own deque and pops from
+// there too, so it keeps working depth-first near what it just read; a
+// worker whose deque is empty steals from the front of another's, which
+// hands it the oldest and usually largest piece of work.
+//
+// Workers are whatever threads call scan_tree_step() with their index:
+// find in files uses its job slots, and scan_tree_run() starts threads of
+// its own.
+//
+// A scan that skips ignored files reads each directory's ignore files
+// before its entries, and never queues a directory they leave out.
+
+#define SCAN_BATCH_BYTES (64 * 1024)
+
+typedef struct {
+    char *path;
+    // Rules for the directory's parent's entries, or NULL for the root or
+    // when not skipping ignored files.
+    IgnoreDir *ignore;
+} ScanDir;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    ScanDir *dirs;
+    int head;
+    int tail;
+    int cap;
+    // The owning worker's getdents64() buffer.
+    char *batch;
+} ScanDeque;
+
+struct ScanTree {
+    ScanDeque *deques;
+    int num_workers;
+    // Directories queued or being read. The scan is over once it is 0.
+    int pending;
+    bool stopped;
+    bool skip_ignored;
+    void (*visit)(const char *path, size_t path_len, void *data);
+    void *data;
+};
+
+#ifdef __linux__
+struct scan_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+ScanTree *scan_tree_start(const char *root, int num_workers, bool skip_ignored, void (*visit)(const char *path, size_t path_len, void *data), void *data);
+int scan_tree_step(ScanTree *scan, int worker);
+void scan_tree_stop(ScanTree *scan);
+void scan_tree_free(ScanTree *scan);
+int scan_tree_run(const char *root, int num_threads, bool skip_ignored, void (*visit)(const char *path, size_t path_len, void *data), void *data);
+
+// Called with the deque's mutex held.
+static int scan_deque_push(ScanDeque *deque, ScanDir dir) {
+    if (deque->tail == deque->cap) {
+        if (deque->head > 0) {
+            memmove(deque->dirs, deque->dirs + deque->head, (deque->tail - deque->head) * sizeof(ScanDir));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        if (deque->tail == deque->cap) {
+            int new_cap = deque->cap ? deque->cap * 2 : 64;
+            ScanDir *new_dirs = realloc(deque->dirs, new_cap * sizeof(ScanDir));
+            if (new_dirs == NULL) return -1;
+            deque->dirs = new_dirs;
+            deque->cap = new_cap;
+        }
+    }
+    deque->dirs[deque->tail++] = dir;
+    return 0;
+}
+
+// Queues `path` on the worker's deque, taking over it and a reference to
+// `ignore`.
+static void scan_push(ScanTree *scan, int worker, char *path, IgnoreDir *ignore) {
+    ScanDeque *deque = &scan->deques[worker];
+    __atomic_add_fetch(&scan->pending, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&deque->mutex);
+    int result = scan_deque_push(deque, (ScanDir){path, ignore});
+    pthread_mutex_unlock(&deque->mutex);
+    if (result == -1) {
+        free(path);
+        ignore_dir_release(ignore);
+        __atomic_sub_fetch(&scan->pending, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+// Takes the newest directory from the worker's own deque, or else the
+// oldest from someone else's.
+static bool scan_take(ScanTree *scan, int worker, ScanDir *dir) {
+    bool found = false;
+    ScanDeque *own = &scan->deques[worker];
+    pthread_mutex_lock(&own->mutex);
+    if (own->tail > own->head) {
+        *dir = own->dirs[--own->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&own->mutex);
+
+    for (int i = 1; !found && i < scan->num_workers; i++) {
+        ScanDeque *victim = &scan->deques[(worker + i) % scan->num_workers];
+        pthread_mutex_lock(&victim->mutex);
+        if (victim->tail > victim->head) {
+            *dir = victim->dirs[victim->head++];
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->mutex);
+    }
+    return found;
+}
+
+// Hands one entry of `dir_path` to the visitor, or queues it if it is a
+// directory, unless `ignore` leaves it out. Returns false once the scan has
+// been stopped.
+static bool scan_entry(ScanTree *scan, int worker, int dir_fd, const char *dir_path, size_t dir_len,
+                       IgnoreDir *ignore, const char *name, unsigned char type) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) return true;
+
+    if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) return true;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+    }
+    if (type != DT_DIR && type != DT_REG && type != DT_LNK) return true;
+
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path == NULL) return true;
+    memcpy(path, dir_path, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+
+    if (ignore && ignore_match(ignore, path, dir_len + 1 + name_len, name, type == DT_DIR)) {
+        free(path);
+    } else if (type == DT_DIR) {
+        scan_push(scan, worker, path, ignore_dir_retain(ignore));
+    } else {
+        scan->visit(path, dir_len + 1 + name_len, scan->data);
+        free(path);
+    }
+    return !__atomic_load_n(&scan->stopped, __ATOMIC_RELAXED);
+}
+
+static void scan_directory(ScanTree *scan, int worker, const char *path, IgnoreDir *parent_ignore) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return;
+    size_t path_len = strlen(path);
+    IgnoreDir *ignore = scan->skip_ignored ? ignore_dir_open(parent_ignore, fd, path_len) : NULL;
+
+#ifdef __linux__
+    ScanDeque *own = &scan->deques[worker];
+    if (own->batch == NULL) own->batch = malloc(SCAN_BATCH_BYTES);
+    char *batch = own->batch;
+    if (batch != NULL) {
+        long n;
+        while ((n = syscall(SYS_getdents64, fd, batch, SCAN_BATCH_BYTES)) > 0) {
+            for (long offset = 0; offset < n; ) {
+                struct scan_dirent64 *entry = (struct scan_dirent64 *)(batch + offset);
+                offset += entry->d_reclen;
+                if (!scan_entry(scan, worker, fd, path, path_len, ignore, entry->d_name, entry->d_type)) {
+                    close(fd);
+                    ignore_dir_release(ignore);
+                    return;
+                }
+            }
+        }
+        close(fd);
+        ignore_dir_release(ignore);
+        return;
+    }
+#endif
+
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        ignore_dir_release(ignore);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!scan_entry(scan, worker, fd, path, path_len, ignore, entry->d_name, entry->d_type)) break;
+    }
+    closedir(dir);
+    ignore_dir_release(ignore);
+}
+
+// Sets up a scan of `root` for `num_workers` workers. `visit` gets every
+// file and symlink below it, on whichever worker found it, but for those
+// ignore files leave out when `skip_ignored` is set.
+ScanTree *scan_tree_start(const char *root, int num_workers, bool skip_ignored, void (*visit)(const char *path, size_t path_len, void *data), void *data) {
+    ScanTree *scan = calloc(1, sizeof(ScanTree));
+    if (scan == NULL) return NULL;
+    if (num_workers < 1) num_workers = 1;
+    scan->deques = calloc(num_workers, sizeof(ScanDeque));
+    char *root_path = strdup(root);
+    if (scan->deques == NULL || root_path == NULL) {
+        free(root_path);
+        free(scan->deques);
+        free(scan);
+        return NULL;
+    }
+    for (int i = 0; i < num_workers; i++) pthread_mutex_init(&scan->deques[i].mutex, NULL);
+    scan->num_workers = num_workers;
+    scan->skip_ignored = skip_ignored;
+    scan->visit = visit;
+    scan->data = data;
+    // A trailing slash would double up in every path built from the root.
+    size_t root_len = strlen(root_path);
+    while (root_len > 1 && root_path[root_len - 1] == '/') root_path[--root_len] = '\0';
+    scan_push(scan, 0, root_path, NULL);
+    return scan;
+}
+
+// Reads one directory on behalf of `worker`. Returns 1 when it did, 0 when
+// there is nothing to take right now but other workers are still reading,
+// and -1 once the scan is over or stopped.
+int scan_tree_step(ScanTree *scan, int worker) {
+    if (__atomic_load_n(&scan->stopped, __ATOMIC_RELAXED)) return -1;
+    ScanDir dir;
+    if (!scan_take(scan, worker, &dir)) return __atomic_load_n(&scan->pending, __ATOMIC_ACQUIRE) == 0 ? -1 : 0;
+
+    scan_directory(scan, worker, dir.path, dir.ignore);
+    free(dir.path);
+    ignore_dir_release(dir.ignore);
+    __atomic_sub_fetch(&scan->pending, 1, __ATOMIC_ACQ_REL);
+    return 1;
+}
+
+// Makes every worker's next step return -1; directories already queued
+// are dropped.
+void scan_tree_stop(ScanTree *scan) {
+    __atomic_store_n(&scan->stopped, true, __ATOMIC_RELAXED);
+}
+
+// Called once no worker is inside scan_tree_step() any more.
+void scan_tree_free(ScanTree *scan) {
+    if (scan == NULL) return;
+    for (int i = 0; i < scan->num_workers; i++) {
+        ScanDeque *deque = &scan->deques[i];
+        for (int j = deque->head; j < deque->tail; j++) {
+            free(deque->dirs[j].path);
+            ignore_dir_release(deque->dirs[j].ignore);
+        }
+        free(deque->dirs);
+        free(deque->batch);
+        pthread_mutex_destroy(&deque->mutex);
+    }
+    free(scan->deques);
+    free(scan);
+}
+
+typedef struct {
+    ScanTree *scan;
+    int worker;
+    pthread_t id;
+    bool started;
+} ScanThread;
+
+static void *scan_thread(void *arg) {
+    ScanThread *thread = arg;
+    int result;
+    while ((result = scan_tree_step(thread->scan, thread->worker)) != -1) {
+        // Someone else holds the last directories; wait for them to spill.
+        if (result == 0) sched_yield();
+    }
+    return NULL;
+}
+
+// Scans `root` to the end on `num_threads` threads, the caller's included,
+// and returns once every file has been visited.
+int scan_tree_run(const char *root, int num_threads, bool skip_ignored, void (*visit)(const char *path, size_t path_len, void *data), void *data) {
+    if (num_threads < 1) num_threads = 1;
+    ScanTree *scan = scan_tree_start(root, num_threads, skip_ignored, visit, data);
+    ScanThread *threads = calloc(num_threads, sizeof(ScanThread));
+    if (scan == NULL || threads == NULL) {
+        scan_tree_free(scan);
+        free(threads);
+        return -1;
+    }
+
+    // A worker whose thread could not start just has its deque stolen from.
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].scan = scan;
+        threads[i].worker = i;
+        if (i > 0) threads[i].started = pthread_create(&threads[i].id, NULL, scan_thread, &threads[i]) == 0;
+    }
+    scan_thread(&threads[0]);
+    for (int i = 1; i < num_threads; i++) {
+        if (threads[i].started) pthread_join(threads[i].id, NULL);
+    }
+
+    scan_tree_free(scan);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,307 @@
+#include"common.h"
+
+#if defined(__x86_64__)
+#include<immintrin.h>
+#define SEARCH_X86 1
+#endif
+
+// Substring search for find, match highlighting and grep. Candidates are
+// filtered a vector at a time by comparing the needle's first and last
+// bytes against two overlapping loads of the haystack; only positions where
+// both agree get a memcmp of the middle. SSE2 is the x86-64 baseline, AVX2
+// is picked at run time when the CPU has it, and other targets use a
+// memchr/memmem fallback. A query written as /pattern/ is a regular
+// expression instead and goes through regex.c a line at a time.
+
+const char *search_forward(const char *hay, size_t hay_len, const char *needle, size_t needle_len);
+const char *search_backward(const char *hay, size_t hay_len, const char *needle, size_t needle_len);
+int search_pattern_init(SearchPattern *pattern, const char *query, char *error, size_t error_size);
+void search_pattern_free(SearchPattern *pattern);
+bool search_pattern_match(SearchPattern *pattern, const char *text, size_t len, size_t col, int direction, size_t *match_start, size_t *match_len);
+bool search_buffer(SearchPattern *pattern, int direction, int *row, int *col, int limit, size_t *budget);
+
+static bool search_middle_matches(const char *candidate, const char *needle, size_t needle_len) {
+    return needle_len <= 2 || memcmp(candidate + 1, needle + 1, needle_len - 2) == 0;
+}
+
+static const char *search_forward_scalar(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    return memmem(hay, hay_len, needle, needle_len);
+}
+
+// memrchr() is a GNU extension, so the backward fallback is a plain loop.
+static const char *search_backward_scalar(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    for (size_t pos = hay_len - needle_len + 1; pos > 0; pos--) {
+        const char *candidate = hay + pos - 1;
+        if (*candidate == needle[0] && memcmp(candidate, needle, needle_len) == 0) return candidate;
+    }
+    return NULL;
+}
+
+#ifdef SEARCH_X86
+
+static const char *search_forward_sse2(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len + 15 <= hay_len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + needle_len - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                            _mm_cmpeq_epi8(block_last, last)));
+        while (mask) {
+            const char *candidate = hay + i + __builtin_ctz(mask);
+            if (search_middle_matches(candidate, needle, needle_len)) return candidate;
+            mask &= mask - 1;
+        }
+    }
+    return search_forward_scalar(hay + i, hay_len - i, needle, needle_len);
+}
+
+static const char *search_backward_sse2(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    // `end` is one past the last candidate position still to check.
+    size_t end = hay_len - needle_len + 1;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    for (; end >= 16; end -= 16) {
+        size_t i = end - 16;
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + needle_len - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                            _mm_cmpeq_epi8(block_last, last)));
+        while (mask) {
+            int bit = 31 - __builtin_clz(mask);
+            const char *candidate = hay + i + bit;
+            if (search_middle_matches(candidate, needle, needle_len)) return candidate;
+            mask &= ~(1u << bit);
+        }
+    }
+    return search_backward_scalar(hay, end + needle_len - 1, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+static const char *search_forward_avx2(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len + 31 <= hay_len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(hay + i + needle_len - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                                                _mm256_cmpeq_epi8(block_last, last)));
+        while (mask) {
+            const char *candidate = hay + i + __builtin_ctz(mask);
+            if (search_middle_matches(candidate, needle, needle_len)) return candidate;
+            mask &= mask - 1;
+        }
+    }
+    return search_forward_sse2(hay + i, hay_len - i, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+static const char *search_backward_avx2(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    size_t end = hay_len - needle_len + 1;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    for (; end >= 32; end -= 32) {
+        size_t i = end - 32;
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(hay + i + needle_len - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                                                _mm256_cmpeq_epi8(block_last, last)));
+        while (mask) {
+            int bit = 31 - __builtin_clz(mask);
+            const char *candidate = hay + i + bit;
+            if (search_middle_matches(candidate, needle, needle_len)) return candidate;
+            mask &= ~(1u << bit);
+        }
+    }
+    return search_backward_sse2(hay, end + needle_len - 1, needle, needle_len);
+}
+
+#endif
+
+// Returns the first occurrence of the needle in the haystack, or NULL.
+const char *search_forward(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    if (needle_len == 0) return hay;
+    if (needle_len > hay_len) return NULL;
+    if (needle_len == 1) return memchr(hay, needle[0], hay_len);
+#ifdef SEARCH_X86
+    if (__builtin_cpu_supports("avx2")) return search_forward_avx2(hay, hay_len, needle, needle_len);
+    return search_forward_sse2(hay, hay_len, needle, needle_len);
+#else
+    return search_forward_scalar(hay, hay_len, needle, needle_len);
+#endif
+}
+
+// Returns the last occurrence of the needle in the haystack, or NULL.
+const char *search_backward(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    if (needle_len == 0) return hay + hay_len;
+    if (needle_len > hay_len) return NULL;
+#ifdef SEARCH_X86
+    if (__builtin_cpu_supports("avx2")) return search_backward_avx2(hay, hay_len, needle, needle_len);
+    return search_backward_sse2(hay, hay_len, needle, needle_len);
+#else
+    return search_backward_scalar(hay, hay_len, needle, needle_len);
+#endif
+}
+
+// Prepares `query` for matching. The pattern borrows the query's text, so
+// the query must outlive it. Returns -1 with a message in `error` when a
+// regular expression does not compile.
+int search_pattern_init(SearchPattern *pattern, const char *query, char *error, size_t error_size) {
+    size_t len = strlen(query);
+    pattern->needle = query;
+    pattern->needle_len = len;
+    pattern->regex = NULL;
+    if (len > 2 && query[0] == '/' && query[len - 1] == '/') {
+        pattern->regex = regex_compile(query + 1, len - 2, error, error_size);
+        if (pattern->regex == NULL) return -1;
+    }
+    return 0;
+}
+
+void search_pattern_free(SearchPattern *pattern) {
+    regex_free(pattern->regex);
+    pattern->regex = NULL;
+}
+
+// Matches the pattern within one line: the first match starting at or
+// after `col` (direction 1), or the last one starting at or before it.
+bool search_pattern_match(SearchPattern *pattern, const char *text, size_t len, size_t col, int direction, size_t *match_start, size_t *match_len) {
+    if (pattern->regex) return regex_search(pattern->regex, text, len, col, direction, match_start, match_len);
+
+    const char *match;
+    if (direction == 1) {
+        if (col > len) return false;
+        match = search_forward(text + col, len - col, pattern->needle, pattern->needle_len);
+    } else {
+        size_t end = col >= len ? len : col + pattern->needle_len;
+        if (end > len) end = len;
+        match = search_backward(text, end, pattern->needle, pattern->needle_len);
+    }
+    if (match == NULL) return false;
+    *match_start = match - text;
+    *match_len = pattern->needle_len;
+    return true;
+}
+
+// search_buffer() starts with a span of the first line alone, then one of
+// this many bytes, doubling after each span without a match. Dense matches
+// are found without walking far ahead; sparse ones still get big runs.
+#define SEARCH_MIN_SPAN 256
+
+// Two lines are adjacent in the file mapping when only the line break
+// ("\n" or "\r\n") lies between them, so they can be searched as one span.
+static bool search_lines_adjacent(EditorLine *line, EditorLine *next) {
+    if (!line->mapped || !next->mapped) return false;
+    const char *end = line->text + line->len;
+    return next->text > end && next->text <= end + 2;
+}
+
+// Finds the row in [first, last] holding `match`, checking that the whole
+// match lies inside it; one spanning a line break is not a match.
+static int search_locate(int first, int last, const char *match, size_t needle_len) {
+    for (int row = first; row <= last; row++) {
+        EditorLine *line = buffer_line(row);
+        if (match >= line->text && match < line->text + line->len) {
+            return match + needle_len <= line->text + line->len ? row : -1;
+        }
+        if (match < line->text) return -1;
+    }
+    return -1;
+}
+
+// Looks for the pattern from (*row, *col) towards `limit`, an exclusive
+// row bound: rows *row .. limit-1 going forward (direction 1) from matches
+// starting at *col, or *row .. limit+1 going backward from matches starting
+// at or before *col. Runs of lines that lie back to back in the file
+// mapping are searched as one span instead of line by line; regular
+// expressions always go line by line. Returns true with (*row, *col) on the
+// match. Otherwise *row is `limit`, or the row to resume from once `budget`
+// bytes have been scanned. Called with the buffer lock held.
+bool search_buffer(SearchPattern *pattern, int direction, int *row, int *col, int limit, size_t *budget) {
+    const char *needle = pattern->needle;
+    size_t needle_len = pattern->needle_len;
+    int r = *row;
+    int c = *col;
+    size_t span_len_total;
+    size_t span_cap = 0;
+    while (direction == 1 ? r < limit : r > limit) {
+        if (*budget == 0) break;
+
+        EditorLine *line = buffer_line(r);
+        if (pattern->regex) {
+            size_t match_start, match_len;
+            if (c >= 0 && search_pattern_match(pattern, line->text, line->len, (size_t)c, direction, &match_start, &match_len)) {
+                *row = r;
+                *col = (int)match_start;
+                return true;
+            }
+            *budget = line->len + 1 >= *budget ? 0 : *budget - line->len - 1;
+            r += direction;
+            c = direction == 1 ? 0 : INT_MAX;
+            continue;
+        }
+
+        const char *span;
+        int first = r, last = r;
+        if (span_cap > *budget) span_cap = *budget;
+
+        if (direction == 1) {
+            size_t start = c < 0 ? 0 : (size_t)c;
+            if (start > line->len) start = line->len;
+            span = line->text + start;
+            const char *span_end = line->text + line->len;
+            while (last + 1 < limit && (size_t)(span_end - span) < span_cap) {
+                EditorLine *next = buffer_line(last + 1);
+                if (!search_lines_adjacent(buffer_line(last), next)) break;
+                last++;
+                span_end = next->text + next->len;
+            }
+            span_len_total = span_end - span;
+        } else {
+            size_t end = c < 0 ? 0 : (size_t)c + needle_len;
+            if (end > line->len) end = line->len;
+            const char *span_end = line->text + end;
+            span = line->text;
+            while (first - 1 > limit && (size_t)(span_end - span) < span_cap) {
+                EditorLine *prev = buffer_line(first - 1);
+                if (!search_lines_adjacent(prev, buffer_line(first))) break;
+                first--;
+                span = prev->text;
+            }
+            span_len_total = span_end - span;
+        }
+
+        size_t span_len = span_len_total;
+        while (span_len >= needle_len) {
+            const char *match = direction == 1 ? search_forward(span, span_len, needle, needle_len)
+                                               : search_backward(span, span_len, needle, needle_len);
+            if (match == NULL) break;
+            int match_row = search_locate(first, last, match, needle_len);
+            if (match_row != -1) {
+                *row = match_row;
+                *col = (int)(match - buffer_line(match_row)->text);
+                return true;
+            }
+            // The candidate straddles a line break; look past it.
+            if (direction == 1) {
+                span_len -= match + 1 - span;
+                span = match + 1;
+            } else {
+                span_len = match + needle_len - 1 - span;
+            }
+        }
+
+        // Count the line breaks too, so runs of empty lines use up budget.
+        size_t scanned = span_len_total + (last - first) + 1;
+        *budget = scanned >= *budget ? 0 : *budget - scanned;
+        span_cap = span_cap ? span_cap * 2 : SEARCH_MIN_SPAN;
+        r = direction == 1 ? last + 1 : first - 1;
+        c = direction == 1 ? 0 : INT_MAX;
+    }
+    if (direction == 1 ? r >= limit : r <= limit) r = limit;
+    *row = r;
+    *col = c;
+    return false;
+}
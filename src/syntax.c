@@ -23,6 +23,7 @@ EditorSyntax C_syntax = {
     "//",
     "/*",
     "*/",
+    NULL,
 };
 // this ones for shell scripts (bash)
 char *SH_HL_extensions[] = { ".sh", NULL };
@@ -40,6 +41,7 @@ EditorSyntax SH_syntax = {
     "#",
     NULL,
     NULL,
+    NULL,
 };
 // this is for java iskript
 char *JS_HL_extensions[] = { ".js", NULL };
@@ -58,6 +60,7 @@ EditorSyntax JS_syntax = {
     "//",
     "/*",
     "*/",
+    NULL,
 };
 // now we have html
 char *HTML_HL_extensions[] = { ".html", ".htm", NULL };
@@ -75,6 +78,7 @@ EditorSyntax HTML_syntax = {
     NULL,
     "<!--",
     "-->",
+    NULL,
 };
 // this is for cascading stylesheets
 char *CSS_HL_extensions[] = { ".css", NULL };
@@ -93,6 +97,7 @@ EditorSyntax CSS_syntax = {
     NULL,
     "/*",
     "*/",
+    NULL,
 };
 // thsi is for html
 char *XML_HL_extensions[] = { ".xml", NULL };
@@ -108,6 +113,7 @@ EditorSyntax XML_syntax = {
     NULL,
     "<!--",
     "-->",
+    NULL,
 };
 
 EditorSyntax *EditorSyntaxes[] = {
@@ -121,19 +127,49 @@ EditorSyntax *EditorSyntaxes[] = {
 };
 
 void editor_select_syntax_highlight();
-void editor_update_syntax(int filerow);
+int editor_highlight_line(EditorLine *line, int in_state);
+void editor_schedule_highlight();
+
+// Lines may be views into a file mapping without a terminating NUL, so every
+// lookahead is bounded by the line length.
+static int line_matches_at(EditorLine *line, size_t i, const char *s, size_t slen) {
+    return i + slen <= line->len && memcmp(&line->text[i], s, slen) == 0;
+}
+
+static char *user_syntax_none[] = { NULL };
+// Stands in for a grammar loaded from ~/.nimki/syntax/ while it is selected.
+static EditorSyntax user_syntax = {
+    user_syntax_none,
+    user_syntax_none,
+    user_syntax_none,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+};
 
 void editor_select_syntax_highlight() {
     E_syntax = NULL;
+    editor_reset_syntax(false);
 
     if (E.filename) {
         char *ext = strrchr(E.filename, '.');
 
         if (ext) {
+            Grammar *grammar = grammar_find(ext);
+            if (grammar) {
+                user_syntax.grammar = grammar;
+                E_syntax = &user_syntax;
+                return;
+            }
+
             for (int i = 0; EditorSyntaxes[i]; i++) {
                 EditorSyntax *syntax = EditorSyntaxes[i];
                 for (int j = 0; syntax->filetype_extensions[j]; j++) {
                     if (strcmp(ext, syntax->filetype_extensions[j]) == 0) {
+                        if (syntax->grammar == NULL) {
+                            syntax->grammar = grammar_from_syntax(syntax);
+                        }
                         E_syntax = syntax;
                         return;
                     }
@@ -143,145 +179,400 @@ void editor_select_syntax_highlight() {
     }
 }
 
-void editor_update_syntax(int filerow) {
-    if (filerow < 0 || filerow >= E.num_lines) return;
+// Runs built by the scanner for the line being highlighted, copied into
+// the line's own HlRuns once it is done.
+static HlRun *scan_runs = NULL;
+static int scan_num_runs = 0;
+static int scan_runs_cap = 0;
+static bool scan_runs_failed = false;
 
-    EditorLine *line = &E.lines[filerow];
+// One static HlRuns per class for lines painted in it from end to end, such
+// as every line inside a block comment. HL_NORMAL's has no runs at all.
+static HlRun hl_whole_runs[HL_SELECTION + 1];
+static HlRuns hl_whole[HL_SELECTION + 1];
 
-    if (line->hl) {
-        free(line->hl);
-        line->hl = NULL;
+// Appends a run, extending the previous one when it is adjacent and of the
+// same class, so a number or a comment's opener and body become one run.
+static void hl_emit(size_t start, size_t len, int hl) {
+    if (len == 0 || start + len > UINT_MAX) return;
+
+    if (scan_num_runs > 0) {
+        HlRun *last = &scan_runs[scan_num_runs - 1];
+        if (last->hl == hl && last->start + last->len == start) {
+            last->len += len;
+            return;
+        }
     }
-    line->hl = malloc(line->len);
-    if (line->hl == NULL) { return; }
-    memset(line->hl, HL_NORMAL, line->len);
+    if (scan_num_runs == scan_runs_cap) {
+        int new_cap = scan_runs_cap ? scan_runs_cap * 2 : 32;
+        HlRun *new_runs = realloc(scan_runs, new_cap * sizeof(HlRun));
+        if (new_runs == NULL) {
+            scan_runs_failed = true;
+            return;
+        }
+        scan_runs = new_runs;
+        scan_runs_cap = new_cap;
+    }
+    scan_runs[scan_num_runs].start = start;
+    scan_runs[scan_num_runs].len = len;
+    scan_runs[scan_num_runs].hl = hl;
+    scan_num_runs++;
+}
 
-    if (E_syntax == NULL) return;
+// Turns the scanned runs into the line's HlRuns, sharing the static one
+// when a single class covers the whole line.
+static HlRuns *hl_commit(EditorLine *line) {
+    int whole = -1;
+    if (scan_num_runs == 0) {
+        whole = HL_NORMAL;
+    } else if (scan_num_runs == 1 && scan_runs[0].start == 0 && scan_runs[0].len == line->len) {
+        whole = scan_runs[0].hl;
+    }
+    if (whole >= 0) {
+        HlRuns *shared = &hl_whole[whole];
+        if (!shared->shared) {
+            shared->shared = true;
+            if (whole != HL_NORMAL) {
+                hl_whole_runs[whole].start = 0;
+                hl_whole_runs[whole].len = UINT_MAX;
+                hl_whole_runs[whole].hl = whole;
+                shared->runs = &hl_whole_runs[whole];
+                shared->num_runs = 1;
+            }
+        }
+        return shared;
+    }
 
-    char **keywords1 = E_syntax->keywords1;
-    char **keywords2 = E_syntax->keywords2;
-    char *sc_start = E_syntax->singleline_comment_start;
-    char *mc_start = E_syntax->multiline_comment_start;
-    char *mc_end = E_syntax->multiline_comment_end;
+    HlRuns *hl = malloc(sizeof(HlRuns) + scan_num_runs * sizeof(HlRun));
+    if (hl == NULL) return NULL;
+    hl->num_runs = scan_num_runs;
+    hl->shared = false;
+    hl->runs = (HlRun *)(hl + 1);
+    memcpy(hl->runs, scan_runs, scan_num_runs * sizeof(HlRun));
+    return hl;
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_multiline_comment = (filerow > 0 && E.lines[filerow - 1].hl_open_comment);
+void editor_free_hl(HlRuns *hl) {
+    if (hl && !hl->shared) free(hl);
+}
 
+// The scanner state carried across lines: 0 is plain code, otherwise the
+// low byte is the open region's index + 1 and the rest its nesting depth.
+#define STATE_REGION(state) (((state) & 0xff) - 1)
+#define STATE_DEPTH(state) ((state) >> 8)
+#define STATE_MAKE(region, depth) (((region) + 1) | ((depth) << 8))
+
+// The one scanner behind every language. It walks the line through the
+// grammar's per-byte action tables, so bytes that can't start anything cost
+// a single lookup, and emits highlight runs when `paint` is set. Returns the
+// state the line ends in.
+static int editor_scan_line(Grammar *grammar, EditorLine *line, int state, bool paint) {
+    const char *text = line->text;
+    size_t len = line->len;
     size_t i = 0;
-    while (i < line->len) {
-        char c = line->text[i];
-        unsigned char prev_hl = (i > 0) ? line->hl[i-1] : HL_NORMAL;
-
-        if (mc_start && mc_end) {
-            if (in_multiline_comment) {
-                line->hl[i] = HL_COMMENT;
-                if (strncmp(&line->text[i], mc_end, strlen(mc_end)) == 0) {
-                    for (size_t j = 0; j < strlen(mc_end); j++) line->hl[i+j] = HL_COMMENT;
-                    i += strlen(mc_end);
-                    in_multiline_comment = 0;
-                    prev_sep = 1;
-                    continue;
+    int prev_sep = 1;
+    int prev_hl = HL_NORMAL;
+
+    while (i < len) {
+        if (state) {
+            int r = STATE_REGION(state);
+            int depth = STATE_DEPTH(state);
+            GrammarRegion *region = &grammar->regions[r];
+            const unsigned char *action = grammar->region_action[r];
+            size_t start = i;
+
+            while (i < len) {
+                unsigned char act = action[(unsigned char)text[i]];
+                if (act == 0) {
+                    i++;
+                } else if ((act & GRAMMAR_ESCAPE) && (unsigned char)text[i] == region->escape && i + 1 < len) {
+                    i += 2;
+                } else if ((act & GRAMMAR_CLOSE) && line_matches_at(line, i, region->close, region->close_len)) {
+                    i += region->close_len;
+                    if (--depth == 0) break;
+                } else if ((act & GRAMMAR_NEST) && line_matches_at(line, i, region->open, region->open_len)) {
+                    i += region->open_len;
+                    depth++;
+                } else {
+                    i++;
                 }
-                i++;
-                continue;
-            } else if (strncmp(&line->text[i], mc_start, strlen(mc_start)) == 0) {
-                for (size_t j = 0; j < strlen(mc_start); j++) line->hl[i+j] = HL_COMMENT;
-                    i += strlen(mc_start);
-                in_multiline_comment = 1;
-                continue;
             }
+            if (paint) hl_emit(start, i - start, region->hl);
+            if (depth > 0) {
+                state = STATE_MAKE(r, depth);
+                break;
+            }
+            state = 0;
+            prev_sep = region->hl == HL_COMMENT;
+            prev_hl = region->hl;
+            continue;
         }
 
-        if (sc_start && strncmp(&line->text[i], sc_start, strlen(sc_start)) == 0) {
-            for (size_t j = i; j < line->len; j++) {
-                line->hl[j] = HL_COMMENT;
+        unsigned char c = text[i];
+        unsigned char act = grammar->code_action[c];
+
+        if (act & GRAMMAR_OPEN) {
+            for (int k = grammar->open_first[c] - 1; k < grammar->num_regions; k++) {
+                int r = grammar->open_order[k];
+                GrammarRegion *region = &grammar->regions[r];
+                if ((unsigned char)region->open[0] != c) break;
+                if (line_matches_at(line, i, region->open, region->open_len)) {
+                    if (paint) hl_emit(i, region->open_len, region->hl);
+                    i += region->open_len;
+                    state = STATE_MAKE(r, 1);
+                    break;
+                }
             }
+            if (state) continue;
+        }
+
+        if ((act & GRAMMAR_LINE_COMMENT) && line_matches_at(line, i, grammar->line_comment, grammar->line_comment_len)) {
+            if (paint) hl_emit(i, len - i, HL_COMMENT);
             break;
         }
 
-        if (in_string) {
-            line->hl[i] = HL_STRING;
-            if (c == '\\' && i + 1 < line->len) {
-                line->hl[i+1] = HL_STRING;
-                i += 2;
-                continue;
-            }
-            if (c == in_string) {
-                in_string = 0;
-            }
-            i++;
+        if ((act & GRAMMAR_PREPROC) && i == 0) {
+            if (paint) hl_emit(0, len, HL_PREPROC);
+            break;
+        }
+
+        if ((act & GRAMMAR_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) {
+            if (paint) hl_emit(i, 1, HL_NUMBER);
+            prev_hl = HL_NUMBER;
             prev_sep = 0;
+            i++;
             continue;
-        } else {
-            if (c == '"' || c == '\'') {
-                in_string = c;
-                line->hl[i] = HL_STRING;
-                i++;
+        }
+
+        if (prev_sep) {
+            const GrammarKeyword *keyword = grammar_match_keyword(grammar, text, len, i);
+            if (keyword) {
+                if (paint) hl_emit(i, keyword->len, keyword->hl);
+                prev_hl = keyword->hl;
                 prev_sep = 0;
+                i += keyword->len;
                 continue;
             }
         }
 
-        if (isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) {
-            line->hl[i] = HL_NUMBER;
-            i++;
-            prev_sep = 0;
-            continue;
-        }
+        prev_sep = (act & GRAMMAR_SEPARATOR) != 0;
+        prev_hl = HL_NORMAL;
+        i++;
+    }
 
-        if (i == 0 && c == '#') {
-            for (size_t j = 0; j < line->len; j++) {
-                line->hl[j] = HL_PREPROC;
-            }
-            break;
+    // Only multi-line regions carry over to the next line.
+    if (state && !(grammar->regions[STATE_REGION(state)].flags & REGION_MULTILINE)) state = 0;
+    return state;
+}
+
+// Highlights a single line starting in the given scanner state and stores
+// the state it ends in. It looks at nothing but `line` and E_syntax.
+// Returns the new hl_open_comment.
+int editor_highlight_line(EditorLine *line, int in_state) {
+    editor_free_hl(line->hl);
+    line->hl = NULL;
+
+    scan_num_runs = 0;
+    scan_runs_failed = false;
+    if (E_syntax == NULL || E_syntax->grammar == NULL) {
+        line->hl_open_comment = 0;
+    } else {
+        line->hl_open_comment = editor_scan_line(E_syntax->grammar, line, in_state, true);
+    }
+    // Left NULL on failure so the line is highlighted again when next drawn.
+    if (!scan_runs_failed) line->hl = hl_commit(line);
+    line->hl_version = buffer_next_version();
+    return line->hl_open_comment;
+}
+
+// Computes only the state a line ends in, without building its runs.
+// Used to carry state across lines that are not on screen, and by the
+// indexer to record every line's state while the file is still loading.
+int editor_syntax_line_state(EditorLine *line, int in_state) {
+    if (E_syntax == NULL || E_syntax->grammar == NULL) return 0;
+    return editor_scan_line(E_syntax->grammar, line, in_state, false);
+}
+
+// Highlighting is computed lazily, only for rows about to be drawn.
+// E.hl_frontier is the first line whose comment state is not known to be
+// current; everything above it is, and any hl runs it has are valid.
+// E.hl_dirty is a sorted list of disjoint [start, end) ranges at or past the
+// frontier whose state must be recomputed. Every other line past the
+// frontier was lexed against the state its predecessor has cached, so each
+// line's hl_open_comment acts as a checkpoint: a walk only lexes dirty lines
+// and whatever a changed state spills into, and jumps over the rest.
+
+static void editor_dirty_merge() {
+    int out = 0;
+    for (int i = 0; i < E.hl_dirty_count; i++) {
+        if (E.hl_dirty[i].start >= E.hl_dirty[i].end) continue;
+        if (out > 0 && E.hl_dirty[i].start <= E.hl_dirty[out - 1].end) {
+            if (E.hl_dirty[i].end > E.hl_dirty[out - 1].end) E.hl_dirty[out - 1].end = E.hl_dirty[i].end;
+        } else {
+            E.hl_dirty[out++] = E.hl_dirty[i];
         }
+    }
+    E.hl_dirty_count = out;
+}
 
-        if (prev_sep) {
-            for (size_t k = 0; keywords1[k]; k++) {
-                size_t kwlen = strlen(keywords1[k]);
-                if (strncmp(&line->text[i], keywords1[k], kwlen) == 0 &&
-                    is_separator(line->text[i + kwlen])) {
-                    for (size_t j = 0; j < kwlen; j++) line->hl[i+j] = HL_KEYWORD1;
-                    i += kwlen;
-                    prev_sep = 0;
-                    goto next_char_in_loop;
-                }
-            }
-            for (size_t k = 0; keywords2[k]; k++) {
-                size_t kwlen = strlen(keywords2[k]);
-                if (strncmp(&line->text[i], keywords2[k], kwlen) == 0 &&
-                    is_separator(line->text[i + kwlen])) {
-                    for (size_t j = 0; j < kwlen; j++) line->hl[i+j] = HL_KEYWORD2;
-                    i += kwlen;
-                    prev_sep = 0;
-                    goto next_char_in_loop;
-                }
-            }
+static void editor_dirty_add(int start, int end) {
+    if (start >= end) return;
+
+    if (E.hl_dirty_count == E.hl_dirty_cap) {
+        int new_cap = E.hl_dirty_cap ? E.hl_dirty_cap * 2 : 16;
+        HlRange *new_ranges = realloc(E.hl_dirty, new_cap * sizeof(HlRange));
+        if (new_ranges == NULL) {
+            // Can't track the range precisely; treat everything after it as dirty.
+            E.hl_dirty_count = 0;
+            start = start < E.hl_frontier ? start : E.hl_frontier;
+            end = INT_MAX;
+            if (E.hl_dirty_cap == 0) return;
+        } else {
+            E.hl_dirty = new_ranges;
+            E.hl_dirty_cap = new_cap;
         }
+    }
 
-        prev_sep = is_separator(c);
-        i++;
-        next_char_in_loop:;
+    int i = E.hl_dirty_count;
+    while (i > 0 && E.hl_dirty[i - 1].start > start) {
+        E.hl_dirty[i] = E.hl_dirty[i - 1];
+        i--;
     }
+    E.hl_dirty[i].start = start;
+    E.hl_dirty[i].end = end;
+    E.hl_dirty_count++;
+    editor_dirty_merge();
+}
 
-    if (E.find_active && E.search_query && filerow >= E.row_offset && filerow < E.row_offset + E.screen_rows) {
-        char *match_ptr = line->text;
-        while ((match_ptr = strstr(match_ptr, E.search_query)) != NULL) {
-            int start_col = match_ptr - line->text;
-            for (size_t k = 0; k < strlen(E.search_query); k++) {
-                if ((size_t)start_col + k < line->len) {
-                    line->hl[start_col + k] = HL_MATCH;
-                }
-            }
-            match_ptr += strlen(E.search_query);
+// Forgets dirty lines above `row`; they have just been re-lexed.
+static void editor_dirty_consume(int row) {
+    int drop = 0;
+    while (drop < E.hl_dirty_count && E.hl_dirty[drop].end <= row) drop++;
+    if (drop > 0) {
+        memmove(&E.hl_dirty[0], &E.hl_dirty[drop], (E.hl_dirty_count - drop) * sizeof(HlRange));
+        E.hl_dirty_count -= drop;
+    }
+    if (E.hl_dirty_count > 0 && E.hl_dirty[0].start < row) E.hl_dirty[0].start = row;
+}
+
+void editor_invalidate_syntax(int start, int end) {
+    if (start < 0) start = 0;
+    editor_dirty_add(start, end);
+    if (start < E.hl_frontier) E.hl_frontier = start;
+}
+
+// Keeps the dirty ranges attached to the same text when lines are inserted
+// in front of them. The new lines are dirty, and so is the line after them,
+// which was lexed against a different predecessor.
+void editor_syntax_lines_inserted(int at, int count) {
+    for (int i = 0; i < E.hl_dirty_count; i++) {
+        if (E.hl_dirty[i].start >= at) E.hl_dirty[i].start += count;
+        if (E.hl_dirty[i].end > at && E.hl_dirty[i].end != INT_MAX) E.hl_dirty[i].end += count;
+    }
+    editor_invalidate_syntax(at, at + count + 1);
+}
+
+// Shifts the dirty ranges up over deleted lines. The line that now follows
+// the gap has a new predecessor, so it is marked dirty too.
+void editor_syntax_lines_deleted(int at, int count) {
+    for (int i = 0; i < E.hl_dirty_count; i++) {
+        HlRange *range = &E.hl_dirty[i];
+        if (range->start > at) range->start = range->start - count > at ? range->start - count : at;
+        if (range->end > at && range->end != INT_MAX) range->end = range->end - count > at ? range->end - count : at;
+    }
+    editor_dirty_merge();
+    if (E.hl_frontier > E.num_lines) E.hl_frontier = E.num_lines;
+    editor_invalidate_syntax(at, at + 1);
+}
+
+// Drops every cached highlight, e.g. after the filetype changed. When the
+// loader has already recorded each line's comment state, only the frontier
+// is reset and the hl runs are rebuilt as rows are drawn.
+void editor_reset_syntax(bool states_known) {
+    E.hl_dirty_count = 0;
+    E.hl_frontier = 0;
+    if (!states_known) editor_dirty_add(0, INT_MAX);
+}
+
+// Brings the comment state of every line above `limit` up to date. The walk
+// is iterative, skips clean lines wholesale, and stops propagating a change
+// as soon as a re-lexed line ends in the state it had cached. Re-lexed lines
+// drop their hl runs so they are rebuilt against the new state when drawn.
+static void editor_syntax_advance(int limit) {
+    if (limit > E.num_lines) limit = E.num_lines;
+
+    int row = E.hl_frontier;
+    bool prev_changed = false;
+    while (row < limit) {
+        editor_dirty_consume(row);
+        bool dirty = E.hl_dirty_count > 0 && E.hl_dirty[0].start <= row;
+        if (!dirty && !prev_changed) {
+            int next_dirty = E.hl_dirty_count > 0 ? E.hl_dirty[0].start : INT_MAX;
+            row = next_dirty < limit ? next_dirty : limit;
+            continue;
         }
+
+        EditorLine *line = buffer_line(row);
+        int in = row > 0 ? buffer_line(row - 1)->hl_open_comment : 0;
+        int out = editor_syntax_line_state(line, in);
+        prev_changed = out != line->hl_open_comment;
+        line->hl_open_comment = out;
+        editor_free_hl(line->hl);
+        line->hl = NULL;
+        row++;
+    }
+
+    if (row > E.hl_frontier) E.hl_frontier = row;
+    editor_dirty_consume(E.hl_frontier);
+    // The next line was lexed against a state that just changed.
+    if (prev_changed && E.hl_frontier < E.num_lines) {
+        editor_dirty_add(E.hl_frontier, E.hl_frontier + 1);
+    }
+}
+
+// Lines the highlight job brings up to date per hold of the buffer lock.
+#define HIGHLIGHT_JOB_LINES 1024
+
+static bool highlight_job_pending = false;
+
+// Walks the frontier to the end of the buffer in chunks, so a jump far
+// down after an edit that opened a comment finds the states already known.
+static void highlight_job_run(Job *job) {
+    buffer_lock();
+    while (!job_cancelled(job) && E.hl_frontier < E.num_lines) {
+        editor_syntax_advance(E.hl_frontier + HIGHLIGHT_JOB_LINES);
+        buffer_yield();
     }
+    buffer_unlock();
+}
+
+static void highlight_job_finish(Job *job, bool cancelled) {
+    (void)job;
+    highlight_job_pending = false;
+    // Edits made after the walk passed them are picked up by the next job.
+    if (!cancelled) editor_schedule_highlight();
+}
+
+// Starts a highlight job if the frontier is short of the end and none is
+// running. Cheap enough to call once per pass of the main loop.
+void editor_schedule_highlight() {
+    if (highlight_job_pending || E.hl_frontier >= E.num_lines) return;
+    if (E_syntax == NULL || E_syntax->grammar == NULL) return;
+    highlight_job_pending = true;
+    if (job_submit(JOB_HIGHLIGHT, highlight_job_run, highlight_job_finish, NULL) == -1) {
+        highlight_job_pending = false;
+    }
+}
 
-    int changed_comment_state = (line->hl_open_comment != in_multiline_comment);
-    line->hl_open_comment = in_multiline_comment;
+// Returns `filerow` with its highlight up to date, building it if needed.
+EditorLine *editor_syntax_line(int filerow) {
+    EditorLine *line = buffer_line(filerow);
+    if (line == NULL) return NULL;
 
-    if (changed_comment_state && filerow + 1 < E.num_lines) {
-        editor_update_syntax(filerow + 1);
+    if (filerow >= E.hl_frontier) editor_syntax_advance(filerow + 1);
+    if (line->hl == NULL) {
+        int in = filerow > 0 ? buffer_line(filerow - 1)->hl_open_comment : 0;
+        editor_highlight_line(line, in);
     }
+    return line;
 }
@@ -10,15 +10,74 @@ void editor_draw_rows();
 void editor_draw_status_bar();
 void editor_draw_message_bar();
 void editor_draw_clock();
+int editor_next_timer_ms();
 void editor_draw_context_menu();
 void editor_refresh_screen();
 void editor_scroll();
 
+// One screen row of text, assembled with its attributes and written to
+// curses in a single call.
+static chtype *row_cells = NULL;
+static int row_cells_cap = 0;
+
+// What a text row on screen was last drawn from. A row is only redrawn when
+// this changes; line versions are never reused, so they stand in for the
+// line's text and highlight.
+typedef struct {
+    int filerow;
+    unsigned int text_version;
+    unsigned int hl_version;
+    int col_offset;
+    int x_offset;
+    int line_num_width;
+    int screen_cols;
+    EditorSyntax *syntax;
+} RowFingerprint;
+
+static RowFingerprint *drawn_rows = NULL;
+static int drawn_rows_cap = 0;
+static int drawn_screen_rows = -1;
+// The search query whose matches are painted, so a new one repaints all,
+// and its compiled pattern; drawn_pattern_ok is false when it did not
+// compile.
+static char *drawn_query = NULL;
+static SearchPattern drawn_pattern;
+static bool drawn_pattern_ok = false;
+
+// Forgets what is on screen so the next frame redraws every row.
+void editor_invalidate_screen() {
+    drawn_screen_rows = -1;
+}
+
 void editor_draw_rows() {
     if (E.file_tree_visible) {
         draw_file_tree();
     }
 
+    const char *query = NULL;
+    if (E.find_active && E.search_query && E.search_query[0] && has_colors()) {
+        query = E.search_query;
+    }
+    if ((query == NULL) != (drawn_query == NULL) || (query && strcmp(query, drawn_query) != 0)) {
+        if (drawn_pattern_ok) search_pattern_free(&drawn_pattern);
+        free(drawn_query);
+        drawn_query = query ? strdup(query) : NULL;
+        drawn_pattern_ok = drawn_query && search_pattern_init(&drawn_pattern, drawn_query, NULL, 0) == 0;
+        editor_invalidate_screen();
+    }
+
+    if (E.screen_rows > drawn_rows_cap) {
+        RowFingerprint *new_rows = realloc(drawn_rows, E.screen_rows * sizeof(RowFingerprint));
+        if (new_rows == NULL) return;
+        drawn_rows = new_rows;
+        drawn_rows_cap = E.screen_rows;
+    }
+    if (drawn_screen_rows != E.screen_rows) {
+        memset(drawn_rows, 0xff, E.screen_rows * sizeof(RowFingerprint));
+        drawn_screen_rows = E.screen_rows;
+    }
+    E.rows_repainted = 0;
+
     int x_offset = E.file_tree_visible ? FILE_TREE_WIDTH : 0;
     int y;
     int line_num_width = 0;
@@ -32,29 +91,32 @@ void editor_draw_rows() {
 
     for (y = 0; y < E.screen_rows; y++) {
         int filerow = y + E.row_offset;
+        EditorLine *line = filerow < E.num_lines ? editor_syntax_line(filerow) : NULL;
+
+        RowFingerprint print;
+        memset(&print, 0, sizeof(print));
+        print.filerow = line ? filerow : -1;
+        print.text_version = line ? line->text_version : 0;
+        print.hl_version = line ? line->hl_version : 0;
+        print.col_offset = E.col_offset;
+        print.x_offset = x_offset;
+        print.line_num_width = line_num_width;
+        print.screen_cols = E.screen_cols;
+        print.syntax = E_syntax;
+        if (memcmp(&print, &drawn_rows[y], sizeof(print)) == 0) continue;
+        memcpy(&drawn_rows[y], &print, sizeof(print));
+        E.rows_repainted++;
 
         move(y, x_offset);
         clrtoeol();
 
-        if (filerow >= E.num_lines) {
-        } else {
-            EditorLine *line = &E.lines[filerow];
-            int current_color_pair = HL_NORMAL;
+        if (line) {
             int display_col = 0;
 
-            int sel_min_cy = E.selection_start_cy;
-            int sel_min_cx = E.selection_start_cx;
-            int sel_max_cy = E.selection_end_cy;
-            int sel_max_cx = E.selection_end_cx;
-
-            if (sel_min_cy > sel_max_cy || (sel_min_cy == sel_max_cy && sel_min_cx > sel_max_cx)) {
-                int temp_cy = sel_min_cy;
-                int temp_cx = sel_min_cx;
-                sel_min_cy = sel_max_cy;
-                sel_min_cx = sel_max_cx;
-                sel_max_cy = temp_cy;
-                sel_max_cx = temp_cx;
-            }
+            // Search matches are painted over the cached highlight here
+            // rather than stored in it, so leaving find costs nothing.
+            bool matching = drawn_pattern_ok;
+            size_t match_start = 0, match_end = 0;
 
             if (E.show_line_numbers) {
                 attron(COLOR_PAIR(HL_COMMENT));
@@ -63,68 +125,114 @@ void editor_draw_rows() {
             }
 
             int text_cols = E.screen_cols - x_offset - line_num_width;
-
-            for (int i = 0; i < (int)line->len; i++) {
-                int char_display_width = 1;
-                if (line->text[i] == '\t') {
-                    char_display_width = TAB_STOP - (display_col % TAB_STOP);
-                }
-
-                if (display_col < E.col_offset) {
-                    display_col += char_display_width;
-                    continue;
+            if (text_cols <= 0) continue;
+            if (text_cols > row_cells_cap) {
+                chtype *new_cells = realloc(row_cells, text_cols * sizeof(chtype));
+                if (new_cells == NULL) continue;
+                row_cells = new_cells;
+                row_cells_cap = text_cols;
+            }
+            int num_cells = 0;
+
+            bool use_colors = (E_syntax || matching) && has_colors();
+            const HlRuns *runs = (E_syntax && line->hl) ? line->hl : NULL;
+            int run = 0;
+
+            // Fill the row a segment at a time, where a segment is a stretch
+            // of one class bounded by highlight runs and search matches, so
+            // its attribute is worked out once.
+            size_t i = 0;
+            while (i < line->len && num_cells < text_cols) {
+                int hl_type = HL_NORMAL;
+                size_t seg_end = line->len;
+
+                if (runs) {
+                    while (run < runs->num_runs && (size_t)runs->runs[run].start + runs->runs[run].len <= i) run++;
+                    if (run < runs->num_runs) {
+                        const HlRun *r = &runs->runs[run];
+                        if (r->start <= i) {
+                            hl_type = r->hl;
+                            seg_end = (size_t)r->start + r->len;
+                            if (seg_end > line->len) seg_end = line->len;
+                        } else {
+                            seg_end = r->start;
+                        }
+                    }
                 }
 
-                if ((display_col - E.col_offset) >= text_cols) break;
-
-                bool is_selected = false;
-
-                if (is_selected && has_colors()) {
-                    if (HL_SELECTION != current_color_pair) {
-                        attroff(COLOR_PAIR(current_color_pair));
-                        current_color_pair = HL_SELECTION;
-                        attron(COLOR_PAIR(current_color_pair));
+                if (matching && i >= match_end) {
+                    size_t match_len;
+                    if (search_pattern_match(&drawn_pattern, line->text, line->len, i, 1, &match_start, &match_len)) {
+                        match_end = match_start + match_len;
+                    } else {
+                        matching = false;
                     }
-                } else {
-                    if (E_syntax && has_colors()) {
-                        int hl_type = line->hl[i];
-                        if (hl_type != current_color_pair) {
-                            attroff(COLOR_PAIR(current_color_pair));
-                            current_color_pair = hl_type;
-                            attron(COLOR_PAIR(current_color_pair));
-                        }
+                }
+                if (matching) {
+                    if (i >= match_start) {
+                        hl_type = HL_MATCH;
+                        if (match_end < seg_end) seg_end = match_end;
+                    } else if (match_start < seg_end) {
+                        seg_end = match_start;
                     }
                 }
 
-                if (line->text[i] == '\t') {
-                    for (int k = 0; k < char_display_width; k++) {
-                        mvaddch(y, x_offset + (display_col - E.col_offset) + line_num_width + k, ' ');
+                chtype attr = use_colors ? COLOR_PAIR(hl_type) : A_NORMAL;
+                for (; i < seg_end && num_cells < text_cols; i++) {
+                    unsigned char c = line->text[i];
+                    if (c == '\t') {
+                        int tab_end = display_col + TAB_STOP - (display_col % TAB_STOP);
+                        // Only the part of a tab right of col_offset shows.
+                        if (display_col < E.col_offset) display_col = E.col_offset;
+                        while (display_col < tab_end && num_cells < text_cols) {
+                            row_cells[num_cells++] = ' ' | attr;
+                            display_col++;
+                        }
+                        display_col = tab_end;
+                        continue;
                     }
-                } else {
-                    mvaddch(y, x_offset + (display_col - E.col_offset) + line_num_width, line->text[i]);
+                    if (display_col++ < E.col_offset) continue;
+                    // Everything must be one cell wide for the batch to line
+                    // up, so bytes curses would spell out as ^X or M-x show
+                    // as '?'.
+                    if (c < 32 || c >= 127) c = '?';
+                    row_cells[num_cells++] = c | attr;
                 }
-                display_col += char_display_width;
             }
-            if (E_syntax && has_colors()) {
-                attroff(COLOR_PAIR(current_color_pair));
+
+            if (num_cells > 0) {
+                mvaddchnstr(y, x_offset + line_num_width, row_cells, num_cells);
             }
         }
     }
 }
 
 void editor_draw_status_bar() {
-    attron(A_REVERSE);
-
     int x_offset = E.file_tree_visible ? FILE_TREE_WIDTH : 0;
     int max_width = E.screen_cols - x_offset;
 
-    mvprintw(E.screen_rows, x_offset, "%.*s - %d lines %s",
+    move(E.screen_rows, x_offset);
+    clrtoeol();
+    attron(A_REVERSE);
+
+    char line_count[32];
+    if (E.indexing) {
+        snprintf(line_count, sizeof(line_count), "indexing...");
+    } else {
+        snprintf(line_count, sizeof(line_count), "%d lines", E.num_lines);
+    }
+    mvprintw(E.screen_rows, x_offset, "%.*s - %s %s%s",
              max_width - 15,
-             E.filename ? E.filename : "[No Name]", E.num_lines,
-             E.dirty ? "(modified)" : "");
+             E.filename ? E.filename : "[No Name]", line_count,
+             E.dirty ? "(modified)" : "",
+             E.map_data ? " [mmap]" : "");
 
     char rstatus[80];
-    snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.num_lines);
+    if (E.indexing) {
+        snprintf(rstatus, sizeof(rstatus), "%d/%d+", E.cy + 1, E.num_lines);
+    } else {
+        snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.num_lines);
+    }
     mvprintw(E.screen_rows, x_offset + max_width - strlen(rstatus), "%s", rstatus);
 
     attroff(A_REVERSE);
@@ -158,16 +266,51 @@ void editor_draw_clock() {
     }
 }
 
+// Milliseconds until the clock or the status message next changes on
+// screen, so the event loop can wake up and redraw without a key press.
+int editor_next_timer_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long now = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    long long next = ((long long)ts.tv_sec / 60 + 1) * 60 * 1000;
+    long long message_expiry = ((long long)status_message_time + 5) * 1000;
+    if (status_message[0] != '\0' && message_expiry > now - 20 && message_expiry < next) {
+        next = message_expiry;
+    }
+    // time() can trail CLOCK_REALTIME by a tick; wake a little late so the
+    // redraw sees the new second.
+    return (int)(next - now) + 20;
+}
+
 void editor_refresh_screen() {
+    static bool menu_drawn = false;
+    static bool grep_drawn = false;
+
     editor_scroll();
 
+    // The context menu is drawn over the text rows, so they have to be
+    // redrawn while it is open and once more after it closes.
+    if (E.context_menu_active || menu_drawn) editor_invalidate_screen();
+    menu_drawn = E.context_menu_active;
+    // Likewise for the find-in-files list.
+    if (E.grep_active || grep_drawn) editor_invalidate_screen();
+    grep_drawn = E.grep_active;
+
     editor_draw_rows();
     editor_draw_status_bar();
     editor_draw_message_bar();
     editor_draw_clock();
     editor_draw_context_menu();
 
-    move(E.cy - E.row_offset, get_cx_display() - E.col_offset);
+    // The result list leaves the cursor on its selected row.
+    if (E.grep_active) {
+        editor_draw_grep_results();
+    } else {
+        move(E.cy - E.row_offset, get_cx_display() - E.col_offset);
+    }
+    // The event loop sleeps in poll() rather than getch(), so nothing else
+    // flushes stdscr for us.
+    wnoutrefresh(stdscr);
     doupdate();
 }
 
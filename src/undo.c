@@ -0,0 +1,170 @@
+#include"common.h"
+
+extern EditorConfig E;
+
+void editor_undo_begin();
+void editor_undo_group_begin();
+void editor_undo_group_end();
+void editor_undo_record(int type, int row, int col, const char *text, size_t len);
+void editor_undo_mark_saved();
+void editor_undo_reset();
+void editor_undo();
+
+static void editor_free_undo_record(UndoRecord *record) {
+    for (int i = 0; i < record->num_ops; i++) {
+        free(record->ops[i].text);
+    }
+    free(record->ops);
+    record->ops = NULL;
+    record->num_ops = 0;
+    record->cx = 0;
+    record->cy = 0;
+}
+
+// Opens a new journal record for the edit that is about to happen. Ops
+// recorded afterwards are appended to it until the next call, so nested
+// edits (insert_char falling back to insert_newline) land in one record.
+void editor_undo_begin() {
+    // Still inside the group and its record is still the newest one.
+    if (E.undo_grouping && E.undo_group_idx == E.undo_history_idx) return;
+
+    if (E.undo_history_idx < E.undo_history_len) {
+        for (int i = E.undo_history_idx; i < E.undo_history_len; ++i) {
+            editor_free_undo_record(&E.undo_history[i]);
+        }
+        E.undo_history_len = E.undo_history_idx;
+        if (E.undo_saved_idx > E.undo_history_idx) E.undo_saved_idx = -1;
+    }
+
+    // An edit that never recorded anything can reuse its empty record.
+    if (E.undo_history_idx > 0 && E.undo_history[E.undo_history_idx - 1].num_ops == 0) {
+        UndoRecord *record = &E.undo_history[E.undo_history_idx - 1];
+        record->cx = E.cx;
+        record->cy = E.cy;
+        E.undo_group_idx = E.undo_history_idx;
+        return;
+    }
+
+    if (E.undo_history_len == MAX_UNDO_STATES) {
+        editor_free_undo_record(&E.undo_history[0]);
+        memmove(&E.undo_history[0], &E.undo_history[1], (MAX_UNDO_STATES - 1) * sizeof(UndoRecord));
+        E.undo_history[MAX_UNDO_STATES - 1].ops = NULL;
+        E.undo_history[MAX_UNDO_STATES - 1].num_ops = 0;
+        E.undo_history_len--;
+        E.undo_history_idx--;
+        if (E.undo_saved_idx >= 0) E.undo_saved_idx--;
+    }
+
+    UndoRecord *record = &E.undo_history[E.undo_history_idx];
+    record->ops = NULL;
+    record->num_ops = 0;
+    record->cx = E.cx;
+    record->cy = E.cy;
+
+    E.undo_history_len++;
+    E.undo_history_idx++;
+    E.undo_group_idx = E.undo_history_idx;
+}
+
+// Keys that arrive together, such as a paste typed out by the terminal,
+// are applied as one burst and undone as one record.
+void editor_undo_group_begin() {
+    E.undo_grouping = true;
+    E.undo_group_idx = -1;
+}
+
+void editor_undo_group_end() {
+    E.undo_grouping = false;
+}
+
+void editor_undo_record(int type, int row, int col, const char *text, size_t len) {
+    if (E.undo_history_idx <= 0 || len == 0) return;
+
+    UndoRecord *record = &E.undo_history[E.undo_history_idx - 1];
+    UndoOp *new_ops = realloc(record->ops, (record->num_ops + 1) * sizeof(UndoOp));
+    if (new_ops == NULL) {
+        editor_set_status_message("Undo error: Out of memory for journal entry.");
+        return;
+    }
+    record->ops = new_ops;
+
+    UndoOp *op = &record->ops[record->num_ops];
+    op->text = malloc(len);
+    if (op->text == NULL) {
+        editor_set_status_message("Undo error: Out of memory for journal text.");
+        return;
+    }
+    memcpy(op->text, text, len);
+    op->len = len;
+    op->type = type;
+    op->row = row;
+    op->col = col;
+    record->num_ops++;
+}
+
+void editor_undo_mark_saved() {
+    // Edits after the save start a record of their own, even within one
+    // burst of keys, so undo can stop at the saved state.
+    E.undo_group_idx = -1;
+    E.undo_saved_idx = E.undo_history_idx;
+    // An empty record on top will be reused by the next edit, so the saved
+    // state is the one before it.
+    if (E.undo_saved_idx > 0 && E.undo_history[E.undo_saved_idx - 1].num_ops == 0) {
+        E.undo_saved_idx--;
+    }
+}
+
+void editor_undo_reset() {
+    for (int i = 0; i < E.undo_history_len; ++i) {
+        editor_free_undo_record(&E.undo_history[i]);
+    }
+    E.undo_history_len = 0;
+    E.undo_history_idx = 0;
+    E.undo_saved_idx = 0;
+}
+
+void editor_undo() {
+    // Skip over records whose edit turned out to be a no-op.
+    while (E.undo_history_idx > 0 && E.undo_history[E.undo_history_idx - 1].num_ops == 0) {
+        editor_free_undo_record(&E.undo_history[E.undo_history_idx - 1]);
+        E.undo_history_idx--;
+        E.undo_history_len = E.undo_history_idx;
+    }
+
+    if (E.undo_history_idx <= 0) {
+        editor_set_status_message("Nothing to undo.");
+        return;
+    }
+
+    E.undo_history_idx--;
+
+    UndoRecord *record = &E.undo_history[E.undo_history_idx];
+
+    for (int i = record->num_ops - 1; i >= 0; i--) {
+        UndoOp *op = &record->ops[i];
+        if (op->type == UNDO_INSERT) {
+            int end_row = op->row;
+            int end_col = op->col;
+            for (size_t j = 0; j < op->len; j++) {
+                if (op->text[j] == '\n') {
+                    end_row++;
+                    end_col = 0;
+                } else {
+                    end_col++;
+                }
+            }
+            editor_delete_text(op->row, op->col, end_row, end_col);
+        } else if (op->type == UNDO_REPLACE) {
+            editor_undo_replace(op);
+        } else {
+            editor_insert_text(op->row, op->col, op->text, op->len, NULL, NULL);
+        }
+    }
+
+    E.cx = record->cx;
+    E.cy = record->cy;
+    if (E.cy >= E.num_lines) E.cy = E.num_lines > 0 ? E.num_lines - 1 : 0;
+    E.dirty = (E.undo_history_idx != E.undo_saved_idx);
+
+    editor_set_status_message("Undo successful.");
+}